@@ -1,8 +1,83 @@
 #include "at45db161d.h"
+#include <string.h>
 #include "wirish.h"
+#include "spi.h"
 
-#define DF_CS_deselect() gpio_write_bit(m_chipSelectGPIO, m_chipSelectPin, 1)
-#define DF_CS_select() gpio_write_bit(m_chipSelectGPIO, m_chipSelectPin, 0)
+#ifdef DATAFLASH_STATS_ENABLED
+#define DF_STAT(statement) statement
+#else
+#define DF_STAT(statement)
+#endif
+
+#ifdef DATAFLASH_TRACE_ENABLED
+#define DF_TRACE(opcode) TraceCommand(opcode)
+#define DF_TRACE_ADDRESS(address) do { if(m_traceEntry) m_traceEntry->command |= (address) & 0xFFFFFF; } while(0)
+#define DF_TRACE_BYTES(count) do { if(m_traceEntry) m_traceEntry->length += (count); } while(0)
+#define DF_TRACE_END() do { if(m_traceEntry) { m_traceEntry->end = micros(); m_traceEntry = NULL; } } while(0)
+#else
+#define DF_TRACE(opcode)
+#define DF_TRACE_ADDRESS(address)
+#define DF_TRACE_BYTES(count)
+#define DF_TRACE_END()
+#endif
+
+#define DF_CS_deselect() do { gpio_write_bit(m_chipSelectGPIO, m_chipSelectPin, 1); DF_TRACE_END(); } while(0)
+/* Selecting the device resumes it from Deep Power-down first, which
+ * busy-waits t_RDPD in whatever context the command runs */
+#define DF_CS_select() do { \
+	if(m_powerDown) ResumeFromDeepPowerDown(); \
+	if(m_powerDownTimeout) m_lastCommand = micros(); \
+	DF_STAT(m_stats.csToggles++); gpio_write_bit(m_chipSelectGPIO, m_chipSelectPin, 0); } while(0)
+
+/** Instance owning the DMA channels of each SPI port **/
+static AT45DB161D *dataflash_dma_owner[3];
+
+/** Source of the dummy bytes clocked out during DMA reads **/
+static uint8_t dataflash_dma_dummy = 0xFF;
+/** Sink of the bytes clocked in during DMA writes **/
+static uint8_t dataflash_dma_sink;
+
+/**
+ * Opcodes of the commands working on a buffer, indexed by buffer
+ * number - 1 rather than branching on it.
+ **/
+static const uint8_t dataflash_buffer_read[2] = { AT45DB161D_BUFFER_1_READ_LOW_FREQ, AT45DB161D_BUFFER_2_READ_LOW_FREQ };
+static const uint8_t dataflash_buffer_write[2] = { AT45DB161D_BUFFER_1_WRITE, AT45DB161D_BUFFER_2_WRITE };
+static const uint8_t dataflash_page_to_buffer[2] = { AT45DB161D_TRANSFER_PAGE_TO_BUFFER_1, AT45DB161D_TRANSFER_PAGE_TO_BUFFER_2 };
+static const uint8_t dataflash_page_through_buffer[2] = { AT45DB161D_PAGE_THROUGH_BUFFER_1, AT45DB161D_PAGE_THROUGH_BUFFER_2 };
+static const uint8_t dataflash_compare_page_to_buffer[2] = { AT45DB161D_COMPARE_PAGE_TO_BUFFER_1, AT45DB161D_COMPARE_PAGE_TO_BUFFER_2 };
+static const uint8_t dataflash_auto_page_rewrite[2] = { AT45DB161D_AUTO_PAGE_REWRITE_THROUGH_BUFFER_1, AT45DB161D_AUTO_PAGE_REWRITE_THROUGH_BUFFER_2 };
+/** Buffer to page program, without and with built-in erase **/
+static const uint8_t dataflash_buffer_to_page[2][2] =
+{
+	{ AT45DB161D_BUFFER_1_TO_PAGE_WITHOUT_ERASE, AT45DB161D_BUFFER_2_TO_PAGE_WITHOUT_ERASE },
+	{ AT45DB161D_BUFFER_1_TO_PAGE_WITH_ERASE, AT45DB161D_BUFFER_2_TO_PAGE_WITH_ERASE }
+};
+
+/**
+ * Geometry of the DataFlash parts, by density code of the status
+ * register. Byte addresses take one bit less in binary page mode.
+ **/
+#define DATAFLASH_GEOMETRY(part) \
+	{ part::DENSITY, part::PAGE_SIZE, part::PAGE_COUNT, part::SECTOR_PAGES, part::OFFSET_BITS }
+
+static const struct
+{
+	uint8_t density;		/**< Status register bits 5-2 **/
+	uint16_t pageSize;		/**< Standard page size **/
+	uint16_t pageCount;		/**< Number of pages **/
+	uint16_t sectorPages;	/**< Pages per sector **/
+	uint8_t offsetBits;		/**< Byte address bits in standard mode **/
+} dataflash_geometries[] =
+{
+	DATAFLASH_GEOMETRY(dataflash_at45db011d),
+	DATAFLASH_GEOMETRY(dataflash_at45db021d),
+	DATAFLASH_GEOMETRY(dataflash_at45db041d),
+	DATAFLASH_GEOMETRY(dataflash_at45db081d),
+	DATAFLASH_GEOMETRY(dataflash_at45db161d),
+	DATAFLASH_GEOMETRY(dataflash_at45db321d),
+	DATAFLASH_GEOMETRY(dataflash_at45db642d)
+};
 
 /**
  * Constructor. Calls the corresponding begin function with pin definitions.
@@ -12,6 +87,7 @@
 AT45DB161D::AT45DB161D(HardwareSPI *spi)
 {
 	m_SPI = spi;
+	InitState();
 	
 	begin(DATAFLASH_DEFAULT_CS, DATAFLASH_DEFAULT_RESET, DATAFLASH_DEFAULT_WP);
 }
@@ -27,6 +103,7 @@ AT45DB161D::AT45DB161D(HardwareSPI *spi)
 AT45DB161D::AT45DB161D(HardwareSPI *spi, uint8_t csPin, uint8_t resetPin, uint8_t wpPin)
 {
 	m_SPI = spi;
+	InitState();
 	
 	begin(csPin, resetPin, wpPin);
 }
@@ -44,6 +121,7 @@ AT45DB161D::AT45DB161D(HardwareSPI *spi, uint8_t csPin, uint8_t resetPin, uint8_
 AT45DB161D::AT45DB161D(HardwareSPI *spi, gpio_dev *cs_dev, uint8_t cs_pin, gpio_dev *reset_dev, uint8_t reset_pin, gpio_dev *wp_dev, uint8_t wp_pin)
 {
 	m_SPI = spi;
+	InitState();
 	
 	begin(cs_dev, cs_pin, reset_dev, reset_pin, wp_dev, wp_pin);
 }
@@ -56,6 +134,60 @@ AT45DB161D::~AT45DB161D()
 	m_SPI = NULL;	
 }
 	
+/**
+ * Put the driver state in its power-on condition.
+ **/
+void AT45DB161D::InitState()
+{
+	m_dmaDev = NULL;
+	m_dmaRx = NULL;
+	m_dmaTx = NULL;
+	m_dmaRemaining = 0;
+	m_dmaStatus = DATAFLASH_DMA_IDLE;
+	m_dmaHandler = NULL;
+	m_dmaContext = NULL;
+	m_dmaHold = false;
+
+	m_streamBuffer = DATAFLASH_BUFFER1;
+	m_streamPage = 0;
+	m_streamOffset = 0;
+	m_streamErase = 0;
+
+#ifdef DATAFLASH_STATS_ENABLED
+	ResetStats();
+#endif
+#ifdef DATAFLASH_TRACE_ENABLED
+	ClearTrace();
+#endif
+
+	m_operation.type = DATAFLASH_OP_NONE;
+	m_operation.address = 0;
+	m_operation.started = 0;
+	m_operation.expected = 0;
+	m_operation.completed = 0;
+	m_operation.status = 0;
+	m_operation.pending = false;
+	m_operation.buffer = 0;
+
+	m_programHandler = NULL;
+	m_programContext = NULL;
+
+	m_powerDown = false;
+	m_powerDownTimeout = 0;
+	m_lastCommand = 0;
+
+	/* AT45DB161D in standard mode until the status register tells */
+	m_pageSize = DATAFLASH_PAGE_SIZE;
+	m_pageCount = DATAFLASH_PAGE_COUNT;
+	m_sectorPages = DATAFLASH_SECTOR_PAGES;
+	m_offsetBits = 10;
+	m_binaryPages = false;
+	m_geometryKnown = false;
+	m_geometryFixed = false;
+
+	InvalidateBuffers();
+}
+
 /** 
  * Setup pinout for DataFlash using wirish pin numbers.
  * @param csPin Chip select (Slave select) pin (CS)
@@ -143,6 +275,9 @@ void AT45DB161D::begin(gpio_dev *cs_dev, uint8_t cs_pin, gpio_dev *reset_dev, ui
 			
 	/* Enable device */
   	DF_CS_select();
+
+	/* SPI may not be set up yet, the first command reads the geometry */
+	m_geometryKnown = m_geometryFixed;
 }
 
 /**
@@ -167,11 +302,15 @@ uint8_t AT45DB161D::ReadStatusRegister()
 	DF_CS_select();      /* to reset Dataflash command decoder     */
   
     /* Send status read command */
+	DF_TRACE(AT45DB161D_STATUS_REGISTER_READ);
 	m_SPI->transfer(AT45DB161D_STATUS_REGISTER_READ);
 	
 	/* Get result with a dummy write */
 	status = m_SPI->transfer(0x00);
 
+	DF_STAT(m_stats.statusReads++);
+	DF_STAT(m_stats.statusPolls++);
+
 	return status;
 }
 
@@ -180,11 +319,201 @@ uint8_t AT45DB161D::ReadStatusRegister()
  **/
 void AT45DB161D::WaitForReady()
 {
+#ifdef DATAFLASH_STATS_ENABLED
+	uint32_t start = micros();
+#endif
 	uint8_t status = ReadStatusRegister();
 		
 	while(!(status & DATAFLASH_STATUS_READY_BUSY))
 	{
 		status = m_SPI->transfer(0x00);
+		DF_STAT(m_stats.statusPolls++);
+	}
+
+#ifdef DATAFLASH_STATS_ENABLED
+	CountWait(micros() - start);
+#endif
+
+	CompleteOperation(status);
+}
+
+#ifdef DATAFLASH_STATS_ENABLED
+/**
+ * Account for a wait for the chip, and for a compare if that is what
+ * was waited for.
+ * @param elapsed Duration of the wait in microseconds
+ **/
+void AT45DB161D::CountWait(uint32_t elapsed)
+{
+	m_stats.waits++;
+	m_stats.waitTime += elapsed;
+	if(elapsed > m_stats.waitMax)
+		m_stats.waitMax = elapsed;
+
+	if(m_operation.pending && m_operation.type == DATAFLASH_OP_COMPARE)
+	{
+		m_stats.compareWaitTime += elapsed;
+		if(elapsed > m_stats.compareWaitMax)
+			m_stats.compareWaitMax = elapsed;
+	}
+}
+
+/**
+ * Copy the performance counters.
+ * @param stats Snapshot to fill
+ **/
+void AT45DB161D::GetStats(struct AT45DB161D::Stats *stats)
+{
+	*stats = m_stats;
+}
+
+/**
+ * Set the performance counters back to zero.
+ **/
+void AT45DB161D::ResetStats()
+{
+	memset(&m_stats, 0, sizeof(m_stats));
+}
+#endif
+
+#ifdef DATAFLASH_TRACE_ENABLED
+/**
+ * Open a trace entry for a command, in the slot of the oldest one. It
+ * is closed by the release of CS.
+ * @param opcode Opcode about to be sent
+ **/
+void AT45DB161D::TraceCommand(uint8_t opcode)
+{
+	struct TraceEntry *entry = &m_trace[m_traceNext++ & (DATAFLASH_TRACE_SIZE - 1)];
+
+	entry->start = micros();
+	entry->end = 0;
+	entry->command = (uint32_t)opcode << 24;
+	entry->length = 0;
+	m_traceEntry = entry;
+}
+
+/**
+ * Print the command trace, oldest first. A header line starting with
+ * '#' gives the page geometry, then each command takes a line with its
+ * start and end time in microseconds, opcode, address and length:
+ *     T 1234567 1234580 84 000000 528
+ * @param out Where to print, a serial port usually
+ **/
+void AT45DB161D::DumpTrace(Print *out)
+{
+	uint32_t count = (m_traceNext < DATAFLASH_TRACE_SIZE) ? m_traceNext : DATAFLASH_TRACE_SIZE;
+
+	out->print("# dataflash trace entries ");
+	out->print(count);
+	out->print(" page_size ");
+	out->print(m_pageSize);
+	out->print(" offset_bits ");
+	out->println(m_offsetBits);
+
+	for(uint32_t i = m_traceNext - count; i != m_traceNext; i++)
+	{
+		const struct TraceEntry *entry = &m_trace[i & (DATAFLASH_TRACE_SIZE - 1)];
+
+		out->print("T ");
+		out->print(entry->start);
+		out->print(' ');
+		out->print(entry->end);
+		out->print(' ');
+		out->print(entry->command >> 24, HEX);
+		out->print(' ');
+		out->print(entry->command & 0xFFFFFF, HEX);
+		out->print(' ');
+		out->println(entry->length);
+	}
+}
+
+/**
+ * Forget the commands traced so far.
+ **/
+void AT45DB161D::ClearTrace()
+{
+	m_traceNext = 0;
+	m_traceEntry = NULL;
+}
+#endif
+
+/**
+ * Record the start of a self-timed operation. Waits for the end of the
+ * previous one first, as the chip ignores commands while busy.
+ * @param type Operation about to be started
+ * @param address Page, block or sector it works on
+ * @param expected Typical duration in microseconds
+ * @param bufferNum Buffer it uses (1 or 2), or 0 if none
+ **/
+void AT45DB161D::BeginOperation(dataflash_op type, uint16_t address, uint32_t expected, uint8_t bufferNum)
+{
+	if(m_operation.pending)
+		WaitForReady();
+
+	DF_STAT(m_stats.operations[type]++);
+
+	m_operation.type = type;
+	m_operation.address = address;
+	m_operation.expected = expected;
+	m_operation.started = micros();
+	m_operation.pending = true;
+	m_operation.buffer = bufferNum;
+
+	if(m_programHandler && type != DATAFLASH_OP_PAGE_TO_BUFFER && type != DATAFLASH_OP_COMPARE)
+		m_programHandler(m_programContext, type, address);
+}
+
+/**
+ * Wait for the end of the pending operation if it uses a buffer. The
+ * chip ignores accesses to that buffer until then, the other one stays
+ * available.
+ * @param bufferNum Buffer about to be accessed
+ **/
+void AT45DB161D::WaitForBuffer(dataflash_buffer bufferNum)
+{
+	if(m_operation.pending && m_operation.buffer == bufferNum)
+		WaitForReady();
+}
+
+/**
+ * Wait for the end of the pending operation, whatever it is, before a
+ * main memory read. The chip ignores reads of the array while busy,
+ * even those of pages the operation doesn't touch.
+ **/
+void AT45DB161D::WaitForMainMemory()
+{
+	if(m_operation.pending)
+		WaitForReady();
+}
+
+/**
+ * Forget the buffers mirroring pages about to change in main memory.
+ * Changes written to the buffers are kept.
+ * @param first First page
+ * @param count Number of pages
+ **/
+void AT45DB161D::InvalidatePages(uint16_t first, uint16_t count)
+{
+	for(uint8_t i = 0; i < 2; i++)
+	{
+		if(m_bufferPage[i] != DATAFLASH_NO_PAGE && (uint16_t)(m_bufferPage[i] - first) < count)
+			m_bufferPage[i] = DATAFLASH_NO_PAGE;
+	}
+}
+
+/**
+ * Record the end of the pending operation, if any.
+ * @param status Status register value showing the chip ready
+ **/
+void AT45DB161D::CompleteOperation(uint8_t status)
+{
+	m_operation.status = status;
+
+	if(m_operation.pending)
+	{
+		m_operation.completed = micros();
+		m_operation.pending = false;
 	}
 }
 
@@ -202,6 +531,7 @@ void AT45DB161D::ReadManufacturerAndDeviceID(struct AT45DB161D::ID *id)
 	DF_CS_select();      /* to reset Dataflash command decoder     */
   
     /* Send status read command */
+	DF_TRACE(AT45DB161D_READ_MANUFACTURER_AND_DEVICE_ID);
 	m_SPI->transfer(AT45DB161D_READ_MANUFACTURER_AND_DEVICE_ID);
 
 	/* Manufacturer ID */
@@ -215,6 +545,123 @@ void AT45DB161D::ReadManufacturerAndDeviceID(struct AT45DB161D::ID *id)
 	
 }
 
+/**
+ * Read the page size mode and the density from the status register
+ * and switch to the matching geometry and address encoding. Done
+ * by the first command after begin(), once SPI is set up.
+ * AT45DB instances have their geometry fixed instead.
+ * The device is resumed from Deep Power-down first, where an earlier
+ * run may have left it: the command does nothing to a device awake.
+ * @return false if the density is unknown, the geometry is left as is
+ *         and detected again by the next command
+ **/
+bool AT45DB161D::DetectGeometry()
+{
+	uint8_t status;
+
+	ResumeFromDeepPowerDown();
+
+	status = ReadStatusRegister();
+
+	DF_CS_deselect();	/* Release SPI bus */
+
+	/* Nothing answering: the addresses of another geometry would send
+	 * every write elsewhere, so nothing is settled */
+	if(status == 0x00 || status == 0xFF)
+		return false;
+
+	for(uint8_t i = 0; i < sizeof(dataflash_geometries) / sizeof(dataflash_geometries[0]); i++)
+	{
+		if(dataflash_geometries[i].density != (status & DATAFLASH_STATUS_DENSITY_MASK))
+			continue;
+
+		uint16_t pageSize = dataflash_geometries[i].pageSize;
+		uint8_t offsetBits = dataflash_geometries[i].offsetBits;
+
+		/* 256, 512 or 1024 bytes, one address bit less */
+		if(status & DATAFLASH_STATUS_PAGE_SIZE)
+		{
+			offsetBits--;
+			pageSize = 1 << offsetBits;
+		}
+
+		/* Buffer contents mean something else with another page size */
+		if(pageSize != m_pageSize)
+			InvalidateBuffers();
+
+		m_binaryPages = (status & DATAFLASH_STATUS_PAGE_SIZE) != 0;
+		m_pageSize = pageSize;
+		m_offsetBits = offsetBits;
+		m_pageCount = dataflash_geometries[i].pageCount;
+		m_sectorPages = dataflash_geometries[i].sectorPages;
+		m_geometryKnown = true;
+
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Set the geometry once and for all, in place of DetectGeometry.
+ * @param pageSize Bytes per page
+ * @param pageCount Number of pages
+ * @param sectorPages Pages per sector
+ * @param offsetBits Address bits of the byte within a page
+ * @param binary Pages in "power of 2" binary mode
+ **/
+void AT45DB161D::SetGeometry(uint16_t pageSize, uint16_t pageCount, uint16_t sectorPages, uint8_t offsetBits, bool binary)
+{
+	m_pageSize = pageSize;
+	m_pageCount = pageCount;
+	m_sectorPages = sectorPages;
+	m_offsetBits = offsetBits;
+	m_binaryPages = binary;
+	m_geometryKnown = true;
+	m_geometryFixed = true;
+
+	InvalidateBuffers();
+}
+
+/**
+ * Split a linear byte address of the main memory into page and
+ * offset. Shifts are enough in binary page mode.
+ * @param address Byte address, from 0 to PageCount() * PageSize() - 1
+ * @param page Set to the page
+ * @param offset Set to the byte within the page
+ **/
+void AT45DB161D::LinearToPage(uint32_t address, uint16_t *page, uint16_t *offset)
+{
+	CheckGeometry();
+
+	if(m_binaryPages)
+	{
+		*page = (uint16_t)(address >> m_offsetBits);
+		*offset = (uint16_t)(address & (m_pageSize - 1));
+	}
+	else
+	{
+		*page = (uint16_t)(address / m_pageSize);
+		*offset = (uint16_t)(address % m_pageSize);
+	}
+}
+
+/**
+ * Send the 3 address bytes of a page and a byte within it. The page
+ * number is followed by as many bits as needed to address a byte of
+ * a page: 10 for 528 byte pages, 9 for 512 byte pages.
+ **/
+void AT45DB161D::SendAddress(uint16_t page, uint16_t offset)
+{
+	uint32_t address = ((uint32_t)page << m_offsetBits) | offset;
+
+	DF_TRACE_ADDRESS(address);
+
+	m_SPI->transfer((uint8_t)(address >> 16));
+	m_SPI->transfer((uint8_t)(address >> 8));
+	m_SPI->transfer((uint8_t)address);
+}
+
 /** 
  * Main Memory Page Read. 
  * A main memory page read allows the user to read data directly from
@@ -226,16 +673,19 @@ void AT45DB161D::ReadManufacturerAndDeviceID(struct AT45DB161D::ID *id)
  **/
 void AT45DB161D::ReadMainMemoryPage(uint16_t page, uint16_t offset)
 {
+	CheckGeometry();
+	WaitForMainMemory();
+
 	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
 	DF_CS_select();      /* to reset Dataflash command decoder     */
 
 	/* Send opcode */
+	DF_TRACE(AT45DB161D_PAGE_READ);
 	m_SPI->transfer(AT45DB161D_PAGE_READ);
+	DF_STAT(m_stats.pageReads++);
 	
 	/* Address (page | offset)  */
-	m_SPI->transfer((uint8_t)(page >> 6));
-	m_SPI->transfer((uint8_t)((page << 2) | (offset >> 8)));
-	m_SPI->transfer((uint8_t)(offset & 0xff));
+	SendAddress(page, offset);
 	
 	/* 4 "don't care" bytes */
 	m_SPI->transfer(0x00);
@@ -253,16 +703,19 @@ void AT45DB161D::ReadMainMemoryPage(uint16_t page, uint16_t offset)
  **/
 void AT45DB161D::ContinuousArrayRead(uint16_t page, uint16_t offset)
 {
+	CheckGeometry();
+	WaitForMainMemory();
+
 	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
 	DF_CS_select();      /* to reset Dataflash command decoder     */
 
 	/* Send opcode */
+	DF_TRACE(AT45DB161D_CONTINUOUS_READ_LOW_FREQ);
 	m_SPI->transfer(AT45DB161D_CONTINUOUS_READ_LOW_FREQ);
+	DF_STAT(m_stats.arrayReads++);
 
 	/* Address (page | offset)  */
-	m_SPI->transfer((uint8_t)(page >> 6));
-	m_SPI->transfer((uint8_t)((page << 2) | (offset >> 8)));
-	m_SPI->transfer((uint8_t)(offset & 0xff));
+	SendAddress(page, offset);
 }
 
 
@@ -273,18 +726,15 @@ void AT45DB161D::ContinuousArrayRead(uint16_t page, uint16_t offset)
  **/
 void AT45DB161D::BufferRead(dataflash_buffer bufferNum, uint16_t offset)
 {
+	WaitForBuffer(bufferNum);
+
 	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
 	DF_CS_select();      /* to reset Dataflash command decoder     */
 
 	/* Send opcode */
-	if(bufferNum == DATAFLASH_BUFFER1)
-	{
-		m_SPI->transfer(AT45DB161D_BUFFER_1_READ_LOW_FREQ);
-	}
-	else
-	{
-		m_SPI->transfer(AT45DB161D_BUFFER_2_READ_LOW_FREQ);
-	}
+	DF_TRACE(dataflash_buffer_read[bufferNum - 1]);
+	m_SPI->transfer(dataflash_buffer_read[bufferNum - 1]);
+	DF_STAT(m_stats.bufferReads++);
 	
 	/* 14 "Don't care" bits */
 	m_SPI->transfer(0x00);
@@ -292,6 +742,8 @@ void AT45DB161D::BufferRead(dataflash_buffer bufferNum, uint16_t offset)
 	m_SPI->transfer((uint8_t)(offset >> 8));
 	/* bits 7-0 of the offset */
 	m_SPI->transfer((uint8_t)(offset & 0xff));
+
+	DF_TRACE_ADDRESS(offset);
 }
 
 /** 
@@ -305,18 +757,18 @@ void AT45DB161D::BufferRead(dataflash_buffer bufferNum, uint16_t offset)
  **/
 void AT45DB161D::BufferWrite(dataflash_buffer bufferNum, uint16_t offset)
 {
+	WaitForBuffer(bufferNum);
+
 	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
 	DF_CS_select();      /* to reset Dataflash command decoder     */
 
+	/* The buffer no longer matches the page it mirrors */
+	m_bufferDirty[bufferNum - 1] = true;
+
 	/* Send opcode */
-	if(bufferNum == DATAFLASH_BUFFER1)
-	{
-		m_SPI->transfer(AT45DB161D_BUFFER_1_WRITE);
-	}
-	else
-	{
-		m_SPI->transfer(AT45DB161D_BUFFER_2_WRITE);
-	}
+	DF_TRACE(dataflash_buffer_write[bufferNum - 1]);
+	m_SPI->transfer(dataflash_buffer_write[bufferNum - 1]);
+	DF_STAT(m_stats.bufferWrites++);
 	
 	/* 14 "Don't care" bits */
 	m_SPI->transfer(0x00);
@@ -324,268 +776,1309 @@ void AT45DB161D::BufferWrite(dataflash_buffer bufferNum, uint16_t offset)
 	m_SPI->transfer((uint8_t)(offset >> 8));
 	/* bits 7-0 of the offset */
 	m_SPI->transfer((uint8_t)(offset & 0xff));
+
+	DF_TRACE_ADDRESS(offset);
 }
 
 /**
- * Transfer data from buffer 1 or 2 to main memory page.
- * @param bufferNum Buffer to use (1 or 2)
- * @param page Page where the content of the buffer will transfered
- * @param erase If set the page will be first erased before the buffer transfer.
- * @note If erase is equal to zero, the page must have been previously erased using one of the erase command (Page or Block Erase).
+ * Read a span of main memory into RAM using a Continuous Array
+ * Read. The read runs across page boundaries and wraps from the
+ * last page back to the first one.
+ * @param page Page of the main memory where the read starts
+ * @param offset Starting byte address within the page
+ * @param dst Destination, at least len bytes
+ * @param len Number of bytes to read
  **/
-void AT45DB161D::BufferToPage(dataflash_buffer bufferNum, uint16_t page, uint8_t erase)
+void AT45DB161D::Read(uint16_t page, uint16_t offset, uint8_t *dst, size_t len)
 {
-	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
-	DF_CS_select();      /* to reset Dataflash command decoder     */
-	
-	uint8_t opcode;
-
-	/* Opcode */
-	if(erase)
-	{
-		opcode = (bufferNum == DATAFLASH_BUFFER1) ? AT45DB161D_BUFFER_1_TO_PAGE_WITH_ERASE : AT45DB161D_BUFFER_2_TO_PAGE_WITH_ERASE;
-	}
-	else
-	{
-		opcode = (bufferNum == DATAFLASH_BUFFER1) ? AT45DB161D_BUFFER_1_TO_PAGE_WITHOUT_ERASE : AT45DB161D_BUFFER_2_TO_PAGE_WITHOUT_ERASE;
-	}
-	
-	m_SPI->transfer(opcode);
-	
-	/*
-	 * 3 address bytes consist of :
-	 *     - 2 don’t care bits
-	 *     - 12 page address bits (PA11 - PA0) that specify the page in 
-	 *       the main memory to be written
-	 *     - 10 don’t care bits
-	 */
-	m_SPI->transfer((uint8_t)(page >> 6));
-	m_SPI->transfer((uint8_t)(page << 2));
-	m_SPI->transfer(0x00);
-	
-	DF_CS_deselect();  /* Start transfer */
-	DF_CS_select();    /* If erase was set, the page will first be erased */
-
-	WaitForReady();
+	ContinuousArrayRead(page, offset);
+	ReceiveBytes(dst, len);
 
+	DF_CS_deselect();	/* End of the read */
 }
 
 /**
- * Transfer a page of data from main memory to buffer 1 or 2.
- * @param page Main memory page to transfer
- * @param bufferNum Buffer (1 or 2) where the data will be written
+ * Read several ranges of main memory. Ranges are taken in address
+ * order, and those less than DATAFLASH_READV_MAX_GAP bytes apart are
+ * read with one Continuous Array Read, the bytes between them being
+ * clocked in and dropped. Ranges may overlap: bytes already received
+ * for a previous range are copied from its destination.
+ * @param ranges Ranges to read, in any order
+ * @param n Number of ranges
+ * @note Ordering costs n * n comparisons, meant for tens of ranges.
  **/
-void AT45DB161D::PageToBuffer(uint16_t page, dataflash_buffer bufferNum)
+void AT45DB161D::ReadV(const struct AT45DB161D::ReadRange *ranges, size_t n)
 {
-	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
-	DF_CS_select();      /* to reset Dataflash command decoder     */
- 
-	/* Send opcode */
-	if(bufferNum == DATAFLASH_BUFFER1)
-	{
-		m_SPI->transfer(AT45DB161D_TRANSFER_PAGE_TO_BUFFER_1);
-	}
-	else
+	const struct ReadRange *prev = NULL;
+	const struct ReadRange *cover = NULL;	/* Range the stream reached the end of */
+	uint32_t prevStart = 0, coverStart = 0;
+	uint32_t position = 0;					/* Next byte delivered by the stream */
+
+	CheckGeometry();
+
+	for(size_t done = 0; done < n; done++)
 	{
-		m_SPI->transfer(AT45DB161D_TRANSFER_PAGE_TO_BUFFER_2);
-	}
+		const struct ReadRange *range = NULL;
+		uint32_t start = 0;
 
-	/*
-	 * 3 address bytes consist of :
-	 *     - 2 don’t care bits
-	 *     - 12 page address bits (PA11 - PA0) that specify the page in 
-	 *       the main memory to be written
-	 *     - 10 don’t care bits
-	 */
-	m_SPI->transfer((uint8_t)(page >> 6));
-	m_SPI->transfer((uint8_t)(page << 2));
-	m_SPI->transfer(0x00);
-		
-	DF_CS_deselect();  /* Start page transfer */
-	DF_CS_select();
+		/* Next range by address, then by index for equal addresses */
+		for(size_t i = 0; i < n; i++)
+		{
+			uint32_t address = (uint32_t)ranges[i].page * m_pageSize + ranges[i].offset;
 
-	/* Wait for the end of the transfer */
-	WaitForReady();
+			if(prev && (address < prevStart || (address == prevStart && &ranges[i] <= prev)))
+				continue;
+			if(range && address >= start)
+				continue;
 
-}
+			range = &ranges[i];
+			start = address;
+		}
 
-/** 
- * Erase a page in the main memory array.
- * @param page Page to erase
- **/
-void AT45DB161D::PageErase(uint16_t page)
-{
-	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
-	DF_CS_select();      /* to reset Dataflash command decoder     */
+		prev = range;
+		prevStart = start;
 
-	/* Send opcode */
-	m_SPI->transfer(AT45DB161D_PAGE_ERASE);
-	
-	/*
-	 * 3 address bytes consist of :
-	 *     - 2 don’t care bits
-	 *     - 12 page address bits (PA11 - PA0) that specify the page in 
-	 *       the main memory to be written
-	 *     - 10 don’t care bits
-	 */
-	m_SPI->transfer((uint8_t)(page >> 6));
-	m_SPI->transfer((uint8_t)(page << 2));
-	m_SPI->transfer(0x00);
-		
-	DF_CS_deselect();  /* Start block erase */
-	DF_CS_select();
+		if(range->len == 0)
+			continue;
 
-	/* Wait for the end of the block erase operation */
-	WaitForReady();
+		uint32_t end = start + range->len;
 
+		if(cover && start <= position + DATAFLASH_READV_MAX_GAP)
+		{
+			if(start < position)
+			{
+				/* Already received for the cover range */
+				uint32_t count = ((end < position) ? end : position) - start;
+				memcpy(range->dst, cover->dst + (start - coverStart), count);
+			}
+			else
+			{
+				SkipBytes(start - position);
+				position = start;
+			}
+		}
+		else
+		{
+			uint16_t page, offset;
+
+			if(cover)
+				DF_CS_deselect();	/* End of the previous stream */
+
+			LinearToPage(start, &page, &offset);
+			ContinuousArrayRead(page, offset);
+			position = start;
+		}
+
+		if(end > position)
+		{
+			ReceiveBytes(range->dst + (position - start), end - position);
+			position = end;
+			cover = range;
+			coverStart = start;
+		}
+	}
+
+	if(cover)
+		DF_CS_deselect();	/* End of the read */
 }
 
 /**
- * Erase a block of eight pages at one time.
- * @param block Index of the block to erase
+ * Read a span of one of the SRAM data buffers into RAM. The read
+ * wraps around to the beginning of the buffer.
+ * @param bufferNum Buffer to read (1 or 2)
+ * @param offset Starting byte within the buffer
+ * @param dst Destination, at least len bytes
+ * @param len Number of bytes to read
  **/
-void AT45DB161D::BlockErase(uint16_t block)
+void AT45DB161D::ReadBuffer(dataflash_buffer bufferNum, uint16_t offset, uint8_t *dst, size_t len)
 {
+	BufferRead(bufferNum, offset);
+	ReceiveBytes(dst, len);
+
+	DF_CS_deselect();	/* End of the read */
+}
+
+/**
+ * Write a span of RAM to one of the SRAM data buffers. The write
+ * wraps around to the beginning of the buffer.
+ * @param bufferNum Buffer to write (1 or 2)
+ * @param offset Starting byte within the buffer
+ * @param src Source, at least len bytes
+ * @param len Number of bytes to write
+ **/
+void AT45DB161D::WriteBuffer(dataflash_buffer bufferNum, uint16_t offset, const uint8_t *src, size_t len)
+{
+	BufferWrite(bufferNum, offset);
+	SendBytes(src, len);
+
+	DF_CS_deselect();	/* End of the write */
+}
+
+/**
+ * Clock len bytes in from the device, sending dummy bytes.
+ * Talks to the SPI registers directly: a HardwareSPI::transfer call
+ * per byte costs several times the wire time of the byte itself.
+ **/
+void AT45DB161D::ReceiveBytes(uint8_t *dst, size_t len)
+{
+	spi_dev *spi = m_SPI->c_dev();
+
+	DF_STAT(m_stats.bytesRead += len);
+	DF_TRACE_BYTES(len);
+
+	while(len--)
+	{
+		spi_tx_reg(spi, 0xFF);
+		while(!spi_is_rx_nonempty(spi));
+		*dst++ = (uint8_t)spi_rx_reg(spi);
+	}
+}
+
+/**
+ * Clock len bytes in from the device and drop them.
+ **/
+void AT45DB161D::SkipBytes(size_t len)
+{
+	spi_dev *spi = m_SPI->c_dev();
+
+	DF_STAT(m_stats.bytesRead += len);
+	DF_TRACE_BYTES(len);
+
+	while(len--)
+	{
+		spi_tx_reg(spi, 0xFF);
+		while(!spi_is_rx_nonempty(spi));
+		spi_rx_reg(spi);
+	}
+}
+
+/**
+ * Clock len bytes out to the device, discarding what comes back.
+ **/
+void AT45DB161D::SendBytes(const uint8_t *src, size_t len)
+{
+	spi_dev *spi = m_SPI->c_dev();
+
+	DF_STAT(m_stats.bytesWritten += len);
+	DF_TRACE_BYTES(len);
+
+	m_SPI->write(src, len);
+
+	/* Wait for the last byte to leave the shift register */
+	while(!spi_is_tx_empty(spi));
+	while(spi_is_busy(spi));
+
+	/* HardwareSPI::write doesn't read the bytes clocked in meanwhile.
+	 * Reading DR then SR drops the stale byte and clears the overrun
+	 * flag, otherwise the next transfer() would return stale data. */
+	spi_rx_reg(spi);
+	spi_is_rx_nonempty(spi);
+}
+
+/**
+ * Start a DMA read of a span of main memory using a Continuous
+ * Array Read. Returns at once; the transfer completes in the
+ * background and releases CS when done.
+ * @param page Page of the main memory where the read starts
+ * @param offset Starting byte address within the page
+ * @param dst Destination, at least len bytes, valid until the end of the transfer
+ * @param len Number of bytes to read
+ * @return false if the transfer could not be started
+ **/
+bool AT45DB161D::ReadDMA(uint16_t page, uint16_t offset, uint8_t *dst, size_t len)
+{
+	if(!SetupDMA())
+		return false;
+
+	ContinuousArrayRead(page, offset);
+	return StartDMA(dst, NULL, len);
+}
+
+/**
+ * Start a Continuous Array Read fed by DMA in several pieces. CS
+ * stays low between the pieces, each requested with ContinueReadDMA,
+ * so that the read goes on where the previous piece ended. The clock
+ * stops in between, which the device allows for as long as needed.
+ * @param page Page of the main memory where the read starts
+ * @param offset Starting byte address within the page
+ * @return false if DMA is not available
+ **/
+bool AT45DB161D::BeginReadDMA(uint16_t page, uint16_t offset)
+{
+	if(!SetupDMA())
+		return false;
+
+	ContinuousArrayRead(page, offset);
+	m_dmaHold = true;
+	m_dmaStatus = DATAFLASH_DMA_IDLE;
+	return true;
+}
+
+/**
+ * Read the next piece of the read started by BeginReadDMA. May be
+ * called from the DMA interrupt handler, once the previous piece has
+ * ended.
+ * @param dst Destination, at least len bytes, valid until the end of the transfer
+ * @param len Number of bytes to read
+ * @return false if no read is open or a transfer is running
+ **/
+bool AT45DB161D::ContinueReadDMA(uint8_t *dst, size_t len)
+{
+	if(!m_dmaHold || m_dmaStatus == DATAFLASH_DMA_BUSY)
+		return false;
+
+	return StartDMA(dst, NULL, len);
+}
+
+/**
+ * Wait for the current piece and end the read started by BeginReadDMA.
+ **/
+void AT45DB161D::EndReadDMA()
+{
+	WaitForDMA();
+
+	m_dmaHold = false;
+	DF_CS_deselect();	/* End of the read */
+}
+
+/**
+ * Start a DMA read of a main memory page, bypassing the buffers.
+ * The read wraps around within the page.
+ * @param page Page of the main memory to read
+ * @param offset Starting byte address within the page
+ * @param dst Destination, at least len bytes, valid until the end of the transfer
+ * @param len Number of bytes to read
+ * @return false if the transfer could not be started
+ **/
+bool AT45DB161D::ReadPageDMA(uint16_t page, uint16_t offset, uint8_t *dst, size_t len)
+{
+	if(!SetupDMA())
+		return false;
+
+	ReadMainMemoryPage(page, offset);
+	return StartDMA(dst, NULL, len);
+}
+
+/**
+ * Start a DMA read of one of the SRAM data buffers.
+ * @param bufferNum Buffer to read (1 or 2)
+ * @param offset Starting byte within the buffer
+ * @param dst Destination, at least len bytes, valid until the end of the transfer
+ * @param len Number of bytes to read
+ * @return false if the transfer could not be started
+ **/
+bool AT45DB161D::ReadBufferDMA(dataflash_buffer bufferNum, uint16_t offset, uint8_t *dst, size_t len)
+{
+	if(!SetupDMA())
+		return false;
+
+	BufferRead(bufferNum, offset);
+	return StartDMA(dst, NULL, len);
+}
+
+/**
+ * Start a DMA write to one of the SRAM data buffers.
+ * @param bufferNum Buffer to write (1 or 2)
+ * @param offset Starting byte within the buffer
+ * @param src Source, at least len bytes, valid until the end of the transfer
+ * @param len Number of bytes to write
+ * @return false if the transfer could not be started
+ **/
+bool AT45DB161D::WriteBufferDMA(dataflash_buffer bufferNum, uint16_t offset, const uint8_t *src, size_t len)
+{
+	if(!SetupDMA())
+		return false;
+
+	BufferWrite(bufferNum, offset);
+	return StartDMA(NULL, src, len);
+}
+
+/**
+ * Wait for the current DMA transfer to end.
+ * @return true if it completed without error
+ **/
+bool AT45DB161D::WaitForDMA()
+{
+	while(m_dmaStatus == DATAFLASH_DMA_BUSY);
+
+	return m_dmaStatus == DATAFLASH_DMA_DONE;
+}
+
+/**
+ * Call a handler from the DMA interrupt at the end of every transfer.
+ * @param handler Handler, or NULL to remove it
+ * @param context Passed to the handler
+ **/
+void AT45DB161D::AttachDMAInterrupt(dataflash_dma_handler handler, void *context)
+{
+	m_dmaHandler = handler;
+	m_dmaContext = context;
+}
+
+/**
+ * Look up the DMA channels serving our SPI port and route their
+ * interrupts to this instance. The channels are fixed by the SPI
+ * request lines (RM0008, tables 78 and 79). Fails if the port has no
+ * DMA or another instance on the same port has a transfer running.
+ **/
+bool AT45DB161D::SetupDMA()
+{
+	spi_dev *spi = m_SPI->c_dev();
+	voidFuncPtr handler;
+
+	if(m_dmaStatus == DATAFLASH_DMA_BUSY)
+		return false;
+
+	if(spi == SPI1)
+	{
+		m_dmaDev = DMA1;
+		m_dmaRxChannel = DMA_CH2;
+		m_dmaTxChannel = DMA_CH3;
+		m_dmaPort = 0;
+		handler = DMAInterruptSPI1;
+	}
+	else if(spi == SPI2)
+	{
+		m_dmaDev = DMA1;
+		m_dmaRxChannel = DMA_CH4;
+		m_dmaTxChannel = DMA_CH5;
+		m_dmaPort = 1;
+		handler = DMAInterruptSPI2;
+	}
+#ifdef STM32_HIGH_DENSITY
+	else if(spi == SPI3)
+	{
+		m_dmaDev = DMA2;
+		m_dmaRxChannel = DMA_CH1;
+		m_dmaTxChannel = DMA_CH2;
+		m_dmaPort = 2;
+		handler = DMAInterruptSPI3;
+	}
+#endif
+	else
+	{
+		m_dmaDev = NULL;
+		m_dmaStatus = DATAFLASH_DMA_ERROR;
+		return false;
+	}
+
+	AT45DB161D *owner = dataflash_dma_owner[m_dmaPort];
+	if(owner != NULL && owner != this && owner->m_dmaStatus == DATAFLASH_DMA_BUSY)
+	{
+		m_dmaStatus = DATAFLASH_DMA_ERROR;
+		return false;
+	}
+
+	if(owner != this)
+	{
+		dma_init(m_dmaDev);
+		dma_attach_interrupt(m_dmaDev, m_dmaRxChannel, handler);
+		dma_attach_interrupt(m_dmaDev, m_dmaTxChannel, handler);
+		dataflash_dma_owner[m_dmaPort] = this;
+	}
+
+	return true;
+}
+
+/**
+ * Start a transfer of len bytes on the bus of the command just sent.
+ * Both channels are always used: reads clock out a dummy byte from a
+ * fixed address, writes drain what comes back into a sink byte, so the
+ * RX completion interrupt marks the end of the last byte on the wire.
+ * @param rx Destination, or NULL to discard received bytes
+ * @param tx Source, or NULL to send dummy bytes
+ **/
+bool AT45DB161D::StartDMA(uint8_t *rx, const uint8_t *tx, size_t len)
+{
+	m_dmaRx = rx;
+	m_dmaTx = tx;
+	m_dmaRemaining = len;
+
+#ifdef DATAFLASH_STATS_ENABLED
+	if(tx)
+		m_stats.bytesWritten += len;
+	else
+		m_stats.bytesRead += len;
+#endif
+	DF_TRACE_BYTES(len);
+
+	if(len == 0)
+	{
+		EndDMA(DATAFLASH_DMA_DONE);
+		return true;
+	}
+
+	m_dmaStatus = DATAFLASH_DMA_BUSY;
+
+	spi_rx_dma_enable(m_SPI->c_dev());
+	spi_tx_dma_enable(m_SPI->c_dev());
+
+	StartDMAChunk();
+	return true;
+}
+
+/**
+ * Arm the channels for the next piece of the current transfer.
+ **/
+void AT45DB161D::StartDMAChunk()
+{
+	spi_dev *spi = m_SPI->c_dev();
+	uint16_t count = (m_dmaRemaining > DATAFLASH_DMA_MAX_TRANSFER) ? DATAFLASH_DMA_MAX_TRANSFER : (uint16_t)m_dmaRemaining;
+
+	dma_setup_transfer(m_dmaDev, m_dmaRxChannel,
+	                   &spi->regs->DR, DMA_SIZE_8BITS,
+	                   m_dmaRx ? m_dmaRx : &dataflash_dma_sink, DMA_SIZE_8BITS,
+	                   (m_dmaRx ? DMA_MINC_MODE : 0) | DMA_TRNS_CMPLT | DMA_TRNS_ERR);
+
+	dma_setup_transfer(m_dmaDev, m_dmaTxChannel,
+	                   &spi->regs->DR, DMA_SIZE_8BITS,
+	                   m_dmaTx ? (uint8_t*)m_dmaTx : &dataflash_dma_dummy, DMA_SIZE_8BITS,
+	                   (m_dmaTx ? DMA_MINC_MODE : 0) | DMA_FROM_MEM | DMA_TRNS_ERR);
+
+	dma_set_num_transfers(m_dmaDev, m_dmaRxChannel, count);
+	dma_set_num_transfers(m_dmaDev, m_dmaTxChannel, count);
+
+	m_dmaRemaining -= count;
+	if(m_dmaRx) m_dmaRx += count;
+	if(m_dmaTx) m_dmaTx += count;
+
+	/* RX first, so that no byte is clocked in before it is armed */
+	dma_enable(m_dmaDev, m_dmaRxChannel);
+	dma_enable(m_dmaDev, m_dmaTxChannel);
+}
+
+/**
+ * Stop the channels, release CS unless a read started by
+ * BeginReadDMA is open, and report the result.
+ **/
+void AT45DB161D::EndDMA(dataflash_dma_status status)
+{
+	if(m_dmaDev != NULL)
+	{
+		dma_disable(m_dmaDev, m_dmaTxChannel);
+		dma_disable(m_dmaDev, m_dmaRxChannel);
+	}
+
+	spi_tx_dma_disable(m_SPI->c_dev());
+	spi_rx_dma_disable(m_SPI->c_dev());
+
+	if(!m_dmaHold)
+		DF_CS_deselect();	/* End of the command */
+
+	m_dmaRemaining = 0;
+	m_dmaStatus = status;
+
+	if(m_dmaHandler)
+		m_dmaHandler(m_dmaContext);
+}
+
+/**
+ * DMA interrupt, shared by the RX and TX channels. Re-arms the channels
+ * until the whole transfer has been moved.
+ **/
+void AT45DB161D::DMAInterrupt()
+{
+	uint8_t rxBits = dma_get_isr_bits(m_dmaDev, m_dmaRxChannel);
+	uint8_t txBits = dma_get_isr_bits(m_dmaDev, m_dmaTxChannel);
+
+	dma_clear_isr_bits(m_dmaDev, m_dmaRxChannel);
+	dma_clear_isr_bits(m_dmaDev, m_dmaTxChannel);
+
+	if(m_dmaStatus != DATAFLASH_DMA_BUSY)
+		return;
+
+	if((rxBits | txBits) & DMA_ISR_TEIF)
+	{
+		EndDMA(DATAFLASH_DMA_ERROR);
+		return;
+	}
+
+	if(!(rxBits & DMA_ISR_TCIF))
+		return;
+
+	if(m_dmaRemaining)
+		StartDMAChunk();
+	else
+		EndDMA(DATAFLASH_DMA_DONE);
+}
+
+void AT45DB161D::DMAInterruptSPI1()
+{
+	dataflash_dma_owner[0]->DMAInterrupt();
+}
+
+void AT45DB161D::DMAInterruptSPI2()
+{
+	dataflash_dma_owner[1]->DMAInterrupt();
+}
+
+void AT45DB161D::DMAInterruptSPI3()
+{
+	dataflash_dma_owner[2]->DMAInterrupt();
+}
+
+/**
+ * Transfer data from buffer 1 or 2 to main memory page.
+ * @param bufferNum Buffer to use (1 or 2)
+ * @param page Page where the content of the buffer will transfered
+ * @param erase If set the page will be first erased before the buffer transfer.
+ * @note If erase is equal to zero, the page must have been previously erased using one of the erase command (Page or Block Erase).
+ **/
+void AT45DB161D::BufferToPage(dataflash_buffer bufferNum, uint16_t page, uint8_t erase)
+{
+	StartBufferToPage(bufferNum, page, erase);
+
+	/* Wait for the end of the programming */
+	WaitForReady();
+}
+
+/**
+ * Start a transfer from buffer 1 or 2 to a main memory page and
+ * return without waiting for the end of the programming.
+ * @param bufferNum Buffer to use (1 or 2)
+ * @param page Page where the content of the buffer will transfered
+ * @param erase If set the page will be first erased before the buffer transfer.
+ **/
+void AT45DB161D::StartBufferToPage(dataflash_buffer bufferNum, uint16_t page, uint8_t erase)
+{
+	CheckGeometry();
+
+	BeginOperation(DATAFLASH_OP_BUFFER_TO_PAGE, page, erase ? DATAFLASH_T_EP : DATAFLASH_T_P, bufferNum);
+
+	/* Once programmed, the page holds what the buffer holds */
+	InvalidatePages(page, 1);
+	m_bufferPage[bufferNum - 1] = page;
+	m_bufferDirty[bufferNum - 1] = false;
+
 	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
 	DF_CS_select();      /* to reset Dataflash command decoder     */
+	
+	/* Opcode */
+	DF_TRACE(dataflash_buffer_to_page[erase ? 1 : 0][bufferNum - 1]);
+	m_SPI->transfer(dataflash_buffer_to_page[erase ? 1 : 0][bufferNum - 1]);
+	
+	/* Page address, followed by don't care bits */
+	SendAddress(page, 0);
+	
+	DF_CS_deselect();  /* Start transfer */
+	DF_CS_select();    /* If erase was set, the page will first be erased */
+}
 
+/**
+ * Transfer a page of data from main memory to buffer 1 or 2.
+ * Nothing is sent if the buffer already holds an unmodified copy
+ * of the page.
+ * @param page Main memory page to transfer
+ * @param bufferNum Buffer (1 or 2) where the data will be written
+ **/
+void AT45DB161D::PageToBuffer(uint16_t page, dataflash_buffer bufferNum)
+{
+	StartPageToBuffer(page, bufferNum);
+
+	/* Wait for the end of the transfer */
+	WaitForOperation();
+}
+
+/**
+ * Start a transfer of a page of data from main memory to buffer 1 or 2
+ * and return without waiting for its end. Nothing is sent if the buffer
+ * already holds an unmodified copy of the page.
+ * @param page Main memory page to transfer
+ * @param bufferNum Buffer (1 or 2) where the data will be written
+ **/
+void AT45DB161D::StartPageToBuffer(uint16_t page, dataflash_buffer bufferNum)
+{
+	CheckGeometry();
+
+	if(m_bufferPage[bufferNum - 1] == page && !m_bufferDirty[bufferNum - 1])
+		return;
+
+	BeginOperation(DATAFLASH_OP_PAGE_TO_BUFFER, page, DATAFLASH_T_XFR, bufferNum);
+
+	m_bufferPage[bufferNum - 1] = page;
+	m_bufferDirty[bufferNum - 1] = false;
+
+	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
+	DF_CS_select();      /* to reset Dataflash command decoder     */
+ 
 	/* Send opcode */
+	DF_TRACE(dataflash_page_to_buffer[bufferNum - 1]);
+	m_SPI->transfer(dataflash_page_to_buffer[bufferNum - 1]);
+
+	/* Page address, followed by don't care bits */
+	SendAddress(page, 0);
+		
+	DF_CS_deselect();  /* Start page transfer */
+	DF_CS_select();
+}
+
+/** 
+ * Erase a page in the main memory array.
+ * @param page Page to erase
+ **/
+void AT45DB161D::PageErase(uint16_t page)
+{
+	StartPageErase(page);
+
+	/* Wait for the end of the page erase operation */
+	WaitForReady();
+}
+
+/** 
+ * Start erasing a page in the main memory array and return without
+ * waiting for the end of the erase.
+ * @param page Page to erase
+ **/
+void AT45DB161D::StartPageErase(uint16_t page)
+{
+	CheckGeometry();
+
+	BeginOperation(DATAFLASH_OP_PAGE_ERASE, page, DATAFLASH_T_PE);
+	InvalidatePages(page, 1);
+
+	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
+	DF_CS_select();      /* to reset Dataflash command decoder     */
+
+	/* Send opcode */
+	DF_TRACE(AT45DB161D_PAGE_ERASE);
+	m_SPI->transfer(AT45DB161D_PAGE_ERASE);
+	
+	/* Page address, followed by don't care bits */
+	SendAddress(page, 0);
+		
+	DF_CS_deselect();  /* Start page erase */
+	DF_CS_select();
+}
+
+/**
+ * Erase a block of eight pages at one time.
+ * @param block Index of the block to erase
+ **/
+void AT45DB161D::BlockErase(uint16_t block)
+{
+	StartBlockErase(block);
+
+	/* Wait for the end of the block erase operation */
+	WaitForReady();
+}
+
+/**
+ * Start erasing a block of eight pages and return without waiting
+ * for the end of the erase.
+ * @param block Index of the block to erase
+ **/
+void AT45DB161D::StartBlockErase(uint16_t block)
+{
+	CheckGeometry();
+
+	BeginOperation(DATAFLASH_OP_BLOCK_ERASE, block, DATAFLASH_T_BE);
+	InvalidatePages(block * DATAFLASH_BLOCK_PAGES, DATAFLASH_BLOCK_PAGES);
+
+	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
+	DF_CS_select();      /* to reset Dataflash command decoder     */
+
+	/* Send opcode */
+	DF_TRACE(AT45DB161D_BLOCK_ERASE);
 	m_SPI->transfer(AT45DB161D_BLOCK_ERASE);
 	
-	/*
-	 * 3 address bytes consist of :
-	 *     - 2 don’t care bits
-	 *     - 9 block address bits (PA11 - PA3)
-	 *     - 13 don’t care bits
-	 */
-	m_SPI->transfer((uint8_t)(block >> 3));
-	m_SPI->transfer((uint8_t)(block << 5));
-	m_SPI->transfer(0x00);
+	/* Address of the first page of the block */
+	SendAddress(block * DATAFLASH_BLOCK_PAGES, 0);
 		
 	DF_CS_deselect();  /* Start block erase */
 	DF_CS_select();
+}
+
+/** 
+ * Erase a sector in main memory. There are 16 sector on the
+ * at45db161d and only one can be erased at one time.
+ * @param sector Sector to erase (1-15), or 0x0a/0x0b for sector 0a/0b
+ * @note Sectors 10 and 11 share their numbers with sectors 0a and 0b,
+ *       use SectorEraseAt to erase them.
+ **/
+void AT45DB161D::SectorErase(uint8_t sector)
+{
+	StartSectorErase(sector);
+
+	/* Wait for the end of the sector erase operation */
+	WaitForReady();
+}
+
+/** 
+ * Start erasing a sector in main memory and return without waiting
+ * for the end of the erase.
+ * @param sector Sector to erase (1-15), or 0x0a/0x0b for sector 0a/0b
+ * @note Sectors 10 and 11 share their numbers with sectors 0a and 0b,
+ *       use StartSectorEraseAt to erase them.
+ **/
+void AT45DB161D::StartSectorErase(uint8_t sector)
+{
+	CheckGeometry();
+
+	/* Sector 0 is split in 0a (block 0) and 0b (the rest of it) */
+	if(sector == 0x0a || sector == 0)
+		StartSectorEraseAt(0);
+	else if(sector == 0x0b)
+		StartSectorEraseAt(DATAFLASH_BLOCK_PAGES);
+	else
+		StartSectorEraseAt(sector * m_sectorPages);
+}
+
+/**
+ * Erase the sector holding a page. Within sector 0, only the part
+ * holding the page is erased: sector 0a (block 0) or 0b (the rest).
+ * @param page Any page of the sector
+ **/
+void AT45DB161D::SectorEraseAt(uint16_t page)
+{
+	StartSectorEraseAt(page);
+
+	/* Wait for the end of the sector erase operation */
+	WaitForReady();
+}
+
+/**
+ * Start erasing the sector holding a page and return without waiting
+ * for the end of the erase. Within sector 0, only the part holding the
+ * page is erased: sector 0a (block 0) or 0b (the rest). The operation
+ * record takes the first page erased as address.
+ * @param page Any page of the sector
+ **/
+void AT45DB161D::StartSectorEraseAt(uint16_t page)
+{
+	CheckGeometry();
+
+	uint16_t first, count;
+
+	if(page < DATAFLASH_BLOCK_PAGES)
+	{
+		first = 0;
+		count = DATAFLASH_BLOCK_PAGES;
+	}
+	else if(page < m_sectorPages)
+	{
+		first = DATAFLASH_BLOCK_PAGES;
+		count = m_sectorPages - DATAFLASH_BLOCK_PAGES;
+	}
+	else
+	{
+		first = page - page % m_sectorPages;
+		count = m_sectorPages;
+	}
+
+	BeginOperation(DATAFLASH_OP_SECTOR_ERASE, first, DATAFLASH_T_SE);
+	InvalidatePages(first, count);
+
+	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
+	DF_CS_select();      /* to reset Dataflash command decoder     */
+
+	/* Send opcode */
+	DF_TRACE(AT45DB161D_SECTOR_ERASE);
+	m_SPI->transfer(AT45DB161D_SECTOR_ERASE);
+	
+	/* Address of the first page of the sector */
+	SendAddress(first, 0);
+				
+	DF_CS_deselect();  /* Start sector erase */
+	DF_CS_select();
+}
+
+#ifdef CHIP_ERASE_ENABLED
+/** 
+ * Erase the entire chip memory. Sectors proteced or locked down will
+ * not be erased.
+ **/
+void AT45DB161D::ChipErase()
+{
+	StartChipErase();
+
+	/* Wait for the end of the chip erase operation */
+	WaitForReady();
+}
+
+/** 
+ * Start erasing the entire chip memory and return without waiting
+ * for the end of the erase.
+ **/
+void AT45DB161D::StartChipErase()
+{
+	CheckGeometry();
+
+	BeginOperation(DATAFLASH_OP_CHIP_ERASE, 0, DATAFLASH_T_CE);
+	InvalidatePages(0, m_pageCount);
+
+	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
+	DF_CS_select();      /* to reset Dataflash command decoder     */
+
+	/* Send chip erase sequence */
+	DF_TRACE(AT45DB161D_CHIP_ERASE_0);
+	m_SPI->transfer(AT45DB161D_CHIP_ERASE_0);
+	m_SPI->transfer(AT45DB161D_CHIP_ERASE_1);
+	m_SPI->transfer(AT45DB161D_CHIP_ERASE_2);
+	m_SPI->transfer(AT45DB161D_CHIP_ERASE_3);
+				
+	DF_CS_deselect();  /* Start chip erase */
+	DF_CS_select();
+}
+#endif
+
+/**
+ * This a combination of Buffer Write and Buffer to Page with
+ * Built-in Erase.
+ * @note You must call EndAndWait in order to start transfering data from buffer to page
+ * @param page Page where the content of the buffer will transfered
+ * @param offset Starting byte address within the buffer
+ * @param bufferNum Buffer to use (1 or 2)
+ * @warning UNTESTED
+ **/
+void AT45DB161D::BeginPageWriteThroughBuffer(uint16_t page, uint16_t offset, dataflash_buffer bufferNum)
+{
+	CheckGeometry();
+
+	/* The command starts when CS goes high in EndAndWait/End */
+	BeginOperation(DATAFLASH_OP_PAGE_WRITE_THROUGH_BUFFER, page, DATAFLASH_T_EP, bufferNum);
+	m_operation.pending = false;
+
+	/* The whole buffer, with the bytes written next, ends up in the page */
+	InvalidatePages(page, 1);
+	m_bufferPage[bufferNum - 1] = page;
+	m_bufferDirty[bufferNum - 1] = false;
+
+	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
+	DF_CS_select();      /* to reset Dataflash command decoder     */
+
+	/* Send opcode */
+	DF_TRACE(dataflash_page_through_buffer[bufferNum - 1]);
+	m_SPI->transfer(dataflash_page_through_buffer[bufferNum - 1]);
+
+	/* Address */
+	SendAddress(page, offset);
+}
+
+/**
+ * Perform a low-to-high transition on the CS pin and then poll
+ * the status register to check if the dataflash is busy.
+ **/
+void AT45DB161D::EndAndWait()
+{
+	End();
+
+	/* Wait for the chip to be ready */
+	WaitForReady();
+
+	DF_CS_deselect();	/* Release SPI bus */
+}
+
+/**
+ * Perform a low-to-high transition on the CS pin, starting the
+ * command begun by BeginPageWriteThroughBuffer, and return without
+ * waiting for its end.
+ **/
+void AT45DB161D::End()
+{
+	DF_CS_deselect();  /* End current operation */
+	DF_CS_select();    /* Some internal operation may occur
+	                    * (buffer to page transfer, page erase, etc... ) */
+
+	m_operation.started = micros();
+	m_operation.pending = true;
+}
+
+/**
+ * Read the status register once and update the operation record.
+ * @return true while the chip is busy
+ **/
+bool AT45DB161D::IsBusy()
+{
+	uint8_t status = ReadStatusRegister();
+
+	DF_CS_deselect();	/* Release SPI bus */
 
-	/* Wait for the end of the block erase operation */
-	WaitForReady();
+	if(!(status & DATAFLASH_STATUS_READY_BUSY))
+		return true;
 
+	CompleteOperation(status);
+	return false;
 }
 
-/** 
- * Erase a sector in main memory. There are 16 sector on the
- * at45db161d and only one can be erased at one time.
- * @param sector Sector to erase (1-15)
+/**
+ * Check if the operation started last is still running. The status
+ * register is not read before the typical duration of the operation
+ * has elapsed, so calling Poll often costs no SPI traffic.
+ * @return true while the operation is running
+ * @note The chip may be done sooner than the typical duration. Use
+ *       IsBusy() to find out at the earliest.
  **/
-void AT45DB161D::SectorErase(uint8_t sector)
+bool AT45DB161D::Poll()
 {
-	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
-	DF_CS_select();      /* to reset Dataflash command decoder     */
+	if(!m_operation.pending)
+		return false;
 
-	/* Send opcode */
-	m_SPI->transfer(AT45DB161D_SECTOR_ERASE);
-	
-	/*
-	 * 3 address bytes consist of :
-	 */
-	if((sector == 0x0a) || (sector == 0x0b))
+	if((uint32_t)(micros() - m_operation.started) < m_operation.expected)
+		return true;
+
+	return IsBusy();
+}
+
+/**
+ * Wait for the end of the operation started last, if any.
+ * @return Status register value read at the end of the operation
+ **/
+uint8_t AT45DB161D::WaitForOperation()
+{
+	if(m_operation.pending)
 	{
-		/*
-		 *  - 11 don’t care bits
-		 *  - 
-		 *  - 12 don’t care bits
-		 */
-		m_SPI->transfer(0x00);
-		m_SPI->transfer(((sector & 0x01) << 4));
-		m_SPI->transfer(0x00);
+		WaitForReady();
+		DF_CS_deselect();	/* Release SPI bus */
 	}
+
+	return m_operation.status;
+}
+
+/**
+ * Main memory page mirrored by a buffer.
+ * @param bufferNum Buffer (1 or 2)
+ * @return Page number, or DATAFLASH_NO_PAGE if unknown
+ **/
+uint16_t AT45DB161D::BufferPage(dataflash_buffer bufferNum)
+{
+	return m_bufferPage[bufferNum - 1];
+}
+
+/**
+ * Check if a buffer was written since it last matched its page.
+ * @param bufferNum Buffer (1 or 2)
+ **/
+bool AT45DB161D::IsBufferDirty(dataflash_buffer bufferNum)
+{
+	return m_bufferDirty[bufferNum - 1];
+}
+
+/**
+ * Look for a buffer mirroring a page.
+ * @param page Main memory page
+ * @param bufferNum Set to the buffer holding the page, if any
+ * @return true if a buffer holds the page
+ **/
+bool AT45DB161D::FindBuffer(uint16_t page, dataflash_buffer *bufferNum)
+{
+	if(m_bufferPage[0] == page)
+		*bufferNum = DATAFLASH_BUFFER1;
+	else if(m_bufferPage[1] == page)
+		*bufferNum = DATAFLASH_BUFFER2;
 	else
+		return false;
+
+	return true;
+}
+
+/**
+ * Forget what the buffers hold. Needed after driving the chip with raw
+ * SPI transfers that change the buffers or the main memory.
+ **/
+void AT45DB161D::InvalidateBuffers()
+{
+	m_bufferPage[0] = DATAFLASH_NO_PAGE;
+	m_bufferPage[1] = DATAFLASH_NO_PAGE;
+	m_bufferDirty[0] = false;
+	m_bufferDirty[1] = false;
+	m_bufferLastUsed = DATAFLASH_BUFFER2;
+}
+
+/**
+ * Read a span of a page through one of the SRAM buffers. A page already
+ * held by a buffer is read from it without accessing the main memory,
+ * including changes written to the buffer and not programmed yet.
+ * Otherwise the page is loaded into a buffer with no pending changes,
+ * or read directly if both have some.
+ * @param page Main memory page to read
+ * @param offset Starting byte within the page
+ * @param dst Destination, at least len bytes
+ * @param len Number of bytes to read, up to the end of the page
+ **/
+void AT45DB161D::ReadThroughBuffer(uint16_t page, uint16_t offset, uint8_t *dst, size_t len)
+{
+	dataflash_buffer bufferNum;
+
+	if(!FindBuffer(page, &bufferNum))
 	{
-		/*
-		 *  - 2 don't care bits 
-		 *  - 4 sector number bits
-		 *  - 18 don't care bits 
-		 */
-		m_SPI->transfer(sector << 1);
-		m_SPI->transfer(0x00);
-		m_SPI->transfer(0x00);
+		/* Replace the buffer used least recently, unless it has
+		 * changes that would be lost */
+		bufferNum = (m_bufferLastUsed == DATAFLASH_BUFFER1) ? DATAFLASH_BUFFER2 : DATAFLASH_BUFFER1;
+		if(m_bufferDirty[bufferNum - 1])
+			bufferNum = m_bufferLastUsed;
+
+		if(m_bufferDirty[bufferNum - 1])
+		{
+			Read(page, offset, dst, len);
+			return;
+		}
+
+		PageToBuffer(page, bufferNum);
 	}
-				
-	DF_CS_deselect();  /* Start block erase */
-	DF_CS_select();
 
-	/* Wait for the end of the block erase operation */
-	WaitForReady();
+	m_bufferLastUsed = bufferNum;
+	ReadBuffer(bufferNum, offset, dst, len);
+}
 
+/**
+ * Start a sequential write of whole pages through both SRAM
+ * buffers. While one buffer is being programmed into main memory,
+ * StreamWrite fills the other one over SPI, so the write runs at
+ * the programming speed of the chip.
+ * @param page First page to write
+ * @param erase If set every page is erased before being programmed
+ * @note No other command may be issued until EndStreamWrite.
+ **/
+void AT45DB161D::BeginStreamWrite(uint16_t page, uint8_t erase)
+{
+	CheckGeometry();
+
+	m_streamBuffer = DATAFLASH_BUFFER1;
+	m_streamPage = page;
+	m_streamOffset = 0;
+	m_streamErase = erase;
 }
 
-#ifdef CHIP_ERASE_ENABLED
-/** 
- * Erase the entire chip memory. Sectors proteced or locked down will
- * not be erased.
+/**
+ * Append data to the stream write. Each time a buffer is full it
+ * is programmed into the next page and filling goes on in the
+ * other buffer.
+ * @param src Source, at least len bytes
+ * @param len Number of bytes to write
  **/
-void AT45DB161D::ChipErase()
+void AT45DB161D::StreamWrite(const uint8_t *src, size_t len)
 {
-	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
-	DF_CS_select();      /* to reset Dataflash command decoder     */
+	while(len)
+	{
+		size_t count = m_pageSize - m_streamOffset;
+		if(count > len)
+			count = len;
 
-	/* Send chip erase sequence */
-	m_SPI->transfer(AT45DB161D_CHIP_ERASE_0);
-	m_SPI->transfer(AT45DB161D_CHIP_ERASE_1);
-	m_SPI->transfer(AT45DB161D_CHIP_ERASE_2);
-	m_SPI->transfer(AT45DB161D_CHIP_ERASE_3);
-				
-	DF_CS_deselect();  /* Start chip erase */
-	DF_CS_select();
+		/* The chip accepts writes to the idle buffer while it
+		 * programs the other one. */
+		WriteBuffer(m_streamBuffer, m_streamOffset, src, count);
+		m_streamOffset += count;
+		src += count;
+		len -= count;
 
-	/* Wait for the end of the chip erase operation */
-	WaitForReady();
+		if(m_streamOffset == m_pageSize)
+		{
+			/* Waits for the previous page, only one can be
+			 * programmed at a time */
+			StartBufferToPage(m_streamBuffer, m_streamPage, m_streamErase);
 
+			m_streamBuffer = (m_streamBuffer == DATAFLASH_BUFFER1) ? DATAFLASH_BUFFER2 : DATAFLASH_BUFFER1;
+			m_streamPage++;
+			m_streamOffset = 0;
+		}
+	}
 }
-#endif
 
 /**
- * This a combination of Buffer Write and Buffer to Page with
- * Built-in Erase.
- * @note You must call EndAndWait in order to start transfering data from buffer to page
- * @param page Page where the content of the buffer will transfered
- * @param offset Starting byte address within the buffer
- * @param bufferNum Buffer to use (1 or 2)
- * @warning UNTESTED
+ * Program the last, partially filled page and wait for the
+ * chip to be ready. The rest of a partial page is filled with 0xFF.
+ * @return Number of the page following the last page written
  **/
-void AT45DB161D::BeginPageWriteThroughBuffer(uint16_t page, uint16_t offset, dataflash_buffer bufferNum)
+uint16_t AT45DB161D::EndStreamWrite()
 {
-	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
-	DF_CS_select();      /* to reset Dataflash command decoder     */
+	if(m_streamOffset)
+	{
+		BufferWrite(m_streamBuffer, m_streamOffset);
+		DF_STAT(m_stats.bytesWritten += m_pageSize - m_streamOffset);
+		DF_TRACE_BYTES(m_pageSize - m_streamOffset);
+		while(m_streamOffset < m_pageSize)
+		{
+			m_SPI->transfer(0xFF);
+			m_streamOffset++;
+		}
 
-	/* Send opcode */
-	if(bufferNum == DATAFLASH_BUFFER1)
+		StartBufferToPage(m_streamBuffer, m_streamPage, m_streamErase);
+		m_streamPage++;
+		m_streamOffset = 0;
+	}
+
+	WaitForOperation();
+
+	DF_CS_deselect();	/* Release SPI bus */
+
+	return m_streamPage;
+}
+
+/**
+ * Write a span of pages, erasing them with as little time as possible.
+ * Whole blocks, or whole sectors when that is quicker, are erased ahead
+ * and programmed without the built-in erase; only the pages at the
+ * ragged ends of the range are erased one by one. Each erase starts
+ * when the previous page is programmed, while StreamWrite fills a
+ * buffer with the first page it clears.
+ * @param page First page to write
+ * @param src Source, at least len bytes
+ * @param len Number of bytes to write. The rest of the last page is
+ *        filled with 0xFF.
+ * @return Number of the page following the last page written
+ **/
+uint16_t AT45DB161D::BulkWrite(uint16_t page, const uint8_t *src, size_t len)
+{
+	CheckGeometry();
+
+	uint32_t end = page + (len + m_pageSize - 1) / m_pageSize;
+
+	if(end > m_pageCount)
 	{
-		m_SPI->transfer(AT45DB161D_PAGE_THROUGH_BUFFER_1);
+		ASSERT(0);
+		if(page >= m_pageCount)
+			return page;
+
+		end = m_pageCount;
+		len = (size_t)(end - page) * m_pageSize;
 	}
-	else
+
+	BeginStreamWrite(page, 1);
+
+	while(len)
 	{
-		m_SPI->transfer(AT45DB161D_PAGE_THROUGH_BUFFER_2);
+		uint16_t pages = EraseAhead(m_streamPage, (uint16_t)end);
+		size_t count;
+
+		if(pages)
+		{
+			count = (size_t)pages * m_pageSize;
+			m_streamErase = 0;
+		}
+		else
+		{
+			count = m_pageSize;
+			m_streamErase = 1;
+		}
+
+		if(count > len)
+			count = len;
+
+		StreamWrite(src, count);
+		src += count;
+		len -= count;
 	}
 
-	/* Address */
-	m_SPI->transfer((uint8_t)(page >> 6));
-	m_SPI->transfer((uint8_t)((page << 2) | (offset >> 8)));
-	m_SPI->transfer((uint8_t)offset);
+	return EndStreamWrite();
 }
 
 /**
- * Perform a low-to-high transition on the CS pin and then poll
- * the status register to check if the dataflash is busy.
+ * Erase the largest unit starting at a page and lying within a range,
+ * if it is quicker than erasing its pages one by one: a sector, when
+ * DATAFLASH_T_SE beats erasing its blocks, else a block.
+ * @param page First page
+ * @param end Page following the range
+ * @return Number of pages erased, 0 if none
  **/
-void AT45DB161D::EndAndWait()
+uint16_t AT45DB161D::EraseAhead(uint16_t page, uint16_t end)
 {
-	DF_CS_deselect();  /* End current operation */
-	DF_CS_select();    /* Some internal operation may occur
-	                    * (buffer to page transfer, page erase, etc... ) */
+	uint32_t blockTime = (uint32_t)(m_sectorPages / DATAFLASH_BLOCK_PAGES) * DATAFLASH_T_BE;
 
-	/* Wait for the chip to be ready */
-	WaitForReady();
+	if(page % DATAFLASH_BLOCK_PAGES || page + DATAFLASH_BLOCK_PAGES > end)
+		return 0;
 
-	DF_CS_deselect();	/* Release SPI bus */
+	if(DATAFLASH_T_SE < blockTime)
+	{
+		/* Sector 0b, the rest of sector 0 after block 0 */
+		if(page == DATAFLASH_BLOCK_PAGES && m_sectorPages <= end)
+		{
+			StartSectorEraseAt(page);
+			return m_sectorPages - DATAFLASH_BLOCK_PAGES;
+		}
+
+		if(page % m_sectorPages == 0 && page != 0 && page + m_sectorPages <= end)
+		{
+			StartSectorEraseAt(page);
+			return m_sectorPages;
+		}
+	}
+
+	StartBlockErase(page / DATAFLASH_BLOCK_PAGES);
+	return DATAFLASH_BLOCK_PAGES;
+}
+
+/**
+ * Write a whole page only if its content changes. The data goes into
+ * a buffer and the chip compares it to the page, which takes tXFR
+ * instead of the tEP of a program: rewriting unchanged data, e.g. a
+ * periodic checkpoint, then costs no program and no wear. The page is
+ * erased and programmed only if they differ.
+ * @param page Page to write
+ * @param src Source, a whole page
+ * @param bufferNum Buffer to go through (1 or 2)
+ * @return true if the page was programmed, false if it already held
+ *         the data
+ **/
+bool AT45DB161D::UpdatePage(uint16_t page, const uint8_t *src, dataflash_buffer bufferNum)
+{
+	CheckGeometry();
+
+	WriteBuffer(bufferNum, 0, src, m_pageSize);
+
+	if(ComparePageToBuffer(page, bufferNum))
+	{
+		DF_STAT(m_stats.unchangedPages++);
+		return false;
+	}
+
+	BufferToPage(bufferNum, page, 1);
+	return true;
+}
+
+/**
+ * Write bytes anywhere in main memory, leaving the rest of the pages as
+ * they are. Each page is changed in a buffer and reprogrammed with the
+ * built-in erase, so a few bytes cost the page address and the bytes
+ * themselves over SPI, not a page read into RAM and written back. A
+ * page already mirrored by a buffer is changed there, changes not yet
+ * programmed included; a page written whole is not loaded first, and
+ * its buffer is filled while the previous page is being programmed.
+ * Returns once the last page is programmed.
+ * @param address Linear byte address, see LinearToPage
+ * @param src Source, at least len bytes
+ * @param len Number of bytes to write. Bytes past the end of the main
+ *        memory are dropped.
+ * @note Changes written to a buffer and not programmed are lost if the
+ *       buffer is needed for a page they do not belong to, which only
+ *       happens when both buffers have some.
+ **/
+void AT45DB161D::Write(uint32_t address, const uint8_t *src, size_t len)
+{
+	uint16_t page, offset;
+
+	LinearToPage(address, &page, &offset);
+
+	while(len && page < m_pageCount)
+	{
+		dataflash_buffer bufferNum;
+		size_t count = m_pageSize - offset;
+
+		if(count > len)
+			count = len;
+
+		if(!FindBuffer(page, &bufferNum))
+		{
+			/* The buffer not being programmed can be filled right
+			 * away, unless it has changes of its own */
+			bufferNum = (m_operation.pending && m_operation.buffer == DATAFLASH_BUFFER1) ? DATAFLASH_BUFFER2 : DATAFLASH_BUFFER1;
+			if(m_bufferDirty[bufferNum - 1] && !m_bufferDirty[2 - bufferNum])
+				bufferNum = (bufferNum == DATAFLASH_BUFFER1) ? DATAFLASH_BUFFER2 : DATAFLASH_BUFFER1;
+
+			/* The rest of a partial page comes from main memory */
+			if(count < m_pageSize)
+				StartPageToBuffer(page, bufferNum);
+		}
+
+		WriteBuffer(bufferNum, offset, src, count);
+		StartBufferToPage(bufferNum, page, 1);
+
+		src += count;
+		len -= count;
+		page++;
+		offset = 0;
+	}
+
+	WaitForOperation();
 }
 
 /**
@@ -595,85 +2088,233 @@ void AT45DB161D::EndAndWait()
  * @return
  *		- 1 if the page and the buffer contains the same data
  * 		- 0 else
- * @warning UNTESTED
  **/
 int8_t AT45DB161D::ComparePageToBuffer(uint16_t page, dataflash_buffer bufferNum)
 {
-	uint8_t status;
-	
+	StartComparePageToBuffer(page, bufferNum);
+
+	/* Wait for the end of the comparaison and get the result */
+	uint8_t status = WaitForOperation();
+  		
+	/* If bit 6 of the status register is 0 then the data in the
+  	 * main memory page matches the data in the buffer. 
+ 	 * If it's 1 then the data in the main memory page doesn't match.
+ 	 */
+	if(status & DATAFLASH_STATUS_COMPARE)
+		return 0;
+
+	/* The buffer is a clean copy of the page */
+	m_bufferPage[bufferNum - 1] = page;
+	m_bufferDirty[bufferNum - 1] = false;
+	return 1;
+}
+
+/**
+ * Start comparing a page of data in main memory to the data in
+ * buffer 1 or 2 and return without waiting for the result. Once the
+ * operation is over, DATAFLASH_STATUS_COMPARE in its status tells if
+ * they differ.
+ * @param page Page to test
+ * @param bufferNum Buffer number
+ **/
+void AT45DB161D::StartComparePageToBuffer(uint16_t page, dataflash_buffer bufferNum)
+{
+	CheckGeometry();
+
+	BeginOperation(DATAFLASH_OP_COMPARE, page, DATAFLASH_T_XFR, bufferNum);
+
 	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
 	DF_CS_select();      /* to reset Dataflash command decoder     */
 	
 	/* Send opcode */
-	if(bufferNum == DATAFLASH_BUFFER1)
-	{
-		m_SPI->transfer(AT45DB161D_COMPARE_PAGE_TO_BUFFER_1);
-	}
-	else
-	{
-		m_SPI->transfer(AT45DB161D_COMPARE_PAGE_TO_BUFFER_2);
-	}
+	DF_TRACE(dataflash_compare_page_to_buffer[bufferNum - 1]);
+	m_SPI->transfer(dataflash_compare_page_to_buffer[bufferNum - 1]);
 	
 	/* Page address */
-	m_SPI->transfer((uint8_t)(page >> 6));
-	m_SPI->transfer((uint8_t)(page << 2));
-	m_SPI->transfer(0x00);
+	SendAddress(page, 0);
 	
 	DF_CS_deselect();  /* Start comparaison */
 	DF_CS_select();
+}
 
-	/* Wait for the end of the comparaison and get the result */
-	while(!((status = ReadStatusRegister()) & DATAFLASH_STATUS_READY_BUSY));
+/**
+ * Refresh a page with Auto Page Rewrite: the page is transferred
+ * into a buffer, then erased and programmed back from it.
+ * @param page Page to rewrite
+ * @param bufferNum Buffer to go through (1 or 2). Its content is lost.
+ **/
+void AT45DB161D::AutoPageRewrite(uint16_t page, dataflash_buffer bufferNum)
+{
+	StartAutoPageRewrite(page, bufferNum);
 
-  		
-	/* If bit 6 of the status register is 0 then the data in the
-  	 * main memory page matches the data in the buffer. 
- 	 * If it's 1 then the data in the main memory page doesn't match.
- 	 */
-	return ((status & DATAFLASH_STATUS_COMPARE) ? 0 : 1);
+	/* Wait for the end of the rewrite */
+	WaitForReady();
 }
 
 /**
- * Put the device into the lowest power consumption mode.
- * Once the device has entered the Deep Power-down mode, all
- * instructions are ignored except the Resume from Deep
- * Power-down command.
- * @warning UNTESTED
+ * Start an Auto Page Rewrite and return without waiting for its end.
+ * @param page Page to rewrite
+ * @param bufferNum Buffer to go through (1 or 2). Its content is lost.
+ **/
+void AT45DB161D::StartAutoPageRewrite(uint16_t page, dataflash_buffer bufferNum)
+{
+	CheckGeometry();
+
+	BeginOperation(DATAFLASH_OP_AUTO_PAGE_REWRITE, page, DATAFLASH_T_EP, bufferNum);
+
+	/* The buffer ends up holding the page */
+	InvalidatePages(page, 1);
+	m_bufferPage[bufferNum - 1] = page;
+	m_bufferDirty[bufferNum - 1] = false;
+
+	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
+	DF_CS_select();      /* to reset Dataflash command decoder     */
+
+	/* Send opcode */
+	DF_TRACE(dataflash_auto_page_rewrite[bufferNum - 1]);
+	m_SPI->transfer(dataflash_auto_page_rewrite[bufferNum - 1]);
+
+	/* Page address */
+	SendAddress(page, 0);
+
+	DF_CS_deselect();  /* Start rewrite */
+	DF_CS_select();
+}
+
+/**
+ * Call a handler each time a program or erase operation is started,
+ * e.g. to count the operations per sector.
+ * @param handler Handler, or NULL to remove it
+ * @param context Passed to the handler
+ **/
+void AT45DB161D::AttachProgramHandler(dataflash_program_handler handler, void *context)
+{
+	m_programHandler = handler;
+	m_programContext = context;
+}
+
+/**
+ * Put the device into the lowest power consumption mode. The chip
+ * ignores the command while busy, so the operation in progress is
+ * waited for first. Once the device has entered the Deep Power-down
+ * mode, all instructions are ignored except the Resume from Deep
+ * Power-down command, which the next command sends first.
  **/
 void AT45DB161D::DeepPowerDown()
+{
+	if(m_powerDown)
+		return;
+
+	WaitForOperation();
+	EnterDeepPowerDown();
+}
+
+/**
+ * Send the Deep Power-down command, with no operation running, and wait
+ * until the device has entered the mode.
+ **/
+void AT45DB161D::EnterDeepPowerDown()
 {
 	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
 	DF_CS_select();      /* to reset Dataflash command decoder     */
 	
 	/* Send opcode */
+	DF_TRACE(AT45DB161D_DEEP_POWER_DOWN);
 	m_SPI->transfer(AT45DB161D_DEEP_POWER_DOWN);
 	
 	/* Enter Deep Power-Down mode */
 	DF_CS_deselect();
 	
-	/* Safety delay */
-	delay(100);
+	/* The device enters the mode t_EDPD microseconds after CS goes high */
+	delayMicroseconds(DATAFLASH_T_EDPD_MAX);
+
+	m_powerDown = true;
 }
 
 /**
- * Takes the device out of Deep Power-down mode.
+ * Takes the device out of Deep Power-down mode. Called by the next
+ * command after DeepPowerDown, so it rarely needs calling directly.
+ * Busy-waits t_RDPD, in the context of that command, interrupt handlers
+ * included.
  **/
 void AT45DB161D::ResumeFromDeepPowerDown()
 {
+	/* Cleared first, selecting the device would resume it again */
+	m_powerDown = false;
+
 	DF_CS_deselect();    /* Make sure to toggle CS signal in order */
 	DF_CS_select();      /* to reset Dataflash command decoder     */
 	
 	/* Send opcode */
+	DF_TRACE(AT45DB161D_RESUME_FROM_DEEP_POWER_DOWN);
 	m_SPI->transfer(AT45DB161D_RESUME_FROM_DEEP_POWER_DOWN);
 	
 	/* Resume device */
 	DF_CS_deselect();
 	
 	/* The CS pin must stay high during t_RDPD microseconds before the device
-	 * can receive any commands.
-	 * On the at45db161D t_RDPD = 35 microseconds. But we will wait 100
-	 * (just to be sure). */
-	delay(100);
+	 * can receive any commands. */
+	delayMicroseconds(DATAFLASH_T_RDPD_MAX);
+}
+
+/**
+ * Let PowerDownIfIdle put the device into Deep Power-down mode after a
+ * quiet period. The time of each command is only recorded while a
+ * timeout is set.
+ * @param timeout Microseconds since the last command, 0 to disable
+ **/
+void AT45DB161D::SetPowerDownTimeout(uint32_t timeout)
+{
+	m_powerDownTimeout = timeout;
+	m_lastCommand = micros();
+}
+
+/**
+ * Enter Deep Power-down mode if no command was sent for the timeout set
+ * with SetPowerDownTimeout and the device is idle: no DMA transfer in
+ * progress or held, no operation still running. The quiet period
+ * starts over once a running operation is found done. To be called from
+ * the main loop; the next command resumes the device, waiting t_RDPD.
+ * The checks are made again and the command sent with interrupts off,
+ * so a command started by an interrupt handler, e.g. one submitting to
+ * a DataFlashQueue, is never cut off. That command busy-waits t_RDPD
+ * (35 us) if it comes after the power-down.
+ * @return true if the device was powered down
+ **/
+bool AT45DB161D::PowerDownIfIdle()
+{
+	if(!m_powerDownTimeout || m_powerDown)
+		return false;
+
+	if(m_dmaStatus == DATAFLASH_DMA_BUSY || m_dmaHold)
+		return false;
+
+	if(micros() - m_lastCommand < m_powerDownTimeout)
+		return false;
+
+	/* The quiet period starts over at the end of a running operation */
+	if(m_operation.pending)
+	{
+		if(!Poll())
+			m_lastCommand = micros();
+		return false;
+	}
+
+	/* An interrupt handler may have started a command since: checked
+	 * again, and the command sent, before it can start another one */
+	noInterrupts();
+
+	if(m_powerDown || m_dmaStatus == DATAFLASH_DMA_BUSY || m_dmaHold || m_operation.pending ||
+	   micros() - m_lastCommand < m_powerDownTimeout)
+	{
+		interrupts();
+		return false;
+	}
+
+	EnterDeepPowerDown();
+
+	interrupts();
+	return true;
 }
 
 /**
@@ -681,6 +2322,8 @@ void AT45DB161D::ResumeFromDeepPowerDown()
  **/
 void AT45DB161D::HardReset()
 {
+	InvalidateBuffers();
+
 	gpio_write_bit(m_resetGPIO, m_resetPin, 0);
 
 	/* The reset pin should stay low for at least 10ms (table 18.4)*/
@@ -9,6 +9,7 @@
 #include "wirish.h"
 
 #include "gpio.h"
+#include "dma.h"
 
 #include "at45db161d_commands.h"
 
@@ -29,6 +30,34 @@
  * @} 
  **/
 
+/**
+ * @defgroup Performance counters
+ * Define DATAFLASH_STATS_ENABLED to have the driver count the commands
+ * it sends, the bytes it moves, CS toggles, status polls and the time
+ * spent waiting for the chip (see AT45DB161D::Stats). Without it the
+ * counters and their cost are compiled out.
+ * @{
+ **/
+/**
+ * @} 
+ **/
+
+/**
+ * @defgroup Command trace
+ * Define DATAFLASH_TRACE_ENABLED to have the driver record the commands
+ * it sends in a ring of the last DATAFLASH_TRACE_SIZE ones (see
+ * AT45DB161D::TraceEntry). DumpTrace prints it for host/trace-decode,
+ * which shows the timeline and the gaps between commands.
+ * @{
+ **/
+#ifndef DATAFLASH_TRACE_SIZE
+/** Number of commands kept, a power of two **/
+#define DATAFLASH_TRACE_SIZE 64
+#endif
+/**
+ * @} 
+ **/
+
 /**
  * @defgroup PINOUT Default pinout
  * @{
@@ -43,6 +72,141 @@
  * @} 
  **/
 
+/**
+ * @defgroup GEOMETRY Geometry
+ * @{
+ **/
+/**
+ * Page and buffer size in standard DataFlash mode. The driver finds the
+ * actual geometry at begin(), see PageSize().
+ **/
+#define DATAFLASH_PAGE_SIZE		528
+/** Page and buffer size in "power of 2" binary mode **/
+#define DATAFLASH_BINARY_PAGE_SIZE	512
+/** Number of main memory pages **/
+#define DATAFLASH_PAGE_COUNT	4096
+/** Pages per block **/
+#define DATAFLASH_BLOCK_PAGES	8
+/** Pages per sector (sectors 0a and 0b together form sector 0) **/
+#define DATAFLASH_SECTOR_PAGES	256
+/** Number of sectors, counting 0a and 0b as one **/
+#define DATAFLASH_SECTOR_COUNT	(DATAFLASH_PAGE_COUNT / DATAFLASH_SECTOR_PAGES)
+/** Page number meaning "no page" **/
+#define DATAFLASH_NO_PAGE		0xFFFF
+/**
+ * @} 
+ **/
+
+/**
+ * @defgroup PARTS DataFlash parts
+ * Geometry of each part, as compile-time constants: density code of the
+ * status register, page size in standard mode, number of pages, pages
+ * per sector and number of address bits of the byte within a page in
+ * standard mode. Binary mode pages are the power of two just below, one
+ * address bit less.
+ * @{
+ **/
+/** AT45DB011D **/
+struct dataflash_at45db011d
+{
+	enum { DENSITY = 0x0C, PAGE_SIZE = 264, PAGE_COUNT = 512, SECTOR_PAGES = 128, OFFSET_BITS = 9 };
+};
+/** AT45DB021D **/
+struct dataflash_at45db021d
+{
+	enum { DENSITY = 0x14, PAGE_SIZE = 264, PAGE_COUNT = 1024, SECTOR_PAGES = 128, OFFSET_BITS = 9 };
+};
+/** AT45DB041D **/
+struct dataflash_at45db041d
+{
+	enum { DENSITY = 0x1C, PAGE_SIZE = 264, PAGE_COUNT = 2048, SECTOR_PAGES = 256, OFFSET_BITS = 9 };
+};
+/** AT45DB081D **/
+struct dataflash_at45db081d
+{
+	enum { DENSITY = 0x24, PAGE_SIZE = 264, PAGE_COUNT = 4096, SECTOR_PAGES = 256, OFFSET_BITS = 9 };
+};
+/** AT45DB161D **/
+struct dataflash_at45db161d
+{
+	enum { DENSITY = 0x2C, PAGE_SIZE = 528, PAGE_COUNT = 4096, SECTOR_PAGES = 256, OFFSET_BITS = 10 };
+};
+/** AT45DB321D **/
+struct dataflash_at45db321d
+{
+	enum { DENSITY = 0x34, PAGE_SIZE = 528, PAGE_COUNT = 8192, SECTOR_PAGES = 128, OFFSET_BITS = 10 };
+};
+/** AT45DB642D **/
+struct dataflash_at45db642d
+{
+	enum { DENSITY = 0x3C, PAGE_SIZE = 1056, PAGE_COUNT = 8192, SECTOR_PAGES = 256, OFFSET_BITS = 11 };
+};
+
+/**
+ * Page size configuration of a part.
+ **/
+typedef enum dataflash_page_mode
+{
+	DATAFLASH_PAGE_STANDARD,	/**< DataFlash page size (264, 528 or 1056 bytes) **/
+	DATAFLASH_PAGE_BINARY		/**< "Power of 2" page size (256, 512 or 1024 bytes) **/
+} dataflash_page_mode;
+/**
+ * @} 
+ **/
+
+/**
+ * @defgroup TIMING Typical operation times
+ * Typical values from the datasheet AC characteristics, in
+ * microseconds. Poll() doesn't read the status register before they
+ * have elapsed.
+ * @{
+ **/
+/** Page to buffer transfer/compare (tXFR) **/
+#define DATAFLASH_T_XFR	200
+/** Page erase and programming (tEP) **/
+#define DATAFLASH_T_EP	14000
+/** Page programming (tP) **/
+#define DATAFLASH_T_P	2000
+/** Page erase (tPE) **/
+#define DATAFLASH_T_PE	13000
+/** Block erase (tBE) **/
+#define DATAFLASH_T_BE	30000
+/** Sector erase (tSE) **/
+#define DATAFLASH_T_SE	1600000
+/** Chip erase (tCE) **/
+#define DATAFLASH_T_CE	12500000
+/**
+ * @} 
+ **/
+
+/**
+ * @defgroup TIMING_MAX Maximum operation times
+ * Worst case values from the datasheet AC characteristics, in
+ * microseconds, over the voltage and temperature range.
+ * @{
+ **/
+/** Page to buffer transfer/compare (tXFR) **/
+#define DATAFLASH_T_XFR_MAX	200
+/** Page erase and programming (tEP) **/
+#define DATAFLASH_T_EP_MAX	35000
+/** Page programming (tP) **/
+#define DATAFLASH_T_P_MAX	4000
+/** Page erase (tPE) **/
+#define DATAFLASH_T_PE_MAX	32000
+/** Block erase (tBE) **/
+#define DATAFLASH_T_BE_MAX	75000
+/** Sector erase (tSE) **/
+#define DATAFLASH_T_SE_MAX	5000000
+/** Chip erase (tCE) **/
+#define DATAFLASH_T_CE_MAX	25000000
+/** Chip select high to deep power-down (tEDPD) **/
+#define DATAFLASH_T_EDPD_MAX	3
+/** Chip select high to standby, out of deep power-down (tRDPD) **/
+#define DATAFLASH_T_RDPD_MAX	35
+/**
+ * @} 
+ **/
+
 /**
  * @defgroup STATUS_REGISTER_FORMAT Status register format
  * @{
@@ -84,6 +248,8 @@
  * The device density is provided only for backward compatibility.
  **/
 #define DATAFLASH_STATUS_DEVICE_DENSITY 0x2C 
+/** Mask of the density bits **/
+#define DATAFLASH_STATUS_DENSITY_MASK 0x3C
 /**
  * @}
  **/
@@ -97,6 +263,62 @@ typedef enum dataflash_buffer
 	DATAFLASH_BUFFER2 = 2
 } dataflash_buffer;
 
+/**
+ * Self-timed operations, during which the chip is busy.
+ **/
+typedef enum dataflash_op
+{
+	DATAFLASH_OP_NONE,						/**< Nothing started yet **/
+	DATAFLASH_OP_BUFFER_TO_PAGE,			/**< Buffer to main memory page program **/
+	DATAFLASH_OP_PAGE_TO_BUFFER,			/**< Main memory page to buffer transfer **/
+	DATAFLASH_OP_COMPARE,					/**< Main memory page to buffer compare **/
+	DATAFLASH_OP_PAGE_ERASE,				/**< Page erase **/
+	DATAFLASH_OP_BLOCK_ERASE,				/**< Block erase **/
+	DATAFLASH_OP_SECTOR_ERASE,				/**< Sector erase **/
+	DATAFLASH_OP_CHIP_ERASE,				/**< Chip erase **/
+	DATAFLASH_OP_PAGE_WRITE_THROUGH_BUFFER,	/**< Main memory page program through buffer **/
+	DATAFLASH_OP_AUTO_PAGE_REWRITE,			/**< Auto page rewrite through buffer **/
+	DATAFLASH_OP_COUNT						/**< Number of operation types **/
+} dataflash_op;
+
+/**
+ * State of the DMA transfer of a DataFlash instance.
+ **/
+typedef enum dataflash_dma_status
+{
+	DATAFLASH_DMA_IDLE,		/**< No transfer started yet **/
+	DATAFLASH_DMA_BUSY,		/**< Transfer in progress **/
+	DATAFLASH_DMA_DONE,		/**< Last transfer completed **/
+	DATAFLASH_DMA_ERROR		/**< Last transfer failed or could not start **/
+} dataflash_dma_status;
+
+/**
+ * Handler called from the DMA interrupt when a transfer ends.
+ * @param context Pointer given to AttachDMAInterrupt
+ **/
+typedef void (*dataflash_dma_handler)(void *context);
+
+/**
+ * Handler called each time a program or erase operation is started.
+ * @param context Pointer given to AttachProgramHandler
+ * @param type Operation being started
+ * @param address Page or block it works on, first page erased by a
+ *        sector erase
+ **/
+typedef void (*dataflash_program_handler)(void *context, dataflash_op type, uint16_t address);
+
+/**
+ * Largest gap between two ranges read by ReadV with a single command.
+ * Starting a new Continuous Array Read costs 4 bytes and a CS toggle.
+ **/
+#define DATAFLASH_READV_MAX_GAP 16
+
+/**
+ * Largest number of bytes moved by a single DMA request. Longer
+ * transfers are split and re-armed from the completion interrupt.
+ **/
+#define DATAFLASH_DMA_MAX_TRANSFER 65535
+
 /**
  * @brief at45db161d module
  **/
@@ -115,6 +337,75 @@ class AT45DB161D
 			uint8_t extendedInfoLength; /**< Extended device information string length **/
 		};
 
+		/**
+		 * @brief Operation record
+		 * State of the self-timed operation (program, erase, transfer or
+		 * compare) started last.
+		 **/
+		struct Operation
+		{
+			dataflash_op type;	/**< Operation started last                      **/
+			uint16_t address;	/**< Page or block, first page of sector erases  **/
+			uint32_t started;	/**< micros() when it was started                **/
+			uint32_t expected;	/**< Typical duration in microseconds            **/
+			uint32_t completed;	/**< micros() when it was seen over              **/
+			uint8_t status;		/**< Status register read when it was seen over  **/
+			bool pending;		/**< Started and not seen over yet               **/
+			uint8_t buffer;		/**< Buffer it uses (1 or 2), or 0               **/
+		};
+
+#ifdef DATAFLASH_STATS_ENABLED
+		/**
+		 * @brief Performance counters
+		 * Counts since construction or the last ResetStats.
+		 **/
+		struct Stats
+		{
+			uint32_t operations[DATAFLASH_OP_COUNT];	/**< Self-timed operations started, by type **/
+			uint32_t arrayReads;		/**< Continuous Array Read commands            **/
+			uint32_t pageReads;			/**< Main Memory Page Read commands            **/
+			uint32_t bufferReads;		/**< Buffer Read commands                      **/
+			uint32_t bufferWrites;		/**< Buffer Write commands                     **/
+			uint32_t statusReads;		/**< Status Register Read commands             **/
+			uint32_t statusPolls;		/**< Status register values clocked in         **/
+			uint32_t bytesRead;			/**< Data bytes received, DMA included         **/
+			uint32_t bytesWritten;		/**< Data bytes sent, DMA included             **/
+			uint32_t csToggles;			/**< Times CS was asserted                     **/
+			uint32_t waits;				/**< Waits for the chip to be ready            **/
+			uint32_t waitTime;			/**< Microseconds spent waiting for the chip   **/
+			uint32_t waitMax;			/**< Longest wait                              **/
+			uint32_t compareWaitTime;	/**< Part of waitTime spent on compares        **/
+			uint32_t compareWaitMax;	/**< Longest wait for a compare                **/
+			uint32_t unchangedPages;	/**< Programs skipped by UpdatePage            **/
+		};
+#endif
+
+#ifdef DATAFLASH_TRACE_ENABLED
+		/**
+		 * @brief Command trace entry
+		 * A command lasts from its opcode to the release of CS, so a
+		 * status read waiting for the chip lasts as long as the wait.
+		 **/
+		struct TraceEntry
+		{
+			uint32_t start;		/**< micros() when the opcode was sent        **/
+			uint32_t end;		/**< micros() when CS was released, 0 if not yet **/
+			uint32_t command;	/**< Opcode in the top byte, address below   **/
+			uint32_t length;	/**< Data bytes moved, DMA included          **/
+		};
+#endif
+
+		/**
+		 * @brief Range of main memory for ReadV
+		 **/
+		struct ReadRange
+		{
+			uint16_t page;		/**< Page where the range starts   **/
+			uint16_t offset;	/**< Starting byte within the page **/
+			uint8_t *dst;		/**< Destination, at least len bytes **/
+			size_t len;			/**< Number of bytes to read       **/
+		};
+
 	public:
 		/**
 		 * Constructor. Calls the corresponding begin function with pin definitions.
@@ -179,6 +470,8 @@ class AT45DB161D
 		 **/
 		inline void Enable()
 		{
+			if(m_powerDown)
+				ResumeFromDeepPowerDown();
 			gpio_write_bit(m_chipSelectGPIO, m_chipSelectPin, 0);
 		}
 	
@@ -204,6 +497,62 @@ class AT45DB161D
 		 * @param id Pointer to the ID structure to initialize
 		 **/
 		void ReadManufacturerAndDeviceID(struct AT45DB161D::ID *id);
+
+		/**
+		 * Read the page size mode and the density from the status register
+		 * and switch to the matching geometry and address encoding. Done
+		 * by the first command after begin(), once SPI is set up.
+		 * AT45DB instances have their geometry fixed instead. Resumes the
+		 * device from Deep Power-down first.
+		 * @return false if the density is unknown, the geometry is left as
+		 *         is and detected again by the next command
+		 **/
+		bool DetectGeometry();
+
+		/**
+		 * Bytes per page and per buffer: 528 or 512 on the AT45DB161D.
+		 **/
+		inline uint16_t PageSize()
+		{
+			CheckGeometry();
+			return m_pageSize;
+		}
+
+		/**
+		 * Number of main memory pages.
+		 **/
+		inline uint16_t PageCount()
+		{
+			CheckGeometry();
+			return m_pageCount;
+		}
+
+		/**
+		 * Pages per sector.
+		 **/
+		inline uint16_t SectorPages()
+		{
+			CheckGeometry();
+			return m_sectorPages;
+		}
+
+		/**
+		 * Check if pages are configured for the "power of 2" binary size.
+		 **/
+		inline bool IsBinaryPageMode()
+		{
+			CheckGeometry();
+			return m_binaryPages;
+		}
+
+		/**
+		 * Split a linear byte address of the main memory into page and
+		 * offset. Shifts are enough in binary page mode.
+		 * @param address Byte address, from 0 to PageCount() * PageSize() - 1
+		 * @param page Set to the page
+		 * @param offset Set to the byte within the page
+		 **/
+		void LinearToPage(uint32_t address, uint16_t *page, uint16_t *offset);
 		
 		/** 
 		 * A main memory page read allows the user to read data directly from
@@ -240,6 +589,141 @@ class AT45DB161D
 		 * @param offset Starting byte within the buffer
 		 **/
 		void BufferWrite(dataflash_buffer bufferNum, uint16_t offset);
+
+		/**
+		 * Read a span of main memory into RAM using a Continuous Array
+		 * Read. The read runs across page boundaries and wraps from the
+		 * last page back to the first one.
+		 * @param page Page of the main memory where the read starts
+		 * @param offset Starting byte address within the page
+		 * @param dst Destination, at least len bytes
+		 * @param len Number of bytes to read
+		 **/
+		void Read(uint16_t page, uint16_t offset, uint8_t *dst, size_t len);
+
+		/**
+		 * Read several ranges of main memory. Ranges are taken in address
+		 * order, and those less than DATAFLASH_READV_MAX_GAP bytes apart are
+		 * read with one Continuous Array Read, the bytes between them being
+		 * clocked in and dropped. Ranges may overlap.
+		 * @param ranges Ranges to read, in any order
+		 * @param n Number of ranges
+		 * @note Ordering costs n * n comparisons, meant for tens of ranges.
+		 **/
+		void ReadV(const struct AT45DB161D::ReadRange *ranges, size_t n);
+
+		/**
+		 * Read a span of one of the SRAM data buffers into RAM. The read
+		 * wraps around to the beginning of the buffer.
+		 * @param bufferNum Buffer to read (1 or 2)
+		 * @param offset Starting byte within the buffer
+		 * @param dst Destination, at least len bytes
+		 * @param len Number of bytes to read
+		 **/
+		void ReadBuffer(dataflash_buffer bufferNum, uint16_t offset, uint8_t *dst, size_t len);
+
+		/**
+		 * Write a span of RAM to one of the SRAM data buffers. The write
+		 * wraps around to the beginning of the buffer.
+		 * @param bufferNum Buffer to write (1 or 2)
+		 * @param offset Starting byte within the buffer
+		 * @param src Source, at least len bytes
+		 * @param len Number of bytes to write
+		 **/
+		void WriteBuffer(dataflash_buffer bufferNum, uint16_t offset, const uint8_t *src, size_t len);
+
+		/**
+		 * Start a DMA read of a span of main memory using a Continuous
+		 * Array Read. Returns at once; the transfer completes in the
+		 * background and releases CS when done.
+		 * @param page Page of the main memory where the read starts
+		 * @param offset Starting byte address within the page
+		 * @param dst Destination, at least len bytes, valid until the end of the transfer
+		 * @param len Number of bytes to read
+		 * @return false if the transfer could not be started
+		 * @note No other command may be issued while DMAStatus() is DATAFLASH_DMA_BUSY.
+		 **/
+		bool ReadDMA(uint16_t page, uint16_t offset, uint8_t *dst, size_t len);
+
+		/**
+		 * Start a Continuous Array Read fed by DMA in several pieces.
+		 * CS stays low between the pieces, each requested with
+		 * ContinueReadDMA, so that the read goes on where the previous
+		 * piece ended. The clock stops in between, which the device
+		 * allows for as long as needed.
+		 * @param page Page of the main memory where the read starts
+		 * @param offset Starting byte address within the page
+		 * @return false if DMA is not available
+		 * @note No other command may be issued until EndReadDMA.
+		 **/
+		bool BeginReadDMA(uint16_t page, uint16_t offset);
+
+		/**
+		 * Read the next piece of the read started by BeginReadDMA. May be
+		 * called from the DMA interrupt handler.
+		 * @param dst Destination, at least len bytes, valid until the end of the transfer
+		 * @param len Number of bytes to read
+		 * @return false if no read is open or a transfer is running
+		 **/
+		bool ContinueReadDMA(uint8_t *dst, size_t len);
+
+		/**
+		 * Wait for the current piece and end the read started by
+		 * BeginReadDMA.
+		 **/
+		void EndReadDMA();
+
+		/**
+		 * Start a DMA read of a main memory page, bypassing the buffers.
+		 * The read wraps around within the page.
+		 * @param page Page of the main memory to read
+		 * @param offset Starting byte address within the page
+		 * @param dst Destination, at least len bytes, valid until the end of the transfer
+		 * @param len Number of bytes to read
+		 * @return false if the transfer could not be started
+		 **/
+		bool ReadPageDMA(uint16_t page, uint16_t offset, uint8_t *dst, size_t len);
+
+		/**
+		 * Start a DMA read of one of the SRAM data buffers.
+		 * @param bufferNum Buffer to read (1 or 2)
+		 * @param offset Starting byte within the buffer
+		 * @param dst Destination, at least len bytes, valid until the end of the transfer
+		 * @param len Number of bytes to read
+		 * @return false if the transfer could not be started
+		 **/
+		bool ReadBufferDMA(dataflash_buffer bufferNum, uint16_t offset, uint8_t *dst, size_t len);
+
+		/**
+		 * Start a DMA write to one of the SRAM data buffers.
+		 * @param bufferNum Buffer to write (1 or 2)
+		 * @param offset Starting byte within the buffer
+		 * @param src Source, at least len bytes, valid until the end of the transfer
+		 * @param len Number of bytes to write
+		 * @return false if the transfer could not be started
+		 **/
+		bool WriteBufferDMA(dataflash_buffer bufferNum, uint16_t offset, const uint8_t *src, size_t len);
+
+		/**
+		 * State of the current or last DMA transfer.
+		 **/
+		inline dataflash_dma_status DMAStatus()
+		{
+			return m_dmaStatus;
+		}
+
+		/**
+		 * Wait for the current DMA transfer to end.
+		 * @return true if it completed without error
+		 **/
+		bool WaitForDMA();
+
+		/**
+		 * Call a handler from the DMA interrupt at the end of every transfer.
+		 * @param handler Handler, or NULL to remove it
+		 * @param context Passed to the handler
+		 **/
+		void AttachDMAInterrupt(dataflash_dma_handler handler, void *context);
 		
 		/**
 		 * Transfer data from buffer 1 or 2 to main memory page.
@@ -250,19 +734,46 @@ class AT45DB161D
 		 **/
 		void BufferToPage(dataflash_buffer bufferNum, uint16_t page, uint8_t erase);		
 
+		/**
+		 * Start a transfer from buffer 1 or 2 to a main memory page and
+		 * return without waiting for the end of the programming.
+		 * @param bufferNum Buffer to use (1 or 2)
+		 * @param page Page where the content of the buffer will transfered
+		 * @param erase If set the page will be first erased before the buffer transfer.
+		 **/
+		void StartBufferToPage(dataflash_buffer bufferNum, uint16_t page, uint8_t erase);
+
 		/**
 		 * Transfer a page of data from main memory to buffer 1 or 2.
+		 * Nothing is sent if the buffer already holds an unmodified copy
+		 * of the page.
 		 * @param page Main memory page to transfer
 		 * @param bufferNum Buffer (1 or 2) where the data will be written
 		 **/
 		void PageToBuffer(uint16_t page, dataflash_buffer bufferNum);
 
+		/**
+		 * Start a transfer of a page of data from main memory to buffer 1 or 2
+		 * and return without waiting for its end. Nothing is sent if the buffer
+		 * already holds an unmodified copy of the page.
+		 * @param page Main memory page to transfer
+		 * @param bufferNum Buffer (1 or 2) where the data will be written
+		 **/
+		void StartPageToBuffer(uint16_t page, dataflash_buffer bufferNum);
+
 		/** 
 		 * Erase a page in the main memory array.
 		 * @param page Page to erase
 		 * @warning UNTESTED
 		 **/
 		void PageErase(uint16_t page);
+
+		/** 
+		 * Start erasing a page in the main memory array and return without
+		 * waiting for the end of the erase.
+		 * @param page Page to erase
+		 **/
+		void StartPageErase(uint16_t page);
 		
 		/**
 		 * Erase a block of eight pages at one time.
@@ -271,14 +782,43 @@ class AT45DB161D
 		 **/
 		void BlockErase(uint16_t block);
 
+		/**
+		 * Start erasing a block of eight pages and return without waiting
+		 * for the end of the erase.
+		 * @param block Index of the block to erase
+		 **/
+		void StartBlockErase(uint16_t block);
+
 		/** 
 		 * Erase a sector in main memory. There are 16 sector on the
 		 * at45db161d and only one can be erased at one time.
-		 * @param sector Sector to erase
-		 * @warning UNTESTED
+		 * @param sector Sector to erase, or 0x0a/0x0b for sector 0a/0b
+		 * @note Sectors 10 and 11 can't be named, use SectorEraseAt.
 		 **/
 		void SectorErase(uint8_t sector);
 
+		/** 
+		 * Start erasing a sector in main memory and return without waiting
+		 * for the end of the erase.
+		 * @param sector Sector to erase, or 0x0a/0x0b for sector 0a/0b
+		 * @note Sectors 10 and 11 can't be named, use StartSectorEraseAt.
+		 **/
+		void StartSectorErase(uint8_t sector);
+
+		/**
+		 * Erase the sector holding a page. Within sector 0, only the part
+		 * holding the page is erased: sector 0a (block 0) or 0b (the rest).
+		 * @param page Any page of the sector
+		 **/
+		void SectorEraseAt(uint16_t page);
+
+		/**
+		 * Start erasing the sector holding a page and return without
+		 * waiting for the end of the erase.
+		 * @param page Any page of the sector
+		 **/
+		void StartSectorEraseAt(uint16_t page);
+
 #ifdef CHIP_ERASE_ENABLED
 		/** 
 		 * Erase the entire chip memory. Sectors proteced or locked down will
@@ -287,6 +827,13 @@ class AT45DB161D
 		 * @warning MAY DAMAGE CHIP, READ DATASHEET FOR DETAILS
 		 **/
 		void ChipErase();
+
+		/** 
+		 * Start erasing the entire chip memory and return without waiting
+		 * for the end of the erase.
+		 * @warning MAY DAMAGE CHIP, READ DATASHEET FOR DETAILS
+		 **/
+		void StartChipErase();
 #endif
 
 		/**
@@ -306,6 +853,179 @@ class AT45DB161D
 		 **/
 		void EndAndWait();
 
+		/**
+		 * Perform a low-to-high transition on the CS pin, starting the
+		 * command begun by BeginPageWriteThroughBuffer, and return without
+		 * waiting for its end.
+		 **/
+		void End();
+
+		/**
+		 * Read the status register once and update the operation record.
+		 * @return true while the chip is busy
+		 **/
+		bool IsBusy();
+
+		/**
+		 * Check if the operation started last is still running. The status
+		 * register is not read before the typical duration of the operation
+		 * has elapsed, so calling Poll often costs no SPI traffic.
+		 * @return true while the operation is running
+		 * @note The chip may be done sooner than the typical duration. Use
+		 *       IsBusy() to find out at the earliest.
+		 **/
+		bool Poll();
+
+		/**
+		 * Wait for the end of the operation started last, if any.
+		 * @return Status register value read at the end of the operation
+		 **/
+		uint8_t WaitForOperation();
+
+		/**
+		 * State of the operation started last.
+		 **/
+		inline const struct AT45DB161D::Operation &LastOperation()
+		{
+			return m_operation;
+		}
+
+#ifdef DATAFLASH_STATS_ENABLED
+		/**
+		 * Copy the performance counters.
+		 * @param stats Snapshot to fill
+		 **/
+		void GetStats(struct AT45DB161D::Stats *stats);
+
+		/**
+		 * Set the performance counters back to zero.
+		 **/
+		void ResetStats();
+#endif
+
+#ifdef DATAFLASH_TRACE_ENABLED
+		/**
+		 * Print the command trace, oldest first, one command per line:
+		 * start and end time, opcode, address and length.
+		 * @param out Where to print, a serial port usually
+		 **/
+		void DumpTrace(Print *out);
+
+		/**
+		 * Forget the commands traced so far.
+		 **/
+		void ClearTrace();
+#endif
+
+		/**
+		 * Main memory page mirrored by a buffer. The driver follows the
+		 * transfers, programs and erases it issues to know it.
+		 * @param bufferNum Buffer (1 or 2)
+		 * @return Page number, or DATAFLASH_NO_PAGE if unknown
+		 **/
+		uint16_t BufferPage(dataflash_buffer bufferNum);
+
+		/**
+		 * Check if a buffer was written since it last matched its page.
+		 * @param bufferNum Buffer (1 or 2)
+		 **/
+		bool IsBufferDirty(dataflash_buffer bufferNum);
+
+		/**
+		 * Look for a buffer mirroring a page.
+		 * @param page Main memory page
+		 * @param bufferNum Set to the buffer holding the page, if any
+		 * @return true if a buffer holds the page
+		 **/
+		bool FindBuffer(uint16_t page, dataflash_buffer *bufferNum);
+
+		/**
+		 * Forget what the buffers hold. Needed after driving the chip with raw
+		 * SPI transfers that change the buffers or the main memory.
+		 **/
+		void InvalidateBuffers();
+
+		/**
+		 * Read a span of a page through one of the SRAM buffers. A page already
+		 * held by a buffer is read from it without accessing the main memory,
+		 * including changes written to the buffer and not programmed yet.
+		 * Otherwise the page is loaded into a buffer with no pending changes,
+		 * or read directly if both have some.
+		 * @param page Main memory page to read
+		 * @param offset Starting byte within the page
+		 * @param dst Destination, at least len bytes
+		 * @param len Number of bytes to read, up to the end of the page
+		 **/
+		void ReadThroughBuffer(uint16_t page, uint16_t offset, uint8_t *dst, size_t len);
+
+		/**
+		 * Start a sequential write of whole pages through both SRAM
+		 * buffers. While one buffer is being programmed into main memory,
+		 * StreamWrite fills the other one over SPI, so the write runs at
+		 * the programming speed of the chip.
+		 * @param page First page to write
+		 * @param erase If set every page is erased before being programmed
+		 * @note No other command may be issued until EndStreamWrite.
+		 **/
+		void BeginStreamWrite(uint16_t page, uint8_t erase);
+
+		/**
+		 * Append data to the stream write. Each time a buffer is full it
+		 * is programmed into the next page and filling goes on in the
+		 * other buffer.
+		 * @param src Source, at least len bytes
+		 * @param len Number of bytes to write
+		 **/
+		void StreamWrite(const uint8_t *src, size_t len);
+
+		/**
+		 * Program the last, partially filled page and wait for the
+		 * chip to be ready. The rest of a partial page is filled with 0xFF.
+		 * @return Number of the page following the last page written
+		 **/
+		uint16_t EndStreamWrite();
+
+		/**
+		 * Write a span of pages, erasing them with as little time as
+		 * possible. Whole blocks, or whole sectors when that is quicker,
+		 * are erased ahead and programmed without the built-in erase;
+		 * only the pages at the ragged ends of the range are erased one
+		 * by one. Programming goes through both buffers, as StreamWrite.
+		 * @param page First page to write
+		 * @param src Source, at least len bytes
+		 * @param len Number of bytes to write. The rest of the last page
+		 *        is filled with 0xFF.
+		 * @return Number of the page following the last page written
+		 **/
+		uint16_t BulkWrite(uint16_t page, const uint8_t *src, size_t len);
+
+		/**
+		 * Write a whole page only if its content changes. The data goes
+		 * into a buffer and the chip compares it to the page (tXFR);
+		 * the page is erased and programmed only if they differ.
+		 * @param page Page to write
+		 * @param src Source, a whole page
+		 * @param bufferNum Buffer to go through (1 or 2)
+		 * @return true if the page was programmed, false if it already
+		 *         held the data
+		 **/
+		bool UpdatePage(uint16_t page, const uint8_t *src, dataflash_buffer bufferNum);
+
+		/**
+		 * Write bytes anywhere in main memory, leaving the rest of the
+		 * pages as they are. Each page is changed in a buffer and
+		 * reprogrammed: only the bytes written go over SPI, and pages
+		 * written whole are not loaded first.
+		 * @param address Linear byte address, see LinearToPage
+		 * @param src Source, at least len bytes
+		 * @param len Number of bytes to write. Bytes past the end of the
+		 *        main memory are dropped.
+		 * @note Changes written to a buffer and not programmed are kept
+		 *       if the buffer mirrors a page written, and may be lost
+		 *       otherwise.
+		 **/
+		void Write(uint32_t address, const uint8_t *src, size_t len);
+
 		/**
 		 * Compare a page of data in main memory to the data in buffer 1 or 2.
 		 * @param page Page to test
@@ -313,25 +1033,78 @@ class AT45DB161D
 		 * @return
 		 *		- 1 if the page and the buffer contains the same data
 		 * 		- 0 else
-		 * @warning UNTESTED
 		 **/
 		int8_t ComparePageToBuffer(uint16_t page, dataflash_buffer bufferNum);
 
 		/**
-		 * Put the device into the lowest power consumption mode.
-		 * Once the device has entered the Deep Power-down mode, all
-		 * instructions are ignored except the Resume from Deep
-		 * Power-down command.
-		 * @warning UNTESTED
+		 * Start comparing a page of data in main memory to the data in
+		 * buffer 1 or 2 and return without waiting for the result. Once the
+		 * operation is over, DATAFLASH_STATUS_COMPARE in its status tells if
+		 * they differ.
+		 * @param page Page to test
+		 * @param bufferNum Buffer number
+		 **/
+		void StartComparePageToBuffer(uint16_t page, dataflash_buffer bufferNum);
+
+		/**
+		 * Refresh a page with Auto Page Rewrite: the page is transferred
+		 * into a buffer, then erased and programmed back from it.
+		 * @param page Page to rewrite
+		 * @param bufferNum Buffer to go through (1 or 2). Its content is lost.
+		 **/
+		void AutoPageRewrite(uint16_t page, dataflash_buffer bufferNum);
+
+		/**
+		 * Start an Auto Page Rewrite and return without waiting for its end.
+		 * @param page Page to rewrite
+		 * @param bufferNum Buffer to go through (1 or 2). Its content is lost.
+		 **/
+		void StartAutoPageRewrite(uint16_t page, dataflash_buffer bufferNum);
+
+		/**
+		 * Call a handler each time a program or erase operation is started,
+		 * e.g. to count the operations per sector.
+		 * @param handler Handler, or NULL to remove it
+		 * @param context Passed to the handler
+		 **/
+		void AttachProgramHandler(dataflash_program_handler handler, void *context);
+
+		/**
+		 * Put the device into the lowest power consumption mode, once the
+		 * operation in progress is done. The next command resumes it.
 		 **/
 		void DeepPowerDown();
 
 		/**
-		 * Takes the device out of Deep Power-down mode.
-		 * @warning UNTESTED
+		 * Takes the device out of Deep Power-down mode, waiting t_RDPD
+		 * (35 us) with the CPU.
 		 **/
 		void ResumeFromDeepPowerDown();
 
+		/**
+		 * Let PowerDownIfIdle put the device into Deep Power-down mode
+		 * after a quiet period. The first command after that waits t_RDPD
+		 * (35 us) to resume it, even in an interrupt handler.
+		 * @param timeout Microseconds since the last command, 0 to disable
+		 **/
+		void SetPowerDownTimeout(uint32_t timeout);
+
+		/**
+		 * Enter Deep Power-down mode if the timeout set with
+		 * SetPowerDownTimeout has elapsed and the device is idle. To be
+		 * called from the main loop.
+		 * @return true if the device was powered down
+		 **/
+		bool PowerDownIfIdle();
+
+		/**
+		 * Check if the device is in Deep Power-down mode.
+		 **/
+		inline bool IsPoweredDown()
+		{
+			return m_powerDown;
+		}
+
 		/**
 		 * Reset device via the reset pin.
 		 **/
@@ -353,11 +1126,142 @@ class AT45DB161D
 			gpio_write_bit(m_writeProtectGPIO, m_writeProtectPin, 1);
 		}
 		
+	protected:
+		/**
+		 * Set the geometry once and for all, in place of DetectGeometry.
+		 * @param pageSize Bytes per page
+		 * @param pageCount Number of pages
+		 * @param sectorPages Pages per sector
+		 * @param offsetBits Address bits of the byte within a page
+		 * @param binary Pages in "power of 2" binary mode
+		 **/
+		void SetGeometry(uint16_t pageSize, uint16_t pageCount, uint16_t sectorPages, uint8_t offsetBits, bool binary);
+
 	private:
+		/**
+		 * Put the driver state in its power-on condition.
+		 **/
+		void InitState();
+
 		/**
 		 * Reads status register and waits for Dataflash to be ready.
 		 **/
 		void WaitForReady();
+
+		/**
+		 * Record the start of a self-timed operation, waiting for the
+		 * end of the previous one first.
+		 **/
+		void BeginOperation(dataflash_op type, uint16_t address, uint32_t expected, uint8_t bufferNum = 0);
+
+		/**
+		 * Wait for the end of the pending operation if it uses a buffer.
+		 **/
+		void WaitForBuffer(dataflash_buffer bufferNum);
+
+		/**
+		 * Wait for the end of the pending operation before a main memory
+		 * read.
+		 **/
+		void WaitForMainMemory();
+
+		/**
+		 * Forget the buffers mirroring pages about to change in main memory.
+		 **/
+		void InvalidatePages(uint16_t first, uint16_t count);
+
+		/**
+		 * Record the end of the pending operation, if any.
+		 **/
+		void CompleteOperation(uint8_t status);
+
+		/**
+		 * Detect the geometry if not done since begin().
+		 **/
+		inline void CheckGeometry()
+		{
+			if(!m_geometryKnown)
+				DetectGeometry();
+		}
+
+		/**
+		 * Send the 3 address bytes of a page and a byte within it, in the
+		 * encoding of the current page size.
+		 **/
+		void SendAddress(uint16_t page, uint16_t offset);
+
+		/**
+		 * Clock len bytes in from the device, sending dummy bytes.
+		 **/
+		void ReceiveBytes(uint8_t *dst, size_t len);
+
+		/**
+		 * Erase the largest unit starting at a page and lying within a
+		 * range, if it is quicker than erasing its pages one by one.
+		 * @return Number of pages erased, 0 if none
+		 **/
+		uint16_t EraseAhead(uint16_t page, uint16_t end);
+
+		/**
+		 * Send the Deep Power-down command to the idle device.
+		 **/
+		void EnterDeepPowerDown();
+
+#ifdef DATAFLASH_TRACE_ENABLED
+		/**
+		 * Open a trace entry for a command.
+		 **/
+		void TraceCommand(uint8_t opcode);
+#endif
+
+#ifdef DATAFLASH_STATS_ENABLED
+		/**
+		 * Account for a wait for the chip.
+		 **/
+		void CountWait(uint32_t elapsed);
+#endif
+
+		/**
+		 * Clock len bytes in from the device and drop them.
+		 **/
+		void SkipBytes(size_t len);
+
+		/**
+		 * Clock len bytes out to the device, discarding what comes back.
+		 **/
+		void SendBytes(const uint8_t *src, size_t len);
+
+		/**
+		 * Look up the DMA channels serving our SPI port and route their
+		 * interrupts to this instance.
+		 **/
+		bool SetupDMA();
+
+		/**
+		 * Start a transfer of len bytes on the bus of the command just sent.
+		 * @param rx Destination, or NULL to discard received bytes
+		 * @param tx Source, or NULL to send dummy bytes
+		 **/
+		bool StartDMA(uint8_t *rx, const uint8_t *tx, size_t len);
+
+		/**
+		 * Arm the channels for the next piece of the current transfer.
+		 **/
+		void StartDMAChunk();
+
+		/**
+		 * Stop the channels, release CS and report the result.
+		 **/
+		void EndDMA(dataflash_dma_status status);
+
+		/**
+		 * DMA interrupt, shared by the RX and TX channels.
+		 **/
+		void DMAInterrupt();
+
+		static void DMAInterruptSPI1();
+		static void DMAInterruptSPI2();
+		static void DMAInterruptSPI3();
 					
 	private:
 		HardwareSPI *m_SPI;
@@ -370,8 +1274,132 @@ class AT45DB161D
 
 		gpio_dev *m_writeProtectGPIO;	/**< Write protect GPIO (WP) **/
 		uint8_t m_writeProtectPin;		/**< Write protect pin (WP)  **/
+
+		dma_dev *m_dmaDev;				/**< DMA controller serving m_SPI, or NULL **/
+		dma_channel m_dmaRxChannel;		/**< SPI RX channel **/
+		dma_channel m_dmaTxChannel;		/**< SPI TX channel **/
+		uint8_t m_dmaPort;				/**< Index of the SPI port **/
+
+		uint8_t *m_dmaRx;				/**< Next destination, or NULL **/
+		const uint8_t *m_dmaTx;			/**< Next source, or NULL **/
+		size_t m_dmaRemaining;			/**< Bytes not yet handed to the DMA **/
+		volatile dataflash_dma_status m_dmaStatus;
+		bool m_dmaHold;					/**< Keep CS low at the end of transfers **/
+
+		dataflash_dma_handler m_dmaHandler;
+		void *m_dmaContext;
+
+		dataflash_buffer m_streamBuffer;	/**< Buffer being filled by StreamWrite **/
+		uint16_t m_streamPage;			/**< Page the buffer will be programmed into **/
+		uint16_t m_streamOffset;		/**< Bytes already in the buffer **/
+		uint8_t m_streamErase;			/**< Erase pages before programming **/
+
+		uint16_t m_pageSize;			/**< Bytes per page **/
+		uint16_t m_pageCount;			/**< Number of pages **/
+		uint16_t m_sectorPages;			/**< Pages per sector **/
+		uint8_t m_offsetBits;			/**< Address bits of the byte within a page **/
+		bool m_binaryPages;				/**< "Power of 2" page size active **/
+		bool m_geometryKnown;			/**< Geometry read from the device since begin(), or fixed **/
+		bool m_geometryFixed;			/**< Geometry set by SetGeometry **/
+
+		struct Operation m_operation;	/**< Self-timed operation started last **/
+#ifdef DATAFLASH_STATS_ENABLED
+		struct Stats m_stats;			/**< Performance counters **/
+#endif
+#ifdef DATAFLASH_TRACE_ENABLED
+		struct TraceEntry m_trace[DATAFLASH_TRACE_SIZE];	/**< Command trace ring **/
+		uint32_t m_traceNext;			/**< Commands traced since ClearTrace **/
+		struct TraceEntry *m_traceEntry;	/**< Entry of the command in progress, or NULL **/
+#endif
+
+		dataflash_program_handler m_programHandler;
+		void *m_programContext;
+
+		volatile bool m_powerDown;		/**< Deep Power-down entered, resume on the next command **/
+		uint32_t m_powerDownTimeout;	/**< Quiet period before PowerDownIfIdle powers down, or 0 **/
+		volatile uint32_t m_lastCommand;	/**< Time the last command was started **/
+
+		uint16_t m_bufferPage[2];		/**< Page mirrored by each buffer, or DATAFLASH_NO_PAGE **/
+		bool m_bufferDirty[2];			/**< Buffer written since it matched its page **/
+		dataflash_buffer m_bufferLastUsed;	/**< Buffer read last by ReadThroughBuffer **/
 };
 
+/**
+ * @brief DataFlash driver for a given part and page size
+ * The geometry is fixed at compile time instead of being read from the
+ * status register, and its constants are available to size buffers,
+ * e.g. AT45DB<dataflash_at45db321d>::PAGE_SIZE. Instances are used
+ * through the AT45DB161D interface by the other modules, within their
+ * own limits: the refresh workspace is sized for the sectors of the
+ * part, the page cache needs DATAFLASH_CACHE_PAGE_SIZE for pages over
+ * 528 bytes, and a translation layer covers DATAFLASH_FTL_MAX_PAGES.
+ * @param Geometry One of the dataflash_at45dbXXXd parts
+ * @param PageMode Page size the part is configured for
+ **/
+template<class Geometry, dataflash_page_mode PageMode = DATAFLASH_PAGE_STANDARD>
+class AT45DB : public AT45DB161D
+{
+	public:
+		enum
+		{
+			/** Address bits of the byte within a page **/
+			OFFSET_BITS = Geometry::OFFSET_BITS - ((PageMode == DATAFLASH_PAGE_BINARY) ? 1 : 0),
+			/** Bytes per page and per buffer **/
+			PAGE_SIZE = (PageMode == DATAFLASH_PAGE_BINARY) ? (1 << OFFSET_BITS) : Geometry::PAGE_SIZE,
+			/** Number of pages **/
+			PAGE_COUNT = Geometry::PAGE_COUNT,
+			/** Pages per sector **/
+			SECTOR_PAGES = Geometry::SECTOR_PAGES
+		};
+
+	public:
+		/**
+		 * Constructor. Calls the corresponding begin function with pin definitions.
+		 * @param spi Reference to HardwareSPI that the Dataflash module is connected to
+		 * @note Calling begin manually is required with the use of this constructor.
+		 **/
+		AT45DB(HardwareSPI *spi) : AT45DB161D(spi)
+		{
+			SetGeometry(PAGE_SIZE, PAGE_COUNT, SECTOR_PAGES, OFFSET_BITS, PageMode == DATAFLASH_PAGE_BINARY);
+		}
+
+		/**
+		 * Constructor. Calls the corresponding begin function with pin definitions.
+		 * @param spi Reference to HardwareSPI that the Dataflash module is connected to
+		 * @param csPin Chip select (Slave select) pin (CS)
+		 * @param resetPin Reset pin (RESET)
+		 * @param wpPin Write protect pin (WP)
+		 **/
+		AT45DB(HardwareSPI *spi, uint8_t csPin, uint8_t resetPin, uint8_t wpPin) : AT45DB161D(spi, csPin, resetPin, wpPin)
+		{
+			SetGeometry(PAGE_SIZE, PAGE_COUNT, SECTOR_PAGES, OFFSET_BITS, PageMode == DATAFLASH_PAGE_BINARY);
+		}
+
+		/**
+		 * Constructor. Calls the corresponding begin function with pin definitions.
+		 * @param cs_dev GPIO the Chip/Slave Select pin is located on.
+		 * @param cs_pin Bit within the cs_dev GPIO the Chip/Slave Select pin is located on.
+		 * @param reset_dev GPIO the reset pin is located on.
+		 * @param reset_pin Bit within the reset_dev GPIO the reset pin is located on.
+		 * @param wp_dev GPIO the Write Protect pin is located on.
+		 * @param wp_pin Bit within the wp_dev GPIO the Write Protect pin is located on.
+		 **/
+		AT45DB(HardwareSPI *spi, gpio_dev *cs_dev, uint8_t cs_pin, gpio_dev *reset_dev, uint8_t reset_pin, gpio_dev *wp_dev, uint8_t wp_pin)
+			: AT45DB161D(spi, cs_dev, cs_pin, reset_dev, reset_pin, wp_dev, wp_pin)
+		{
+			SetGeometry(PAGE_SIZE, PAGE_COUNT, SECTOR_PAGES, OFFSET_BITS, PageMode == DATAFLASH_PAGE_BINARY);
+		}
+};
+
+/** AT45DB041D in standard page mode **/
+typedef AT45DB<dataflash_at45db041d> AT45DB041D;
+/** AT45DB081D in standard page mode **/
+typedef AT45DB<dataflash_at45db081d> AT45DB081D;
+/** AT45DB321D in standard page mode **/
+typedef AT45DB<dataflash_at45db321d> AT45DB321D;
+/** AT45DB642D in standard page mode **/
+typedef AT45DB<dataflash_at45db642d> AT45DB642D;
+
 /**
  * @}
  **/
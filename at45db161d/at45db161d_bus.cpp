@@ -0,0 +1,100 @@
+#include "at45db161d_bus.h"
+
+/**
+ * Constructor.
+ * @param spi Port of the bus. It is set up by the first transaction,
+ *        for the device of that transaction.
+ **/
+DataFlashBus::DataFlashBus(HardwareSPI *spi)
+{
+	m_SPI = spi;
+	m_owner = NULL;
+	m_configured = NULL;
+}
+
+/**
+ * Start a transaction, waiting for the one running to end. Must not be
+ * called from an interrupt handler, which could wait forever for the
+ * code it interrupted.
+ * @param device Device the transaction is for, valid until End
+ **/
+void DataFlashBus::Begin(const struct DataFlashBus::Device *device)
+{
+	while(!TryBegin(device));
+}
+
+/**
+ * Start a transaction if the bus is free. The port is set up again only
+ * when the settings of the device differ from the ones in use.
+ * @param device Device the transaction is for, valid until End
+ * @return false if another transaction is running
+ **/
+bool DataFlashBus::TryBegin(const struct DataFlashBus::Device *device)
+{
+	/* An interrupt handler taking the bus here frees it before
+	 * returning, so the bus is still free afterwards */
+	if(m_owner != NULL)
+		return false;
+
+	m_owner = device;
+
+	if(m_configured != device &&
+	   (m_configured == NULL ||
+	    m_configured->frequency != device->frequency ||
+	    m_configured->bitOrder != device->bitOrder ||
+	    m_configured->mode != device->mode))
+	{
+		m_SPI->begin(device->frequency, device->bitOrder, device->mode);
+	}
+
+	m_configured = device;
+	return true;
+}
+
+/**
+ * End the transaction running: release the CS line of its device, in
+ * case its driver left it asserted, and free the bus.
+ **/
+void DataFlashBus::End()
+{
+	const struct Device *device = m_owner;
+
+	if(device == NULL)
+		return;
+
+	gpio_write_bit(device->csDev, device->csPin, 1);
+	m_owner = NULL;
+}
+
+/**
+ * Check a DataFlash for the end of its operation, in a transaction of
+ * its own. The status is not read before the typical duration of the
+ * operation has elapsed (see AT45DB161D::Poll), so polling often costs
+ * next to no bus time. The main loop can serve other devices between
+ * calls.
+ * @param dataflash Chip to check
+ * @param device Its settings and CS line
+ * @return true while the operation is running
+ **/
+bool DataFlashBus::PollDataFlash(AT45DB161D *dataflash, const struct DataFlashBus::Device *device)
+{
+	bool busy;
+
+	Begin(device);
+	busy = dataflash->Poll();
+	End();
+
+	return busy;
+}
+
+/**
+ * Wait for the operation running on a DataFlash, with the bus free
+ * except while its status is read: transactions begun by interrupt
+ * handlers go through in the meantime.
+ * @param dataflash Chip to wait for
+ * @param device Its settings and CS line
+ **/
+void DataFlashBus::WaitForDataFlash(AT45DB161D *dataflash, const struct DataFlashBus::Device *device)
+{
+	while(PollDataFlash(dataflash, device));
+}
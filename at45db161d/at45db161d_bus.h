@@ -0,0 +1,113 @@
+/**
+ * @file at45db161d_bus.h
+ * @brief Arbiter of a SPI bus shared by the AT45DB161D and other devices
+ **/
+#ifndef _AT45DB161D_BUS_H_
+#define _AT45DB161D_BUS_H_
+
+#include <inttypes.h>
+
+#include "at45db161d.h"
+
+/**
+ * @defgroup AT45DB161D_bus AT45DB161D shared bus arbiter
+ * @{
+ **/
+
+/**
+ * @brief Arbiter of a shared SPI bus
+ * Owns a HardwareSPI and hands it to one device at a time, for a
+ * transaction: Begin sets up the clock, bit order and mode of the
+ * device, End releases its CS line and frees the bus. A DataFlash
+ * command is one transaction, and the chip programs and erases with
+ * CS released, so other devices get the bus in the meantime;
+ * PollDataFlash and WaitForDataFlash check the chip with a transaction
+ * per status read rather than holding the bus for the whole operation.
+ *
+ * The AT45DB161D driver waits for the operation in progress before the
+ * next one, with CS asserted: call WaitForDataFlash before commands
+ * that start an operation. A DMA transfer is part of the transaction
+ * of its command, which ends once the transfer does, from the main
+ * loop or the DMA handler. CS of every device must be released before
+ * the first transaction; AT45DB161D::begin leaves it asserted.
+ *
+ * Transactions may be run from interrupt handlers with TryBegin, as
+ * long as they end in the handler that began them.
+ **/
+class DataFlashBus
+{
+	public:
+		/**
+		 * @brief SPI settings and CS line of a device of the bus
+		 **/
+		struct Device
+		{
+			SPIFrequency frequency;
+			uint32_t bitOrder;		/**< MSBFIRST or LSBFIRST **/
+			uint32_t mode;			/**< SPI mode, 0 to 3 **/
+			gpio_dev *csDev;
+			uint8_t csPin;
+		};
+
+		/**
+		 * Constructor.
+		 * @param spi Port of the bus. It is set up by the first transaction.
+		 **/
+		DataFlashBus(HardwareSPI *spi);
+
+		/**
+		 * Start a transaction, waiting for the one running to end.
+		 * @param device Device the transaction is for, valid until End
+		 **/
+		void Begin(const struct DataFlashBus::Device *device);
+
+		/**
+		 * Start a transaction if the bus is free.
+		 * @param device Device the transaction is for, valid until End
+		 * @return false if another transaction is running
+		 **/
+		bool TryBegin(const struct DataFlashBus::Device *device);
+
+		/**
+		 * End the transaction running: release the CS line of its device
+		 * and free the bus.
+		 **/
+		void End();
+
+		/**
+		 * Check a DataFlash for the end of its operation, in a
+		 * transaction of its own.
+		 * @param dataflash Chip to check
+		 * @param device Its settings and CS line
+		 * @return true while the operation is running
+		 **/
+		bool PollDataFlash(AT45DB161D *dataflash, const struct DataFlashBus::Device *device);
+
+		/**
+		 * Wait for the operation running on a DataFlash, with the bus
+		 * free except while its status is read.
+		 * @param dataflash Chip to wait for
+		 * @param device Its settings and CS line
+		 **/
+		void WaitForDataFlash(AT45DB161D *dataflash, const struct DataFlashBus::Device *device);
+
+		/**
+		 * Whether a transaction is running.
+		 **/
+		inline bool IsBusy()
+		{
+			return m_owner != NULL;
+		}
+
+	private:
+		HardwareSPI *m_SPI;
+
+		const struct Device *volatile m_owner;	/**< Device of the transaction running, or NULL **/
+		const struct Device *m_configured;		/**< Device the port is set up for, or NULL **/
+};
+
+/**
+ * @}
+ **/
+
+#endif /* _AT45DB161D_BUS_H_ */
@@ -0,0 +1,212 @@
+#include "at45db161d_cache.h"
+
+#include <string.h>
+
+/**
+ * Constructor.
+ * @param dataflash Device the pages are read from and written to
+ * @param pool Cache lines, valid for the life of the cache
+ * @param lines Number of lines in pool
+ **/
+DataFlashCache::DataFlashCache(AT45DB161D *dataflash, dataflash_cache_line *pool, uint8_t lines)
+{
+	m_dataflash = dataflash;
+	m_lines = pool;
+	m_count = lines;
+	m_clock = 0;
+	m_flushBuffer = DATAFLASH_BUFFER1;
+	m_hits = 0;
+	m_misses = 0;
+
+	for(uint8_t i = 0; i < m_count; i++)
+	{
+		m_lines[i].page = DATAFLASH_NO_PAGE;
+		m_lines[i].flags = 0;
+		m_lines[i].lastUse = 0;
+	}
+}
+
+/**
+ * Read a span of main memory, running across page boundaries.
+ * @param page Page where the read starts
+ * @param offset Starting byte within the page, less than the page size
+ * @param dst Destination, at least len bytes
+ * @param len Number of bytes to read
+ **/
+void DataFlashCache::Read(uint16_t page, uint16_t offset, uint8_t *dst, size_t len)
+{
+	if(offset >= m_dataflash->PageSize())
+	{
+		ASSERT(0);
+		return;
+	}
+
+	while(len)
+	{
+		size_t count = m_dataflash->PageSize() - offset;
+		if(count > len)
+			count = len;
+
+		dataflash_cache_line *line = Lookup(page);
+		memcpy(dst, line->data + offset, count);
+
+		dst += count;
+		len -= count;
+		page = (page + 1) % m_dataflash->PageCount();
+		offset = 0;
+	}
+}
+
+/**
+ * Write a span of main memory, running across page boundaries.
+ * The data is programmed when the pages are evicted or flushed.
+ * @param page Page where the write starts
+ * @param offset Starting byte within the page, less than the page size
+ * @param src Source, at least len bytes
+ * @param len Number of bytes to write
+ **/
+void DataFlashCache::Write(uint16_t page, uint16_t offset, const uint8_t *src, size_t len)
+{
+	if(offset >= m_dataflash->PageSize())
+	{
+		ASSERT(0);
+		return;
+	}
+
+	while(len)
+	{
+		size_t count = m_dataflash->PageSize() - offset;
+		if(count > len)
+			count = len;
+
+		dataflash_cache_line *line = Lookup(page);
+		memcpy(line->data + offset, src, count);
+		line->flags |= DATAFLASH_CACHE_DIRTY;
+
+		src += count;
+		len -= count;
+		page = (page + 1) % m_dataflash->PageCount();
+		offset = 0;
+	}
+}
+
+/**
+ * Program a page if it is cached and dirty, and wait for the end
+ * of the programming.
+ * @param page Page to flush
+ **/
+void DataFlashCache::FlushPage(uint16_t page)
+{
+	for(uint8_t i = 0; i < m_count; i++)
+	{
+		if((m_lines[i].flags & DATAFLASH_CACHE_VALID) && m_lines[i].page == page)
+		{
+			WriteBack(&m_lines[i]);
+			break;
+		}
+	}
+
+	m_dataflash->WaitForOperation();
+}
+
+/**
+ * Program all dirty pages and wait for the end of the programming.
+ **/
+void DataFlashCache::Flush()
+{
+	for(uint8_t i = 0; i < m_count; i++)
+		WriteBack(&m_lines[i]);
+
+	m_dataflash->WaitForOperation();
+}
+
+/**
+ * Drop all cached pages, losing the changes not flushed yet.
+ **/
+void DataFlashCache::Invalidate()
+{
+	for(uint8_t i = 0; i < m_count; i++)
+	{
+		m_lines[i].page = DATAFLASH_NO_PAGE;
+		m_lines[i].flags = 0;
+	}
+}
+
+/**
+ * Find the line holding a page. On a miss, the least recently used
+ * line is written back if dirty and reloaded with the page.
+ **/
+dataflash_cache_line *DataFlashCache::Lookup(uint16_t page)
+{
+	dataflash_cache_line *victim = &m_lines[0];
+
+	m_clock++;
+
+	for(uint8_t i = 0; i < m_count; i++)
+	{
+		dataflash_cache_line *line = &m_lines[i];
+
+		if((line->flags & DATAFLASH_CACHE_VALID) && line->page == page)
+		{
+			line->lastUse = m_clock;
+			m_hits++;
+			return line;
+		}
+
+		/* Free lines first, then the one unused for the longest time */
+		if(!(line->flags & DATAFLASH_CACHE_VALID))
+		{
+			if(victim->flags & DATAFLASH_CACHE_VALID)
+				victim = line;
+		}
+		else if((victim->flags & DATAFLASH_CACHE_VALID) && (m_clock - line->lastUse) > (m_clock - victim->lastUse))
+		{
+			victim = line;
+		}
+	}
+
+	m_misses++;
+
+	/* Lines are sized at build time, the page size known at run time */
+	ASSERT(m_dataflash->PageSize() <= DATAFLASH_CACHE_PAGE_SIZE);
+
+	WriteBack(victim);
+
+	/* Take the page from a buffer if the driver knows one holds it,
+	 * it may have changes not programmed yet */
+	dataflash_buffer bufferNum;
+	if(m_dataflash->FindBuffer(page, &bufferNum))
+		m_dataflash->ReadBuffer(bufferNum, 0, victim->data, m_dataflash->PageSize());
+	else
+		m_dataflash->Read(page, 0, victim->data, m_dataflash->PageSize());
+
+	victim->page = page;
+	victim->flags = DATAFLASH_CACHE_VALID;
+	victim->lastUse = m_clock;
+
+	return victim;
+}
+
+/**
+ * Start programming a dirty line, without waiting for the end. The
+ * buffers are used in turn: the page is transferred into one of them
+ * while the previous write back is programmed from the other one.
+ **/
+void DataFlashCache::WriteBack(dataflash_cache_line *line)
+{
+	if((line->flags & (DATAFLASH_CACHE_VALID | DATAFLASH_CACHE_DIRTY)) != (DATAFLASH_CACHE_VALID | DATAFLASH_CACHE_DIRTY))
+		return;
+
+	const struct AT45DB161D::Operation &op = m_dataflash->LastOperation();
+
+	/* Only our own program from the other buffer may still be running */
+	if(op.pending && !(op.type == DATAFLASH_OP_BUFFER_TO_PAGE && op.buffer != m_flushBuffer))
+		m_dataflash->WaitForOperation();
+
+	m_dataflash->WriteBuffer(m_flushBuffer, 0, line->data, m_dataflash->PageSize());
+	m_dataflash->StartBufferToPage(m_flushBuffer, line->page, 1);
+
+	m_flushBuffer = (m_flushBuffer == DATAFLASH_BUFFER1) ? DATAFLASH_BUFFER2 : DATAFLASH_BUFFER1;
+
+	line->flags &= ~DATAFLASH_CACHE_DIRTY;
+}
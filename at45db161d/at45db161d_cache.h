@@ -0,0 +1,154 @@
+/**
+ * @file at45db161d_cache.h
+ * @brief Write-back page cache for the AT45DB161D module
+ **/
+#ifndef _AT45DB161D_CACHE_H_
+#define _AT45DB161D_CACHE_H_
+
+#include <inttypes.h>
+
+#include "at45db161d.h"
+
+/**
+ * @defgroup AT45DB161D_cache AT45DB161D page cache
+ * @{
+ **/
+
+/**
+ * @defgroup CACHE_LINE_FLAGS Cache line flags
+ * @{
+ **/
+/** The line holds a copy of its page **/
+#define DATAFLASH_CACHE_VALID	0x01
+/** The line was written since it was loaded or flushed **/
+#define DATAFLASH_CACHE_DIRTY	0x02
+/**
+ * @}
+ **/
+
+#ifndef DATAFLASH_CACHE_PAGE_SIZE
+/**
+ * Largest page a cache line holds. Define it to 1056 for the
+ * AT45DB642D, whose pages don't fit the default.
+ **/
+#define DATAFLASH_CACHE_PAGE_SIZE	DATAFLASH_PAGE_SIZE
+#endif
+
+/**
+ * One page of the cache. The pool is allocated by the application,
+ * usually as a static array, so that its size is known at link time:
+ *
+ *     static dataflash_cache_line pool[4];
+ *     DataFlashCache cache(&dataflash, pool, 4);
+ **/
+typedef struct dataflash_cache_line
+{
+	uint16_t page;						/**< Main memory page held           **/
+	uint8_t flags;						/**< DATAFLASH_CACHE_* flags         **/
+	uint32_t lastUse;					/**< Access stamp, for LRU eviction  **/
+	uint8_t data[DATAFLASH_CACHE_PAGE_SIZE];	/**< Page content                    **/
+} dataflash_cache_line;
+
+/**
+ * @brief Write-back cache of main memory pages in MCU RAM
+ * Reads are served from RAM once a page is loaded, writes are merged in
+ * RAM and programmed when the page is evicted or flushed. Pages are
+ * evicted least recently used first. Dirty pages are programmed through
+ * the SRAM buffers with built-in erase, alternating between the two
+ * buffers so that a page is transferred while the previous one is
+ * programmed.
+ * @note Main memory must not be changed behind the back of the cache,
+ *       other than through pages it does not hold.
+ **/
+class DataFlashCache
+{
+	public:
+		/**
+		 * Constructor.
+		 * @param dataflash Device the pages are read from and written to
+		 * @param pool Cache lines, valid for the life of the cache
+		 * @param lines Number of lines in pool
+		 **/
+		DataFlashCache(AT45DB161D *dataflash, dataflash_cache_line *pool, uint8_t lines);
+
+		/**
+		 * Read a span of main memory, running across page boundaries.
+		 * @param page Page where the read starts
+		 * @param offset Starting byte within the page, less than the page size
+		 * @param dst Destination, at least len bytes
+		 * @param len Number of bytes to read
+		 **/
+		void Read(uint16_t page, uint16_t offset, uint8_t *dst, size_t len);
+
+		/**
+		 * Write a span of main memory, running across page boundaries.
+		 * The data is programmed when the pages are evicted or flushed.
+		 * @param page Page where the write starts
+		 * @param offset Starting byte within the page, less than the page size
+		 * @param src Source, at least len bytes
+		 * @param len Number of bytes to write
+		 **/
+		void Write(uint16_t page, uint16_t offset, const uint8_t *src, size_t len);
+
+		/**
+		 * Program a page if it is cached and dirty, and wait for the end
+		 * of the programming.
+		 * @param page Page to flush
+		 **/
+		void FlushPage(uint16_t page);
+
+		/**
+		 * Program all dirty pages and wait for the end of the programming.
+		 **/
+		void Flush();
+
+		/**
+		 * Drop all cached pages, losing the changes not flushed yet.
+		 **/
+		void Invalidate();
+
+		/**
+		 * Number of accesses served from RAM since construction.
+		 **/
+		inline uint32_t Hits()
+		{
+			return m_hits;
+		}
+
+		/**
+		 * Number of accesses that loaded a page since construction.
+		 **/
+		inline uint32_t Misses()
+		{
+			return m_misses;
+		}
+
+	private:
+		/**
+		 * Find the line holding a page, loading the page if needed.
+		 **/
+		dataflash_cache_line *Lookup(uint16_t page);
+
+		/**
+		 * Start programming a dirty line, without waiting for the end.
+		 **/
+		void WriteBack(dataflash_cache_line *line);
+
+	private:
+		AT45DB161D *m_dataflash;
+
+		dataflash_cache_line *m_lines;	/**< Line pool **/
+		uint8_t m_count;				/**< Number of lines **/
+		uint32_t m_clock;				/**< Access stamp of the last access **/
+
+		dataflash_buffer m_flushBuffer;	/**< Buffer used by the next write back **/
+
+		uint32_t m_hits;
+		uint32_t m_misses;
+};
+
+/**
+ * @}
+ **/
+
+#endif /* _AT45DB161D_CACHE_H_ */
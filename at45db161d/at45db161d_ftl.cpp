@@ -0,0 +1,559 @@
+#include "at45db161d_ftl.h"
+
+/** Bytes used to fill the unwritten part of a new logical page **/
+static const uint8_t dataflash_ftl_blank[16] =
+{
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+/**
+ * Check word of a page header. Erased and blank pages don't pass it.
+ **/
+static uint16_t dataflash_ftl_check(uint16_t page, uint32_t sequence, uint32_t eraseCount)
+{
+	return (uint16_t)~(page ^ (sequence & 0xFFFF) ^ (sequence >> 16) ^ (eraseCount & 0xFFFF) ^ (eraseCount >> 16) ^ 0x5A5A);
+}
+
+/** Number of bits set in a byte of valid page flags **/
+static uint8_t dataflash_ftl_count(uint8_t flags)
+{
+	uint8_t count = 0;
+
+	while(flags)
+	{
+		flags &= flags - 1;
+		count++;
+	}
+
+	return count;
+}
+
+/**
+ * Constructor.
+ * @param dataflash Device holding the pages
+ * @param firstPage First physical page, rounded up to a block
+ * @param pages Number of physical pages, rounded down to whole blocks,
+ *        at most DATAFLASH_FTL_MAX_PAGES
+ * @param logicalPages Number of logical pages, at most two blocks less than pages
+ * @param workspace DATAFLASH_FTL_WORKSPACE_SIZE(pages, logicalPages) bytes,
+ *        valid for the life of the translation layer
+ **/
+DataFlashFTL::DataFlashFTL(AT45DB161D *dataflash, uint16_t firstPage, uint16_t pages, uint16_t logicalPages, uint8_t *workspace)
+{
+	uint16_t skip = (DATAFLASH_BLOCK_PAGES - (firstPage % DATAFLASH_BLOCK_PAGES)) % DATAFLASH_BLOCK_PAGES;
+
+	m_dataflash = dataflash;
+	m_first = firstPage + skip;
+	m_blocks = ((pages > skip) ? pages - skip : 0) / DATAFLASH_BLOCK_PAGES;
+	m_logicalPages = logicalPages;
+
+	/* Physical pages beyond the reach of the map are left out */
+	if(m_blocks > DATAFLASH_FTL_MAX_PAGES / DATAFLASH_BLOCK_PAGES)
+	{
+		ASSERT(0);
+		m_blocks = DATAFLASH_FTL_MAX_PAGES / DATAFLASH_BLOCK_PAGES;
+	}
+
+	/* One block is filled while another one is kept free to reclaim
+	 * into, the rest must be able to hold all logical pages */
+	if(m_blocks < 3 || logicalPages > (m_blocks - 2) * DATAFLASH_BLOCK_PAGES)
+	{
+		ASSERT(0);
+		m_logicalPages = (m_blocks > 2) ? (m_blocks - 2) * DATAFLASH_BLOCK_PAGES : 0;
+	}
+
+	/* Carve the workspace, sized for the requested logical pages */
+	m_map = workspace;
+	m_mapped = m_map + (logicalPages * 3 + 1) / 2;
+	m_valid = m_mapped + (logicalPages + 7) / 8;
+	m_erase = m_valid + m_blocks;
+
+	m_eraseBase = 0;
+	m_open = DATAFLASH_NO_PAGE;
+	m_next = 0;
+	m_sequence = 1;
+	m_buffer = DATAFLASH_BUFFER1;
+	m_relocations = 0;
+}
+
+/**
+ * Rebuild the map and the erase counts from the page headers. Reads
+ * the header of every physical page once. When two pages hold the same
+ * logical page, the one with the higher sequence number wins. The
+ * erase count of a block is the highest one found in its headers; a
+ * block without any takes the lowest count found.
+ **/
+void DataFlashFTL::Mount()
+{
+	uint32_t minErase = 0xFFFFFFFF;
+
+	/* Headers live past the 512 data bytes */
+	ASSERT(m_dataflash->PageSize() >= DATAFLASH_FTL_PAGE_SIZE + DATAFLASH_FTL_HEADER_SIZE);
+
+	for(uint16_t i = 0; i < (m_logicalPages + 7) / 8; i++)
+		m_mapped[i] = 0;
+
+	m_sequence = 1;
+	m_open = DATAFLASH_NO_PAGE;
+
+	/* Build the map, and the erase counts relative to the lowest one
+	 * found so far. Blocks without any header are marked with 0xFFFF. */
+	for(uint16_t block = 0; block < m_blocks; block++)
+	{
+		uint32_t blockErase = 0;
+		bool found = false;
+
+		m_valid[block] = 0;
+
+		for(uint8_t i = 0; i < DATAFLASH_BLOCK_PAGES; i++)
+		{
+			uint16_t phys = block * DATAFLASH_BLOCK_PAGES + i;
+			uint16_t page;
+			uint32_t sequence, eraseCount;
+
+			if(!ReadHeader(phys, &page, &sequence, &eraseCount))
+				continue;
+
+			if(!found || eraseCount > blockErase)
+				blockErase = eraseCount;
+			found = true;
+
+			if((int32_t)(sequence - m_sequence) >= 0)
+				m_sequence = sequence + 1;
+
+			if(page >= m_logicalPages)
+				continue;
+
+			if(IsMapped(page))
+			{
+				uint16_t other = MapGet(page);
+				uint16_t otherPage;
+				uint32_t otherSequence, otherErase;
+
+				ReadHeader(other, &otherPage, &otherSequence, &otherErase);
+				if((int32_t)(sequence - otherSequence) < 0)
+					continue;
+
+				m_valid[other / DATAFLASH_BLOCK_PAGES] &= ~(1 << (other % DATAFLASH_BLOCK_PAGES));
+			}
+
+			MapSet(page, phys);
+			SetMapped(page, true);
+			m_valid[block] |= 1 << i;
+		}
+
+		if(!found)
+		{
+			SetEraseDelta(block, 0xFFFF);
+			continue;
+		}
+
+		/* A new lowest count: the counts so far move up by the difference */
+		if(blockErase < minErase)
+		{
+			for(uint16_t other = 0; minErase != 0xFFFFFFFF && other < block; other++)
+			{
+				uint32_t delta = EraseDelta(other);
+
+				if(delta == 0xFFFF)
+					continue;
+
+				delta += minErase - blockErase;
+				SetEraseDelta(other, (delta > 0xFFFE) ? 0xFFFE : (uint16_t)delta);
+			}
+
+			minErase = blockErase;
+		}
+
+		SetEraseDelta(block, (blockErase - minErase > 0xFFFE) ? 0xFFFE : (uint16_t)(blockErase - minErase));
+	}
+
+	if(minErase == 0xFFFFFFFF)
+		minErase = 0;
+	m_eraseBase = minErase;
+
+	for(uint16_t block = 0; block < m_blocks; block++)
+	{
+		if(EraseDelta(block) == 0xFFFF)
+			SetEraseDelta(block, 0);
+	}
+}
+
+/**
+ * Erase the whole range, losing all data and erase counts.
+ **/
+void DataFlashFTL::Format()
+{
+	/* Headers live past the 512 data bytes */
+	ASSERT(m_dataflash->PageSize() >= DATAFLASH_FTL_PAGE_SIZE + DATAFLASH_FTL_HEADER_SIZE);
+
+	for(uint16_t block = 0; block < m_blocks; block++)
+	{
+		m_dataflash->BlockErase((m_first / DATAFLASH_BLOCK_PAGES) + block);
+		m_valid[block] = 0;
+		SetEraseDelta(block, 0);
+	}
+
+	for(uint16_t i = 0; i < (m_logicalPages + 7) / 8; i++)
+		m_mapped[i] = 0;
+
+	m_eraseBase = 0;
+	m_open = DATAFLASH_NO_PAGE;
+	m_sequence = 1;
+}
+
+/**
+ * Read a span of a logical page. Pages never written read as 0xFF.
+ * @param page Logical page
+ * @param offset Starting byte within the page
+ * @param dst Destination, at least len bytes
+ * @param len Number of bytes, up to the end of the page
+ * @return false if the span is out of range
+ **/
+bool DataFlashFTL::Read(uint16_t page, uint16_t offset, uint8_t *dst, size_t len)
+{
+	if(page >= m_logicalPages || offset + len > DATAFLASH_FTL_PAGE_SIZE)
+		return false;
+
+	if(!IsMapped(page))
+	{
+		for(size_t i = 0; i < len; i++)
+			dst[i] = 0xFF;
+		return true;
+	}
+
+	m_dataflash->Read(m_first + MapGet(page), offset, dst, len);
+
+	return true;
+}
+
+/**
+ * Write a span of a logical page. The page is programmed to a new
+ * physical page, with the rest of its content copied from the
+ * previous one. The programming goes on after the call returns.
+ * @param page Logical page
+ * @param offset Starting byte within the page
+ * @param src Source, at least len bytes
+ * @param len Number of bytes, up to the end of the page
+ * @return false if the span is out of range
+ **/
+bool DataFlashFTL::Write(uint16_t page, uint16_t offset, const uint8_t *src, size_t len)
+{
+	if(page >= m_logicalPages || offset + len > DATAFLASH_FTL_PAGE_SIZE)
+		return false;
+
+	Program(page, offset, src, len, false);
+
+	return true;
+}
+
+/**
+ * Wait for the end of the last programming.
+ **/
+void DataFlashFTL::Sync()
+{
+	m_dataflash->WaitForOperation();
+}
+
+/**
+ * Number of times a block of the range was erased.
+ * @param block Block index within the range
+ **/
+uint32_t DataFlashFTL::EraseCount(uint16_t block)
+{
+	return m_eraseBase + EraseDelta(block);
+}
+
+/**
+ * Program a logical page into the next free page of the open block.
+ * A whole page is sent straight into a free SRAM buffer while the
+ * previous page programs from the other one. A partial page first
+ * brings the current copy into the buffer.
+ * @param src Data to write, or NULL to copy the current content only
+ * @param reclaim Called while reclaiming a block
+ **/
+void DataFlashFTL::Program(uint16_t page, uint16_t offset, const uint8_t *src, size_t len, bool reclaim)
+{
+	PrepareWrite(reclaim);
+
+	uint16_t phys = m_open * DATAFLASH_BLOCK_PAGES + m_next;
+	bool mapped = IsMapped(page);
+	uint16_t old = mapped ? MapGet(page) : 0;
+
+	if(src == NULL || len < DATAFLASH_FTL_PAGE_SIZE)
+	{
+		if(mapped)
+		{
+			m_dataflash->StartPageToBuffer(m_first + old, m_buffer);
+			m_dataflash->WaitForOperation();
+		}
+		else
+		{
+			for(uint16_t i = 0; i < DATAFLASH_FTL_PAGE_SIZE; i += sizeof(dataflash_ftl_blank))
+				m_dataflash->WriteBuffer(m_buffer, i, dataflash_ftl_blank, sizeof(dataflash_ftl_blank));
+		}
+	}
+
+	if(src != NULL)
+		m_dataflash->WriteBuffer(m_buffer, offset, src, len);
+
+	WriteHeader(m_buffer, page, EraseCount(m_open));
+
+	/* The block was erased when opened */
+	m_dataflash->StartBufferToPage(m_buffer, m_first + phys, 0);
+
+	if(mapped)
+		m_valid[old / DATAFLASH_BLOCK_PAGES] &= ~(1 << (old % DATAFLASH_BLOCK_PAGES));
+
+	MapSet(page, phys);
+	SetMapped(page, true);
+	m_valid[m_open] |= 1 << m_next;
+	m_next++;
+
+	m_buffer = (m_buffer == DATAFLASH_BUFFER1) ? DATAFLASH_BUFFER2 : DATAFLASH_BUFFER1;
+}
+
+/**
+ * Make sure the open block has a free page. Before opening a block for
+ * a write, blocks are reclaimed until one stays free for later
+ * reclaims, and the least erased block is reclaimed if it lags behind.
+ **/
+void DataFlashFTL::PrepareWrite(bool reclaim)
+{
+	if(m_open != DATAFLASH_NO_PAGE && m_next < DATAFLASH_BLOCK_PAGES)
+		return;
+
+	if(reclaim)
+	{
+		OpenBlock();
+		return;
+	}
+
+	while(FreeBlocks() < 2)
+	{
+		/* Greedy: the block with the fewest valid pages */
+		uint16_t victim = DATAFLASH_NO_PAGE;
+		uint8_t fewest = DATAFLASH_BLOCK_PAGES;
+
+		for(uint16_t block = 0; block < m_blocks; block++)
+		{
+			uint8_t count = dataflash_ftl_count(m_valid[block]);
+
+			if(block != m_open && count && count < fewest)
+			{
+				victim = block;
+				fewest = count;
+			}
+		}
+
+		if(victim == DATAFLASH_NO_PAGE)
+			break;
+
+		Reclaim(victim);
+	}
+
+	/* Static wear leveling */
+	uint16_t coldest = DATAFLASH_NO_PAGE;
+	uint16_t lowest = 0xFFFF, highest = 0;
+
+	for(uint16_t block = 0; block < m_blocks; block++)
+	{
+		uint16_t delta = EraseDelta(block);
+
+		if(delta > highest)
+			highest = delta;
+
+		if(delta < lowest)
+		{
+			lowest = delta;
+			coldest = (m_valid[block] && block != m_open) ? block : DATAFLASH_NO_PAGE;
+		}
+	}
+
+	if(coldest != DATAFLASH_NO_PAGE && highest - lowest > DATAFLASH_FTL_WEAR_THRESHOLD)
+		Reclaim(coldest);
+
+	if(m_open == DATAFLASH_NO_PAGE || m_next >= DATAFLASH_BLOCK_PAGES)
+		OpenBlock();
+}
+
+/**
+ * Erase the free block with the lowest erase count and open it. The
+ * erase goes on while the first page is sent to a buffer.
+ **/
+void DataFlashFTL::OpenBlock()
+{
+	uint16_t best = DATAFLASH_NO_PAGE;
+
+	for(uint16_t block = 0; block < m_blocks; block++)
+	{
+		if(block != m_open && m_valid[block] == 0 && (best == DATAFLASH_NO_PAGE || EraseDelta(block) < EraseDelta(best)))
+			best = block;
+	}
+
+	/* Can't happen while logical pages fit in all blocks but two */
+	ASSERT(best != DATAFLASH_NO_PAGE);
+
+	m_dataflash->StartBlockErase((m_first / DATAFLASH_BLOCK_PAGES) + best);
+
+	if(EraseDelta(best) < 0xFFFE)
+		SetEraseDelta(best, EraseDelta(best) + 1);
+
+	m_open = best;
+	m_next = 0;
+
+	/* Keep the counts small: rebase once all blocks were erased */
+	uint16_t lowest = 0xFFFF;
+	for(uint16_t block = 0; block < m_blocks; block++)
+	{
+		if(EraseDelta(block) < lowest)
+			lowest = EraseDelta(block);
+	}
+
+	if(lowest >= 0x8000)
+	{
+		for(uint16_t block = 0; block < m_blocks; block++)
+			SetEraseDelta(block, EraseDelta(block) - lowest);
+		m_eraseBase += lowest;
+	}
+}
+
+/**
+ * Copy the valid pages of a block elsewhere, freeing it. Pages are
+ * moved with a page to buffer transfer and a program, only the header
+ * crosses the SPI bus.
+ **/
+void DataFlashFTL::Reclaim(uint16_t block)
+{
+	for(uint8_t i = 0; i < DATAFLASH_BLOCK_PAGES; i++)
+	{
+		uint16_t page;
+		uint32_t sequence, eraseCount;
+
+		if(!(m_valid[block] & (1 << i)))
+			continue;
+
+		if(!ReadHeader(block * DATAFLASH_BLOCK_PAGES + i, &page, &sequence, &eraseCount) || page >= m_logicalPages)
+		{
+			m_valid[block] &= ~(1 << i);
+			continue;
+		}
+
+		Program(page, 0, NULL, 0, true);
+		m_relocations++;
+	}
+}
+
+/**
+ * Number of blocks holding no valid page, besides the open one.
+ **/
+uint16_t DataFlashFTL::FreeBlocks()
+{
+	uint16_t count = 0;
+
+	for(uint16_t block = 0; block < m_blocks; block++)
+	{
+		if(block != m_open && m_valid[block] == 0)
+			count++;
+	}
+
+	return count;
+}
+
+/**
+ * Read the header of a physical page.
+ * @return false if the page holds no valid header
+ **/
+bool DataFlashFTL::ReadHeader(uint16_t phys, uint16_t *page, uint32_t *sequence, uint32_t *eraseCount)
+{
+	uint8_t header[DATAFLASH_FTL_HEADER_SIZE];
+
+	m_dataflash->Read(m_first + phys, DATAFLASH_FTL_PAGE_SIZE, header, DATAFLASH_FTL_HEADER_SIZE);
+
+	*page = header[0] | ((uint16_t)header[1] << 8);
+	*sequence = header[2] | ((uint32_t)header[3] << 8) | ((uint32_t)header[4] << 16) | ((uint32_t)header[5] << 24);
+	*eraseCount = header[6] | ((uint32_t)header[7] << 8) | ((uint32_t)header[8] << 16) | ((uint32_t)header[9] << 24);
+	uint16_t check = header[10] | ((uint16_t)header[11] << 8);
+
+	return check == dataflash_ftl_check(*page, *sequence, *eraseCount);
+}
+
+/**
+ * Write the header of the next program into a buffer.
+ **/
+void DataFlashFTL::WriteHeader(dataflash_buffer bufferNum, uint16_t page, uint32_t eraseCount)
+{
+	uint8_t header[DATAFLASH_FTL_HEADER_SIZE];
+	uint16_t check = dataflash_ftl_check(page, m_sequence, eraseCount);
+
+	header[0] = (uint8_t)page;
+	header[1] = (uint8_t)(page >> 8);
+	header[2] = (uint8_t)m_sequence;
+	header[3] = (uint8_t)(m_sequence >> 8);
+	header[4] = (uint8_t)(m_sequence >> 16);
+	header[5] = (uint8_t)(m_sequence >> 24);
+	header[6] = (uint8_t)eraseCount;
+	header[7] = (uint8_t)(eraseCount >> 8);
+	header[8] = (uint8_t)(eraseCount >> 16);
+	header[9] = (uint8_t)(eraseCount >> 24);
+	header[10] = (uint8_t)check;
+	header[11] = (uint8_t)(check >> 8);
+
+	m_dataflash->WriteBuffer(bufferNum, DATAFLASH_FTL_PAGE_SIZE, header, DATAFLASH_FTL_HEADER_SIZE);
+	m_sequence++;
+}
+
+/**
+ * Physical page index of a logical page. Entries are 12 bits, two of
+ * them packed in three bytes.
+ **/
+uint16_t DataFlashFTL::MapGet(uint16_t page)
+{
+	uint8_t *p = m_map + (page / 2) * 3;
+
+	if(page & 1)
+		return (p[1] >> 4) | ((uint16_t)p[2] << 4);
+	else
+		return p[0] | ((uint16_t)(p[1] & 0x0F) << 8);
+}
+
+void DataFlashFTL::MapSet(uint16_t page, uint16_t phys)
+{
+	uint8_t *p = m_map + (page / 2) * 3;
+
+	if(page & 1)
+	{
+		p[1] = (p[1] & 0x0F) | (uint8_t)((phys & 0x0F) << 4);
+		p[2] = (uint8_t)(phys >> 4);
+	}
+	else
+	{
+		p[0] = (uint8_t)phys;
+		p[1] = (p[1] & 0xF0) | (uint8_t)((phys >> 8) & 0x0F);
+	}
+}
+
+bool DataFlashFTL::IsMapped(uint16_t page)
+{
+	return (m_mapped[page / 8] >> (page % 8)) & 1;
+}
+
+void DataFlashFTL::SetMapped(uint16_t page, bool mapped)
+{
+	if(mapped)
+		m_mapped[page / 8] |= 1 << (page % 8);
+	else
+		m_mapped[page / 8] &= ~(1 << (page % 8));
+}
+
+uint16_t DataFlashFTL::EraseDelta(uint16_t block)
+{
+	return m_erase[block * 2] | ((uint16_t)m_erase[block * 2 + 1] << 8);
+}
+
+void DataFlashFTL::SetEraseDelta(uint16_t block, uint16_t delta)
+{
+	m_erase[block * 2] = (uint8_t)delta;
+	m_erase[block * 2 + 1] = (uint8_t)(delta >> 8);
+}
@@ -0,0 +1,208 @@
+/**
+ * @file at45db161d_ftl.h
+ * @brief Flash translation layer for the AT45DB161D module
+ **/
+#ifndef _AT45DB161D_FTL_H_
+#define _AT45DB161D_FTL_H_
+
+#include <inttypes.h>
+
+#include "at45db161d.h"
+
+/**
+ * @defgroup AT45DB161D_ftl AT45DB161D flash translation layer
+ * @{
+ **/
+
+/** Size of a logical page **/
+#define DATAFLASH_FTL_PAGE_SIZE		512
+/**
+ * Size of the header stored in the last 16 bytes of each physical
+ * page: logical page (2 bytes), sequence number (4 bytes), erase count
+ * of the block (4 bytes) and check word (2 bytes).
+ **/
+#define DATAFLASH_FTL_HEADER_SIZE	12
+/**
+ * Difference between the most and the least erased blocks above which
+ * the data of the least erased block is moved, so that the block joins
+ * the free pool.
+ **/
+#define DATAFLASH_FTL_WEAR_THRESHOLD	32
+/**
+ * Largest number of physical pages, those the 12-bit entries of the map
+ * can address. The AT45DB321D and AT45DB642D have twice as many, of
+ * which a translation layer covers one half at most.
+ **/
+#define DATAFLASH_FTL_MAX_PAGES		4096
+
+/**
+ * Bytes of RAM needed by a translation layer, for the workspace given
+ * to the constructor:
+ *     - 12 bits per logical page for the map, plus one bit telling if
+ *       it is mapped
+ *     - per block, one byte of valid page flags and two bytes of erase
+ *       count
+ * About 8 KB for DATAFLASH_FTL_MAX_PAGES pages.
+ * @param pages Number of physical pages
+ * @param logicalPages Number of logical pages
+ **/
+#define DATAFLASH_FTL_WORKSPACE_SIZE(pages, logicalPages) \
+	(((logicalPages) * 3 + 1) / 2 + ((logicalPages) + 7) / 8 + ((pages) / DATAFLASH_BLOCK_PAGES) * 3)
+
+/**
+ * @brief Flash translation layer
+ * Maps logical pages of DATAFLASH_FTL_PAGE_SIZE bytes onto the pages of
+ * a range of the chip. Every write goes to the next free page of the
+ * open block, so that random updates become sequential programs, and
+ * the previous copy becomes stale. Blocks are erased when opened, the
+ * free block with the lowest erase count first. When free blocks run
+ * low, the block with the fewest valid pages is reclaimed, its pages
+ * being copied through an SRAM buffer without crossing the SPI bus.
+ * The least erased block is also reclaimed when it falls more than
+ * DATAFLASH_FTL_WEAR_THRESHOLD erases behind, so that blocks holding
+ * data that never changes take their share of the wear.
+ *
+ * Each physical page carries the logical page it holds and a sequence
+ * number in its last bytes, from which Mount rebuilds the map. This
+ * needs the chip in standard page mode, with 528 byte pages.
+ **/
+class DataFlashFTL
+{
+	public:
+		/**
+		 * Constructor.
+		 * @param dataflash Device holding the pages
+		 * @param firstPage First physical page, rounded up to a block
+		 * @param pages Number of physical pages, rounded down to whole blocks,
+		 *        at most DATAFLASH_FTL_MAX_PAGES
+		 * @param logicalPages Number of logical pages, at most two blocks less than pages
+		 * @param workspace DATAFLASH_FTL_WORKSPACE_SIZE(pages, logicalPages) bytes,
+		 *        valid for the life of the translation layer
+		 * @note Mount or Format must be called before any other method.
+		 **/
+		DataFlashFTL(AT45DB161D *dataflash, uint16_t firstPage, uint16_t pages, uint16_t logicalPages, uint8_t *workspace);
+
+		/**
+		 * Rebuild the map and the erase counts from the page headers.
+		 * Reads the header of every physical page.
+		 **/
+		void Mount();
+
+		/**
+		 * Erase the whole range, losing all data and erase counts.
+		 **/
+		void Format();
+
+		/**
+		 * Read a span of a logical page. Pages never written read as 0xFF.
+		 * @param page Logical page
+		 * @param offset Starting byte within the page
+		 * @param dst Destination, at least len bytes
+		 * @param len Number of bytes, up to the end of the page
+		 * @return false if the span is out of range
+		 **/
+		bool Read(uint16_t page, uint16_t offset, uint8_t *dst, size_t len);
+
+		/**
+		 * Write a span of a logical page. The page is programmed to a new
+		 * physical page, with the rest of its content copied from the
+		 * previous one. The programming goes on after the call returns.
+		 * @param page Logical page
+		 * @param offset Starting byte within the page
+		 * @param src Source, at least len bytes
+		 * @param len Number of bytes, up to the end of the page
+		 * @return false if the span is out of range
+		 **/
+		bool Write(uint16_t page, uint16_t offset, const uint8_t *src, size_t len);
+
+		/**
+		 * Wait for the end of the last programming.
+		 **/
+		void Sync();
+
+		/**
+		 * Number of logical pages.
+		 **/
+		inline uint16_t LogicalPages()
+		{
+			return m_logicalPages;
+		}
+
+		/**
+		 * Number of times a block of the range was erased.
+		 * @param block Block index within the range
+		 **/
+		uint32_t EraseCount(uint16_t block);
+
+		/**
+		 * Number of pages copied to reclaim blocks since construction.
+		 **/
+		inline uint32_t Relocations()
+		{
+			return m_relocations;
+		}
+
+	private:
+		/**
+		 * Program a logical page into the next free page of the open block.
+		 * @param src Data to write, or NULL to copy the current content only
+		 * @param reclaim Called while reclaiming a block
+		 **/
+		void Program(uint16_t page, uint16_t offset, const uint8_t *src, size_t len, bool reclaim);
+
+		/**
+		 * Make sure the open block has a free page.
+		 **/
+		void PrepareWrite(bool reclaim);
+
+		/**
+		 * Erase the free block with the lowest erase count and open it.
+		 **/
+		void OpenBlock();
+
+		/**
+		 * Copy the valid pages of a block elsewhere, freeing it.
+		 **/
+		void Reclaim(uint16_t block);
+
+		/**
+		 * Number of blocks holding no valid page, besides the open one.
+		 **/
+		uint16_t FreeBlocks();
+
+		bool ReadHeader(uint16_t phys, uint16_t *page, uint32_t *sequence, uint32_t *eraseCount);
+		void WriteHeader(dataflash_buffer bufferNum, uint16_t page, uint32_t eraseCount);
+
+		uint16_t MapGet(uint16_t page);
+		void MapSet(uint16_t page, uint16_t phys);
+		bool IsMapped(uint16_t page);
+		void SetMapped(uint16_t page, bool mapped);
+		uint16_t EraseDelta(uint16_t block);
+		void SetEraseDelta(uint16_t block, uint16_t delta);
+
+	private:
+		AT45DB161D *m_dataflash;
+
+		uint16_t m_first;				/**< First physical page **/
+		uint16_t m_blocks;				/**< Number of blocks **/
+		uint16_t m_logicalPages;		/**< Number of logical pages **/
+
+		uint8_t *m_map;					/**< Packed 12 bit physical index per logical page **/
+		uint8_t *m_mapped;				/**< One bit per logical page **/
+		uint8_t *m_valid;				/**< Valid page flags, one byte per block **/
+		uint8_t *m_erase;				/**< Erase count above m_eraseBase, two bytes per block **/
+		uint32_t m_eraseBase;			/**< Erase count of the least erased block at mount **/
+
+		uint16_t m_open;				/**< Block being filled, or DATAFLASH_NO_PAGE **/
+		uint8_t m_next;					/**< Next free page in the open block **/
+		uint32_t m_sequence;			/**< Sequence number of the next program **/
+		dataflash_buffer m_buffer;		/**< Buffer used by the next program **/
+
+		uint32_t m_relocations;
+};
+
+/**
+ * @}
+ **/
+
+#endif /* _AT45DB161D_FTL_H_ */
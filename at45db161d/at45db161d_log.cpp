@@ -0,0 +1,320 @@
+#include "at45db161d_log.h"
+
+/**
+ * Check word of a page header. An erased page (all bits set) and a
+ * blank one (all bits clear) don't pass the check.
+ **/
+static uint16_t dataflash_log_check(uint32_t sequence, uint16_t used)
+{
+	return (uint16_t)~((sequence & 0xFFFF) ^ (sequence >> 16) ^ used);
+}
+
+/**
+ * Constructor.
+ * @param dataflash Device holding the log
+ * @param firstPage First page of the log, rounded up to a block
+ * @param pages Number of pages, rounded down to whole blocks, at least two blocks
+ **/
+DataFlashLog::DataFlashLog(AT45DB161D *dataflash, uint16_t firstPage, uint16_t pages)
+{
+	uint16_t skip = (DATAFLASH_BLOCK_PAGES - (firstPage % DATAFLASH_BLOCK_PAGES)) % DATAFLASH_BLOCK_PAGES;
+
+	m_dataflash = dataflash;
+	m_first = firstPage + skip;
+	m_count = (pages > skip) ? pages - skip : 0;
+	m_count -= m_count % DATAFLASH_BLOCK_PAGES;
+
+	/* The block ahead of the log is erased while the oldest one
+	 * remains readable, so two blocks are needed at least */
+	if(m_count < 2 * DATAFLASH_BLOCK_PAGES)
+	{
+		ASSERT(0);
+		m_count = 2 * DATAFLASH_BLOCK_PAGES;
+	}
+
+	m_head = DATAFLASH_NO_PAGE;
+	m_headSequence = 0;
+	m_page = m_first;
+	m_offset = DATAFLASH_LOG_HEADER_SIZE;
+	m_sequence = 1;
+	m_buffer = DATAFLASH_BUFFER1;
+	m_blockErased = false;
+}
+
+/**
+ * Find the end of the log written before, so that Append goes on
+ * after it.
+ * Pages are written in order with increasing sequence numbers, so
+ * along the range the pages at least as new as the first one form a
+ * prefix, ending with the last page written. The pages after it are
+ * erased or older.
+ * @return true if the log holds at least one page
+ **/
+bool DataFlashLog::Mount()
+{
+	uint32_t baseSequence, sequence;
+	uint16_t used;
+	uint16_t base = m_first;
+
+	m_head = DATAFLASH_NO_PAGE;
+	m_page = m_first;
+	m_offset = DATAFLASH_LOG_HEADER_SIZE;
+	m_sequence = 1;
+	m_blockErased = false;
+
+	if(!ReadHeader(base, &baseSequence, &used))
+	{
+		/* The first block is erased when the log wraps around into it,
+		 * the log then starts with the second one */
+		base = m_first + DATAFLASH_BLOCK_PAGES;
+		if(!ReadHeader(base, &baseSequence, &used))
+			return false;
+	}
+
+	uint16_t lo = base;
+	uint16_t hi = m_first + m_count - 1;
+
+	while(lo < hi)
+	{
+		uint16_t mid = lo + (hi - lo + 1) / 2;
+
+		if(ReadHeader(mid, &sequence, &used) && (int32_t)(sequence - baseSequence) >= 0)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	ReadHeader(lo, &sequence, &used);
+
+	m_head = lo;
+	m_headSequence = sequence;
+	m_page = NextPage(lo);
+	m_sequence = sequence + 1;
+
+	return true;
+}
+
+/**
+ * Erase the whole range of the log.
+ **/
+void DataFlashLog::Format()
+{
+	for(uint16_t page = m_first; page < m_first + m_count; page += DATAFLASH_BLOCK_PAGES)
+		m_dataflash->BlockErase(page / DATAFLASH_BLOCK_PAGES);
+
+	m_dataflash->WaitForOperation();
+
+	m_head = DATAFLASH_NO_PAGE;
+	m_page = m_first;
+	m_offset = DATAFLASH_LOG_HEADER_SIZE;
+	m_sequence = 1;
+	m_blockErased = false;
+}
+
+/**
+ * Append a record. The record is programmed when its page is full
+ * or on Sync.
+ * @param record Record data
+ * @param len Length of the record, up to DATAFLASH_LOG_MAX_RECORD, or 16 bytes
+ *        less in binary page mode
+ * @return false if the record is too long
+ **/
+bool DataFlashLog::Append(const void *record, uint16_t len)
+{
+	uint8_t prefix[DATAFLASH_LOG_LENGTH_SIZE];
+
+	uint16_t pageSize = m_dataflash->PageSize();
+
+	if(len > pageSize - DATAFLASH_LOG_HEADER_SIZE - DATAFLASH_LOG_LENGTH_SIZE)
+		return false;
+
+	if(m_offset + DATAFLASH_LOG_LENGTH_SIZE + len > pageSize)
+		CommitPage();
+
+	if(m_offset == DATAFLASH_LOG_HEADER_SIZE && (m_page - m_first) % DATAFLASH_BLOCK_PAGES == 0)
+	{
+		/* Entering a new block: erase it while the page is filled. This
+		 * drops the oldest block once the log has wrapped around. */
+		m_dataflash->StartBlockErase(m_page / DATAFLASH_BLOCK_PAGES);
+		m_blockErased = true;
+	}
+
+	prefix[0] = (uint8_t)len;
+	prefix[1] = (uint8_t)(len >> 8);
+
+	/* The other buffer may be programming, this one is free */
+	m_dataflash->WriteBuffer(m_buffer, m_offset, prefix, DATAFLASH_LOG_LENGTH_SIZE);
+	m_dataflash->WriteBuffer(m_buffer, m_offset + DATAFLASH_LOG_LENGTH_SIZE, (const uint8_t*)record, len);
+	m_offset += DATAFLASH_LOG_LENGTH_SIZE + len;
+
+	return true;
+}
+
+/**
+ * Program the records appended so far and wait for the end of the
+ * programming. Records appended next start on a new page.
+ **/
+void DataFlashLog::Sync()
+{
+	if(m_offset > DATAFLASH_LOG_HEADER_SIZE)
+		CommitPage();
+
+	m_dataflash->WaitForOperation();
+}
+
+/**
+ * Set a cursor on the oldest record programmed. The oldest page
+ * follows the head, after the rest of the block erased ahead of it, or
+ * is the first page of the log if the log hasn't wrapped around yet.
+ * @param cursor Cursor to set
+ * @return false if the log is empty
+ **/
+bool DataFlashLog::Rewind(struct DataFlashLog::Cursor *cursor)
+{
+	uint32_t sequence;
+	uint16_t used;
+	uint16_t page;
+
+	if(m_head == DATAFLASH_NO_PAGE)
+		return false;
+
+	page = NextPage(m_head);
+	if(!ReadHeader(page, &sequence, &used) || (int32_t)(m_headSequence - sequence) < 0)
+	{
+		/* Skip the rest of the block erased ahead of the head */
+		do
+		{
+			page = NextPage(page);
+		}
+		while((page - m_first) % DATAFLASH_BLOCK_PAGES);
+
+		if(!ReadHeader(page, &sequence, &used) || (int32_t)(m_headSequence - sequence) < 0)
+		{
+			/* Not wrapped around yet, or the first block is the erased one */
+			page = m_first;
+			if(!ReadHeader(page, &sequence, &used))
+			{
+				page = m_first + DATAFLASH_BLOCK_PAGES;
+				ReadHeader(page, &sequence, &used);
+			}
+		}
+	}
+
+	cursor->page = page;
+	cursor->offset = DATAFLASH_LOG_HEADER_SIZE;
+	cursor->used = used;
+	cursor->sequence = sequence;
+
+	return true;
+}
+
+/**
+ * Read the record under a cursor and move the cursor to the next one.
+ * Records still in the SRAM buffer, not synced yet, are not seen.
+ * @param cursor Cursor set by Rewind
+ * @param dst Destination
+ * @param size Size of dst. Longer records are truncated.
+ * @return Length of the record, or -1 at the end of the log
+ **/
+int16_t DataFlashLog::ReadNext(struct DataFlashLog::Cursor *cursor, void *dst, uint16_t size)
+{
+	uint8_t prefix[DATAFLASH_LOG_LENGTH_SIZE];
+	uint16_t len;
+
+	while(cursor->offset + DATAFLASH_LOG_LENGTH_SIZE > cursor->used)
+	{
+		uint32_t sequence;
+		uint16_t used;
+
+		if(cursor->page == m_head)
+			return -1;
+
+		/* Pages follow each other with consecutive sequence numbers */
+		uint16_t page = NextPage(cursor->page);
+		if(!ReadHeader(page, &sequence, &used) || sequence != cursor->sequence + 1)
+			return -1;
+
+		cursor->page = page;
+		cursor->offset = DATAFLASH_LOG_HEADER_SIZE;
+		cursor->used = used;
+		cursor->sequence = sequence;
+	}
+
+	m_dataflash->Read(cursor->page, cursor->offset, prefix, DATAFLASH_LOG_LENGTH_SIZE);
+	len = prefix[0] | ((uint16_t)prefix[1] << 8);
+
+	if(cursor->offset + DATAFLASH_LOG_LENGTH_SIZE + len > cursor->used)
+		return -1;
+
+	m_dataflash->Read(cursor->page, cursor->offset + DATAFLASH_LOG_LENGTH_SIZE, (uint8_t*)dst, (len < size) ? len : size);
+	cursor->offset += DATAFLASH_LOG_LENGTH_SIZE + len;
+
+	return (int16_t)len;
+}
+
+/**
+ * Read the header of a page.
+ * @return false if the page holds no valid header
+ **/
+bool DataFlashLog::ReadHeader(uint16_t page, uint32_t *sequence, uint16_t *used)
+{
+	uint8_t header[DATAFLASH_LOG_HEADER_SIZE];
+
+	m_dataflash->Read(page, 0, header, DATAFLASH_LOG_HEADER_SIZE);
+
+	*sequence = header[0] | ((uint32_t)header[1] << 8) | ((uint32_t)header[2] << 16) | ((uint32_t)header[3] << 24);
+	*used = header[4] | ((uint16_t)header[5] << 8);
+	uint16_t check = header[6] | ((uint16_t)header[7] << 8);
+
+	return check == dataflash_log_check(*sequence, *used) &&
+	       *used >= DATAFLASH_LOG_HEADER_SIZE && *used <= m_dataflash->PageSize();
+}
+
+/**
+ * Program the page being filled and move on to the next one. The
+ * header goes in last; the program starts without waiting, the next
+ * page is filled in the other buffer meanwhile.
+ **/
+void DataFlashLog::CommitPage()
+{
+	uint8_t header[DATAFLASH_LOG_HEADER_SIZE];
+	uint16_t check = dataflash_log_check(m_sequence, m_offset);
+
+	header[0] = (uint8_t)m_sequence;
+	header[1] = (uint8_t)(m_sequence >> 8);
+	header[2] = (uint8_t)(m_sequence >> 16);
+	header[3] = (uint8_t)(m_sequence >> 24);
+	header[4] = (uint8_t)m_offset;
+	header[5] = (uint8_t)(m_offset >> 8);
+	header[6] = (uint8_t)check;
+	header[7] = (uint8_t)(check >> 8);
+
+	m_dataflash->WriteBuffer(m_buffer, 0, header, DATAFLASH_LOG_HEADER_SIZE);
+
+	/* Pages of a block we didn't erase may not be blank, e.g. after a
+	 * power loss during a program */
+	m_dataflash->StartBufferToPage(m_buffer, m_page, !m_blockErased);
+
+	m_head = m_page;
+	m_headSequence = m_sequence;
+
+	m_buffer = (m_buffer == DATAFLASH_BUFFER1) ? DATAFLASH_BUFFER2 : DATAFLASH_BUFFER1;
+	m_page = NextPage(m_page);
+	m_offset = DATAFLASH_LOG_HEADER_SIZE;
+	m_sequence++;
+
+	if((m_page - m_first) % DATAFLASH_BLOCK_PAGES == 0)
+		m_blockErased = false;
+}
+
+/**
+ * Page following a page of the log.
+ **/
+uint16_t DataFlashLog::NextPage(uint16_t page)
+{
+	page++;
+	if(page >= m_first + m_count)
+		page = m_first;
+
+	return page;
+}
@@ -0,0 +1,161 @@
+/**
+ * @file at45db161d_log.h
+ * @brief Append-only record log for the AT45DB161D module
+ **/
+#ifndef _AT45DB161D_LOG_H_
+#define _AT45DB161D_LOG_H_
+
+#include <inttypes.h>
+
+#include "at45db161d.h"
+
+/**
+ * @defgroup AT45DB161D_log AT45DB161D record log
+ * @{
+ **/
+
+/**
+ * Size of the header at the start of every log page: sequence number
+ * (4 bytes), bytes used (2 bytes) and check word (2 bytes).
+ **/
+#define DATAFLASH_LOG_HEADER_SIZE	8
+/** Size of the length prefix of every record **/
+#define DATAFLASH_LOG_LENGTH_SIZE	2
+/** Largest record in standard page mode, as records don't span pages **/
+#define DATAFLASH_LOG_MAX_RECORD	(DATAFLASH_PAGE_SIZE - DATAFLASH_LOG_HEADER_SIZE - DATAFLASH_LOG_LENGTH_SIZE)
+
+/**
+ * @brief Circular log of variable-length records
+ * Records are packed into pages behind a header holding a sequence
+ * number that increases by one with every page written. Pages are
+ * filled in one SRAM buffer while the previous page is programmed from
+ * the other one. Each block of eight pages is erased once, when the log
+ * enters it, and its pages are then programmed without built-in erase.
+ * When the log reaches the end of its range it wraps around and
+ * overwrites the oldest block.
+ *
+ * Mounting finds the last page written with a binary search over the
+ * page headers: along the range, pages newer than the first page come
+ * first, then erased or older ones.
+ **/
+class DataFlashLog
+{
+	public:
+		/**
+		 * @brief Read position in the log
+		 **/
+		struct Cursor
+		{
+			uint16_t page;		/**< Page being read          **/
+			uint16_t offset;	/**< Next record in the page  **/
+			uint16_t used;		/**< End of the records       **/
+			uint32_t sequence;	/**< Sequence number of page  **/
+		};
+
+	public:
+		/**
+		 * Constructor.
+		 * @param dataflash Device holding the log
+		 * @param firstPage First page of the log, rounded up to a block
+		 * @param pages Number of pages, rounded down to whole blocks, at least two blocks
+		 **/
+		DataFlashLog(AT45DB161D *dataflash, uint16_t firstPage, uint16_t pages);
+
+		/**
+		 * Find the end of the log written before, so that Append goes on
+		 * after it.
+		 * @return true if the log holds at least one page
+		 **/
+		bool Mount();
+
+		/**
+		 * Erase the whole range of the log.
+		 **/
+		void Format();
+
+		/**
+		 * Append a record. The record is programmed when its page is full
+		 * or on Sync.
+		 * @param record Record data
+		 * @param len Length of the record, up to DATAFLASH_LOG_MAX_RECORD, or 16 bytes
+		 *        less in binary page mode
+		 * @return false if the record is too long
+		 **/
+		bool Append(const void *record, uint16_t len);
+
+		/**
+		 * Program the records appended so far and wait for the end of the
+		 * programming. Records appended next start on a new page.
+		 **/
+		void Sync();
+
+		/**
+		 * Set a cursor on the oldest record programmed.
+		 * @param cursor Cursor to set
+		 * @return false if the log is empty
+		 **/
+		bool Rewind(struct DataFlashLog::Cursor *cursor);
+
+		/**
+		 * Read the record under a cursor and move the cursor to the next one.
+		 * @param cursor Cursor set by Rewind
+		 * @param dst Destination
+		 * @param size Size of dst. Longer records are truncated.
+		 * @return Length of the record, or -1 at the end of the log
+		 **/
+		int16_t ReadNext(struct DataFlashLog::Cursor *cursor, void *dst, uint16_t size);
+
+		/**
+		 * Last page programmed, or DATAFLASH_NO_PAGE if none.
+		 **/
+		inline uint16_t HeadPage()
+		{
+			return m_head;
+		}
+
+		/**
+		 * Sequence number of the next page.
+		 **/
+		inline uint32_t Sequence()
+		{
+			return m_sequence;
+		}
+
+	private:
+		/**
+		 * Read the header of a page.
+		 * @return false if the page holds no valid header
+		 **/
+		bool ReadHeader(uint16_t page, uint32_t *sequence, uint16_t *used);
+
+		/**
+		 * Program the page being filled and move on to the next one.
+		 **/
+		void CommitPage();
+
+		/**
+		 * Page following a page of the log.
+		 **/
+		uint16_t NextPage(uint16_t page);
+
+	private:
+		AT45DB161D *m_dataflash;
+
+		uint16_t m_first;				/**< First page of the log **/
+		uint16_t m_count;				/**< Number of pages **/
+
+		uint16_t m_head;				/**< Last page programmed **/
+		uint32_t m_headSequence;		/**< Its sequence number **/
+
+		uint16_t m_page;				/**< Page being filled **/
+		uint16_t m_offset;				/**< Bytes used in the page **/
+		uint32_t m_sequence;			/**< Sequence number of the page **/
+		dataflash_buffer m_buffer;		/**< Buffer the page is filled in **/
+		bool m_blockErased;				/**< The block of m_page was erased by us **/
+};
+
+/**
+ * @}
+ **/
+
+#endif /* _AT45DB161D_LOG_H_ */
@@ -0,0 +1,232 @@
+#include "at45db161d_pool.h"
+
+#include <string.h>
+
+/**
+ * Worst case duration of an operation, from the time it was started
+ * with.
+ **/
+static uint32_t dataflash_pool_worst_time(const struct AT45DB161D::Operation &op)
+{
+	switch(op.type)
+	{
+		case DATAFLASH_OP_PAGE_TO_BUFFER:
+		case DATAFLASH_OP_COMPARE:
+			return DATAFLASH_T_XFR_MAX;
+
+		case DATAFLASH_OP_BUFFER_TO_PAGE:
+			return (op.expected == DATAFLASH_T_P) ? DATAFLASH_T_P_MAX : DATAFLASH_T_EP_MAX;
+
+		case DATAFLASH_OP_PAGE_ERASE:
+			return DATAFLASH_T_PE_MAX;
+
+		case DATAFLASH_OP_BLOCK_ERASE:
+			return DATAFLASH_T_BE_MAX;
+
+		case DATAFLASH_OP_SECTOR_ERASE:
+			return DATAFLASH_T_SE_MAX;
+
+		case DATAFLASH_OP_CHIP_ERASE:
+			return DATAFLASH_T_CE_MAX;
+
+		default:
+			/* Page programs through a buffer erase first */
+			return DATAFLASH_T_EP_MAX;
+	}
+}
+
+/**
+ * Constructor. No page is taken as erased.
+ * @param dataflash Device holding the pages
+ * @param firstPage First page of the range, rounded up to a block
+ * @param pages Number of pages, rounded down to whole blocks
+ * @param workspace DATAFLASH_POOL_WORKSPACE_SIZE(pages) bytes, valid for
+ *        the life of the pool
+ **/
+DataFlashErasePool::DataFlashErasePool(AT45DB161D *dataflash, uint16_t firstPage, uint16_t pages, uint8_t *workspace)
+{
+	uint16_t skip = (DATAFLASH_BLOCK_PAGES - (firstPage % DATAFLASH_BLOCK_PAGES)) % DATAFLASH_BLOCK_PAGES;
+
+	m_dataflash = dataflash;
+	m_first = firstPage + skip;
+	m_pages = (pages > skip) ? pages - skip : 0;
+	m_pages -= m_pages % DATAFLASH_BLOCK_PAGES;
+
+	if(m_pages == 0)
+		ASSERT(0);
+
+	m_erasedMap = workspace;
+	m_discardMap = workspace + (m_pages + 7) / 8;
+	memset(workspace, 0, DATAFLASH_POOL_WORKSPACE_SIZE(m_pages));
+
+	m_erased = 0;
+	m_backlog = 0;
+	m_next = 0;
+	m_discardNext = 0;
+	m_buffer = DATAFLASH_BUFFER1;
+}
+
+/**
+ * Hand back the whole blocks of a span of pages, to be erased by
+ * Tick. Their data must not be needed any more. Pages outside the
+ * pool and blocks partly in the span are left alone, as are blocks
+ * already erased.
+ * @param page First page
+ * @param count Number of pages
+ **/
+void DataFlashErasePool::Discard(uint16_t page, uint16_t count)
+{
+	uint32_t end = (uint32_t)page + count;
+
+	if(page < m_first)
+		page = m_first;
+	if(end > (uint32_t)m_first + m_pages)
+		end = (uint32_t)m_first + m_pages;
+
+	for(uint32_t first = (page + DATAFLASH_BLOCK_PAGES - 1) & ~(uint32_t)(DATAFLASH_BLOCK_PAGES - 1);
+	    first + DATAFLASH_BLOCK_PAGES <= end; first += DATAFLASH_BLOCK_PAGES)
+	{
+		uint16_t index = first - m_first;
+		uint16_t block = index / DATAFLASH_BLOCK_PAGES;
+		uint8_t erased = 0;
+
+		if(Bit(m_discardMap, block))
+			continue;
+
+		for(uint8_t i = 0; i < DATAFLASH_BLOCK_PAGES; i++)
+			erased += Bit(m_erasedMap, index + i);
+
+		if(erased == DATAFLASH_BLOCK_PAGES)
+			continue;
+
+		/* The erased pages of the block wait for the erase too, rather
+		 * than being written in between */
+		for(uint8_t i = 0; i < DATAFLASH_BLOCK_PAGES; i++)
+			SetBit(m_erasedMap, index + i, false);
+
+		m_erased -= erased;
+		SetBit(m_discardMap, block, true);
+		m_backlog++;
+	}
+}
+
+/**
+ * Erase one discarded block, if the chip is idle and the erase cannot
+ * run into a write due within the slack, taking the worst case block
+ * erase time. The pages of the block count as erased from the start:
+ * a Write to one of them waits for the end of the erase.
+ * @param slack Microseconds before the next time critical write
+ * @return true if an erase was started
+ **/
+bool DataFlashErasePool::Tick(uint32_t slack)
+{
+	uint16_t blocks = m_pages / DATAFLASH_BLOCK_PAGES;
+
+	if(!m_backlog || slack < DATAFLASH_T_BE_MAX || m_dataflash->Poll())
+		return false;
+
+	for(uint16_t n = 0; n < blocks; n++)
+	{
+		uint16_t block = (m_discardNext + n) % blocks;
+
+		if(!Bit(m_discardMap, block))
+			continue;
+
+		m_dataflash->StartBlockErase((m_first / DATAFLASH_BLOCK_PAGES) + block);
+
+		for(uint8_t i = 0; i < DATAFLASH_BLOCK_PAGES; i++)
+			SetBit(m_erasedMap, block * DATAFLASH_BLOCK_PAGES + i, true);
+
+		SetBit(m_discardMap, block, false);
+		m_erased += DATAFLASH_BLOCK_PAGES;
+		m_backlog--;
+		m_discardNext = (block + 1) % blocks;
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Next erased page of the pool, in address order from the last one
+ * given. The page stays erased until written.
+ * @return Page number, or DATAFLASH_NO_PAGE if none is left
+ **/
+uint16_t DataFlashErasePool::Allocate()
+{
+	if(!m_erased)
+		return DATAFLASH_NO_PAGE;
+
+	for(uint16_t n = 0; n < m_pages; n++)
+	{
+		uint16_t index = (m_next + n) % m_pages;
+
+		if(Bit(m_erasedMap, index))
+		{
+			m_next = (index + 1) % m_pages;
+			return m_first + index;
+		}
+	}
+
+	return DATAFLASH_NO_PAGE;
+}
+
+/**
+ * Write a whole page. An erased page of the pool is only programmed,
+ * any other page is erased by the chip first. The buffers are used in
+ * turn, so the page is transferred while the previous one is being
+ * programmed. The programming goes on after the call returns.
+ * @param page Page to write
+ * @param src Source, a whole page
+ * @return true if the page was erased, so the write only took a program
+ **/
+bool DataFlashErasePool::Write(uint16_t page, const uint8_t *src)
+{
+	bool erased = IsErased(page);
+
+	m_dataflash->WriteBuffer(m_buffer, 0, src, m_dataflash->PageSize());
+	m_dataflash->StartBufferToPage(m_buffer, page, erased ? 0 : 1);
+
+	if(erased)
+	{
+		SetBit(m_erasedMap, page - m_first, false);
+		m_erased--;
+	}
+
+	m_buffer = (m_buffer == DATAFLASH_BUFFER1) ? DATAFLASH_BUFFER2 : DATAFLASH_BUFFER1;
+	return erased;
+}
+
+/**
+ * Whether a page of the pool is erased.
+ **/
+bool DataFlashErasePool::IsErased(uint16_t page)
+{
+	if(page < m_first || page - m_first >= m_pages)
+		return false;
+
+	return Bit(m_erasedMap, page - m_first);
+}
+
+/**
+ * Longest the next Write to an erased page may wait for the chip, in
+ * microseconds: what is left of the operation in progress, at its
+ * worst, or DATAFLASH_POOL_WRITE_LATENCY for the program of the page
+ * written before.
+ **/
+uint32_t DataFlashErasePool::WorstCaseLatency()
+{
+	const struct AT45DB161D::Operation &op = m_dataflash->LastOperation();
+	uint32_t latency = DATAFLASH_POOL_WRITE_LATENCY;
+
+	if(op.pending)
+	{
+		uint32_t worst = dataflash_pool_worst_time(op);
+		uint32_t elapsed = micros() - op.started;
+
+		if(elapsed < worst && worst - elapsed > latency)
+			latency = worst - elapsed;
+	}
+
+	return latency;
+}
@@ -0,0 +1,157 @@
+/**
+ * @file at45db161d_pool.h
+ * @brief Pool of pre-erased pages for the AT45DB161D module
+ **/
+#ifndef _AT45DB161D_POOL_H_
+#define _AT45DB161D_POOL_H_
+
+#include <inttypes.h>
+
+#include "at45db161d.h"
+
+/**
+ * @defgroup AT45DB161D_pool AT45DB161D pre-erase pool
+ * @{
+ **/
+
+/**
+ * Longest a Write to an erased page may wait for the chip, in
+ * microseconds, when no erase is in progress: the program of the page
+ * written before. The SPI transfer of the page comes on top of it.
+ **/
+#define DATAFLASH_POOL_WRITE_LATENCY	DATAFLASH_T_P_MAX
+
+/**
+ * Bytes of RAM needed by a pool, for the workspace given to the
+ * constructor: one bit per page telling if it is erased, and one bit
+ * per block telling if it is waiting to be erased.
+ * @param pages Number of pages
+ **/
+#define DATAFLASH_POOL_WORKSPACE_SIZE(pages) \
+	(((pages) + 7) / 8 + ((pages) / DATAFLASH_BLOCK_PAGES + 7) / 8)
+
+/**
+ * @brief Pool of pre-erased pages
+ * Keeps track of the erased pages of a range of the chip, so that
+ * writing them only takes a program (tP) instead of an erase and a
+ * program (tEP). Blocks whose data is no longer needed are handed back
+ * with Discard, and Tick erases them one at a time when the chip is
+ * idle, outside the time critical part of the application.
+ *
+ * A Write to an erased page waits at most DATAFLASH_POOL_WRITE_LATENCY
+ * for the chip, or longer if it comes while Tick's erase runs;
+ * WorstCaseLatency tells the bound at any time, and the slack given to
+ * Tick keeps erases from running into the next critical write.
+ *
+ * @note Which pages are erased is kept in RAM. After a reset the whole
+ *       range is taken as written until discarded.
+ **/
+class DataFlashErasePool
+{
+	public:
+		/**
+		 * Constructor.
+		 * @param dataflash Device holding the pages
+		 * @param firstPage First page of the range, rounded up to a block
+		 * @param pages Number of pages, rounded down to whole blocks
+		 * @param workspace DATAFLASH_POOL_WORKSPACE_SIZE(pages) bytes, valid
+		 *        for the life of the pool
+		 **/
+		DataFlashErasePool(AT45DB161D *dataflash, uint16_t firstPage, uint16_t pages, uint8_t *workspace);
+
+		/**
+		 * Hand back the whole blocks of a span of pages, to be erased by
+		 * Tick. Their data must not be needed any more.
+		 * @param page First page
+		 * @param count Number of pages
+		 **/
+		void Discard(uint16_t page, uint16_t count);
+
+		/**
+		 * Erase one discarded block, if the chip is idle and the erase
+		 * cannot run into a write due within the slack.
+		 * @param slack Microseconds before the next time critical write
+		 * @return true if an erase was started
+		 **/
+		bool Tick(uint32_t slack = 0xFFFFFFFF);
+
+		/**
+		 * Next erased page of the pool, in address order from the last
+		 * one given.
+		 * @return Page number, or DATAFLASH_NO_PAGE if none is left
+		 **/
+		uint16_t Allocate();
+
+		/**
+		 * Write a whole page. An erased page of the pool is only
+		 * programmed, any other page is erased by the chip first. The
+		 * programming goes on after the call returns.
+		 * @param page Page to write
+		 * @param src Source, a whole page
+		 * @return true if the page was erased, so the write only took a program
+		 **/
+		bool Write(uint16_t page, const uint8_t *src);
+
+		/**
+		 * Whether a page of the pool is erased.
+		 **/
+		bool IsErased(uint16_t page);
+
+		/**
+		 * Number of erased pages in the pool.
+		 **/
+		inline uint16_t Erased()
+		{
+			return m_erased;
+		}
+
+		/**
+		 * Number of discarded blocks waiting to be erased.
+		 **/
+		inline uint16_t Backlog()
+		{
+			return m_backlog;
+		}
+
+		/**
+		 * Longest the next Write to an erased page may wait for the chip,
+		 * in microseconds: what is left of the erase in progress, at its
+		 * worst, or DATAFLASH_POOL_WRITE_LATENCY.
+		 **/
+		uint32_t WorstCaseLatency();
+
+	private:
+		inline bool Bit(uint8_t *map, uint16_t index)
+		{
+			return map[index >> 3] & (1 << (index & 7));
+		}
+
+		inline void SetBit(uint8_t *map, uint16_t index, bool value)
+		{
+			if(value)
+				map[index >> 3] |= (1 << (index & 7));
+			else
+				map[index >> 3] &= ~(1 << (index & 7));
+		}
+
+	private:
+		AT45DB161D *m_dataflash;
+
+		uint16_t m_first;				/**< First page **/
+		uint16_t m_pages;				/**< Number of pages **/
+
+		uint8_t *m_erasedMap;			/**< One bit per erased page **/
+		uint8_t *m_discardMap;			/**< One bit per block waiting for erase **/
+		uint16_t m_erased;				/**< Number of erased pages **/
+		uint16_t m_backlog;				/**< Number of blocks waiting for erase **/
+
+		uint16_t m_next;				/**< Where Allocate looks first **/
+		uint16_t m_discardNext;			/**< Where Tick looks first **/
+		dataflash_buffer m_buffer;		/**< Buffer used by the next write **/
+};
+
+/**
+ * @}
+ **/
+
+#endif /* _AT45DB161D_POOL_H_ */
@@ -0,0 +1,473 @@
+#include "at45db161d_queue.h"
+
+/**
+ * Constructor. Takes over the DMA interrupt handler of the driver.
+ * @param dataflash Device to drive
+ **/
+DataFlashQueue::DataFlashQueue(AT45DB161D *dataflash)
+{
+	m_dataflash = dataflash;
+
+	m_queue = NULL;
+	m_transfer = NULL;
+	m_program = NULL;
+	m_transferDone = false;
+	m_loading = false;
+	m_erase = NULL;
+	m_erasePage = 0;
+	m_eraseEnd = 0;
+	m_buffer = DATAFLASH_BUFFER2;
+	m_sequence = 0;
+
+	m_running = false;
+	m_again = false;
+
+	m_dataflash->AttachDMAInterrupt(DataFlashQueue::DMAHandler, this);
+}
+
+/**
+ * Queue a request behind the ones of the same or a higher priority,
+ * and start it if it can run now. May be called from interrupt
+ * handlers, request handlers included.
+ * @param request Request, valid until its status is
+ *        DATAFLASH_REQUEST_DONE or DATAFLASH_REQUEST_FAILED
+ **/
+void DataFlashQueue::Submit(struct DataFlashQueue::Request *request)
+{
+	struct Request **link;
+
+	noInterrupts();
+
+	request->status = DATAFLASH_REQUEST_QUEUED;
+	request->sequence = m_sequence++;
+
+	for(link = (struct Request**)&m_queue; *link && (*link)->priority >= request->priority; link = &(*link)->next);
+
+	request->next = *link;
+	*link = request;
+
+	interrupts();
+
+	Run();
+}
+
+/**
+ * Check for the end of the program or erase running and start what can
+ * run next. Call it from the main loop or a timer interrupt; the status
+ * register is not read before the typical duration of the operation.
+ **/
+void DataFlashQueue::Service()
+{
+	Run();
+}
+
+/**
+ * Run Step until nothing changes. Only one context runs the queue at a
+ * time: an interrupt coming while the main loop is at it leaves it a
+ * note to go round once more.
+ **/
+void DataFlashQueue::Run()
+{
+	noInterrupts();
+
+	if(m_running)
+	{
+		m_again = true;
+		interrupts();
+		return;
+	}
+
+	m_running = true;
+	interrupts();
+
+	for(;;)
+	{
+		while(Step());
+
+		noInterrupts();
+
+		if(!m_again)
+		{
+			m_running = false;
+			interrupts();
+			return;
+		}
+
+		m_again = false;
+		interrupts();
+	}
+}
+
+/**
+ * Finish the transfer or operation that ended and start the next
+ * request that can run.
+ * @return true if anything changed
+ **/
+bool DataFlashQueue::Step()
+{
+	struct Request *request;
+	bool changed = false;
+
+	if(m_transfer)
+	{
+		/* The bus is taken until the DMA interrupt */
+		if(!m_transferDone)
+			return false;
+
+		request = m_transfer;
+		m_transfer = NULL;
+		m_transferDone = false;
+		changed = true;
+
+		if(m_dataflash->DMAStatus() != DATAFLASH_DMA_DONE)
+		{
+			Complete(request, DATAFLASH_REQUEST_FAILED);
+		}
+		else if(request->type == DATAFLASH_REQUEST_WRITE)
+		{
+			/* The page stays in the buffer once programmed */
+			m_dataflash->StartBufferToPage(m_buffer, request->page, 1);
+			m_program = request;
+		}
+		else
+		{
+			Complete(request, DATAFLASH_REQUEST_DONE);
+		}
+	}
+
+	if(m_program && !m_dataflash->Poll())
+	{
+		request = m_program;
+		m_program = NULL;
+		changed = true;
+
+		if(m_loading)
+		{
+			/* The rest of the page is in the buffer, the data goes over it */
+			m_loading = false;
+
+			if(!StartWrite(request))
+				Complete(request, DATAFLASH_REQUEST_FAILED);
+		}
+		else if(request->type == DATAFLASH_REQUEST_ERASE_SECTOR && m_erasePage < m_eraseEnd)
+		{
+			/* Reads of a higher priority may run before the next block */
+			m_erase = request;
+		}
+		else
+		{
+			Complete(request, DATAFLASH_REQUEST_DONE);
+		}
+	}
+
+	request = Next();
+	if(request)
+	{
+		Start(request);
+		changed = true;
+	}
+	else if(m_erase && !m_transfer && !m_program)
+	{
+		request = m_erase;
+		m_erase = NULL;
+		EraseNextBlock(request);
+		changed = true;
+	}
+
+	return changed;
+}
+
+/**
+ * Take the queued request to start next out of the queue: the first
+ * one, in queue order, that no earlier request holds back and that can
+ * run alongside the program or erase running, if any. Between the
+ * blocks of a sector erase, only reads of a higher priority outside
+ * the sector go first.
+ * @return The request, or NULL if none can start
+ **/
+struct DataFlashQueue::Request *DataFlashQueue::Next()
+{
+	struct Request **link;
+	dataflash_buffer bufferNum;
+
+	if(m_transfer)
+		return NULL;
+
+	/* Geometry known, so the scan sends no command */
+	m_dataflash->PageSize();
+
+	noInterrupts();
+
+	for(link = (struct Request**)&m_queue; *link; link = &(*link)->next)
+	{
+		struct Request *request = *link;
+
+		if(Blocked(request))
+			continue;
+
+		if(m_program && !BufferHit(request, &bufferNum))
+			continue;
+
+		if(m_erase && !Passes(request))
+			continue;
+
+		*link = request->next;
+		request->status = DATAFLASH_REQUEST_RUNNING;
+
+		interrupts();
+		return request;
+	}
+
+	interrupts();
+	return NULL;
+}
+
+/**
+ * Start a request taken out of the queue. Requests out of the main
+ * memory fail.
+ **/
+void DataFlashQueue::Start(struct DataFlashQueue::Request *request)
+{
+	uint16_t pageSize = m_dataflash->PageSize();
+	uint32_t size = (uint32_t)m_dataflash->PageCount() * pageSize;
+	dataflash_buffer bufferNum;
+	bool started;
+
+	switch(request->type)
+	{
+		case DATAFLASH_REQUEST_READ:
+			if((uint32_t)request->page * pageSize + request->offset + request->len > size)
+				break;
+
+			m_transfer = request;
+
+			if(BufferHit(request, &bufferNum))
+			{
+				started = m_dataflash->ReadBufferDMA(bufferNum, request->offset, request->data, request->len);
+			}
+			else
+			{
+				started = m_dataflash->ReadDMA(request->page, request->offset, request->data, request->len);
+			}
+
+			if(!started)
+			{
+				m_transfer = NULL;
+				break;
+			}
+			return;
+
+		case DATAFLASH_REQUEST_WRITE:
+			if(request->page >= m_dataflash->PageCount() || request->offset + request->len > pageSize)
+				break;
+
+			/* A page not in a buffer goes to the one not written last,
+			 * so the previous page can still be read from the other */
+			if(!m_dataflash->FindBuffer(request->page, &bufferNum))
+			{
+				bufferNum = (m_buffer == DATAFLASH_BUFFER1) ? DATAFLASH_BUFFER2 : DATAFLASH_BUFFER1;
+
+				/* The rest of a partial page comes from main memory. The
+				 * transfer runs as a stage of its own, rather than the
+				 * buffer write waiting tXFR for it, maybe in an interrupt */
+				if(request->len < pageSize)
+				{
+					m_buffer = bufferNum;
+					m_dataflash->StartPageToBuffer(request->page, bufferNum);
+					m_program = request;
+					m_loading = true;
+					return;
+				}
+			}
+
+			m_buffer = bufferNum;
+
+			if(!StartWrite(request))
+				break;
+			return;
+
+		case DATAFLASH_REQUEST_ERASE_BLOCK:
+			if(request->page >= m_dataflash->PageCount())
+				break;
+
+			m_dataflash->StartBlockErase(request->page / DATAFLASH_BLOCK_PAGES);
+			m_program = request;
+			return;
+
+		case DATAFLASH_REQUEST_ERASE_SECTOR:
+			if(request->page >= m_dataflash->PageCount())
+				break;
+
+			/* Erased block by block, sector 0 in its parts 0a and 0b as
+			 * Range has it. Erasing the blocks takes less than a sector
+			 * erase, and reads do not wait for more than one of them */
+			Range(request, &m_erasePage, &m_eraseEnd);
+			m_eraseEnd += m_erasePage;
+			EraseNextBlock(request);
+			return;
+	}
+
+	Complete(request, DATAFLASH_REQUEST_FAILED);
+}
+
+/**
+ * Start the DMA transfer of the data of a write into m_buffer, with
+ * nothing running on the chip.
+ * @return false if the transfer could not be started
+ **/
+bool DataFlashQueue::StartWrite(struct DataFlashQueue::Request *request)
+{
+	m_transfer = request;
+
+	if(!m_dataflash->WriteBufferDMA(m_buffer, request->offset, request->data, request->len))
+	{
+		m_transfer = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Start the erase of the next block of a sector request.
+ **/
+void DataFlashQueue::EraseNextBlock(struct DataFlashQueue::Request *request)
+{
+	m_dataflash->StartBlockErase(m_erasePage / DATAFLASH_BLOCK_PAGES);
+	m_erasePage += DATAFLASH_BLOCK_PAGES;
+	m_program = request;
+}
+
+/**
+ * Whether a request may run between two blocks of the sector erase in
+ * m_erase: a read of a higher priority, outside of the sector.
+ **/
+bool DataFlashQueue::Passes(const struct DataFlashQueue::Request *request)
+{
+	uint16_t first, count, eraseFirst, eraseCount;
+
+	if(request->type != DATAFLASH_REQUEST_READ || request->priority <= m_erase->priority)
+		return false;
+
+	Range(request, &first, &count);
+	Range(m_erase, &eraseFirst, &eraseCount);
+
+	return (uint32_t)first + count <= eraseFirst || (uint32_t)eraseFirst + eraseCount <= first;
+}
+
+/**
+ * Whether an earlier request still queued touches the same pages and
+ * either one changes them. Called with interrupts masked.
+ **/
+bool DataFlashQueue::Blocked(const struct DataFlashQueue::Request *request)
+{
+	uint16_t first, count;
+
+	Range(request, &first, &count);
+
+	for(const struct Request *other = m_queue; other; other = other->next)
+	{
+		uint16_t otherFirst, otherCount;
+
+		if((int32_t)(other->sequence - request->sequence) >= 0)
+			continue;
+
+		if(other->type == DATAFLASH_REQUEST_READ && request->type == DATAFLASH_REQUEST_READ)
+			continue;
+
+		Range(other, &otherFirst, &otherCount);
+
+		if((uint32_t)otherFirst < (uint32_t)first + count && (uint32_t)first < (uint32_t)otherFirst + otherCount)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Buffer holding the page of a read within a single page, that the
+ * operation running does not use. The chip serves such buffer reads
+ * while it programs or erases.
+ * @param request Request
+ * @param bufferNum Set to the buffer
+ * @return true if the read can be served from a buffer
+ **/
+bool DataFlashQueue::BufferHit(const struct DataFlashQueue::Request *request, dataflash_buffer *bufferNum)
+{
+	const struct AT45DB161D::Operation &op = m_dataflash->LastOperation();
+
+	if(request->type != DATAFLASH_REQUEST_READ || request->offset + request->len > m_dataflash->PageSize())
+		return false;
+
+	if(!m_dataflash->FindBuffer(request->page, bufferNum))
+		return false;
+
+	return !(op.pending && op.buffer == *bufferNum);
+}
+
+/**
+ * Pages a request touches.
+ * @param request Request
+ * @param first Set to the first page
+ * @param count Set to the number of pages
+ **/
+void DataFlashQueue::Range(const struct DataFlashQueue::Request *request, uint16_t *first, uint16_t *count)
+{
+	uint16_t pageSize = m_dataflash->PageSize();
+	uint16_t sectorPages = m_dataflash->SectorPages();
+
+	switch(request->type)
+	{
+		case DATAFLASH_REQUEST_READ:
+			*first = request->page;
+			*count = ((uint32_t)request->offset + request->len + pageSize - 1) / pageSize;
+			break;
+
+		case DATAFLASH_REQUEST_ERASE_BLOCK:
+			*first = request->page - request->page % DATAFLASH_BLOCK_PAGES;
+			*count = DATAFLASH_BLOCK_PAGES;
+			break;
+
+		case DATAFLASH_REQUEST_ERASE_SECTOR:
+			if(request->page < DATAFLASH_BLOCK_PAGES)
+			{
+				*first = 0;
+				*count = DATAFLASH_BLOCK_PAGES;
+			}
+			else if(request->page < sectorPages)
+			{
+				*first = DATAFLASH_BLOCK_PAGES;
+				*count = sectorPages - DATAFLASH_BLOCK_PAGES;
+			}
+			else
+			{
+				*first = request->page - request->page % sectorPages;
+				*count = sectorPages;
+			}
+			break;
+
+		default:
+			*first = request->page;
+			*count = 1;
+			break;
+	}
+}
+
+/**
+ * Record the end of a request and call its handler.
+ **/
+void DataFlashQueue::Complete(struct DataFlashQueue::Request *request, dataflash_request_status status)
+{
+	request->status = status;
+
+	if(request->handler)
+		request->handler(request->context);
+}
+
+void DataFlashQueue::DMAHandler(void *context)
+{
+	DataFlashQueue *queue = (DataFlashQueue*)context;
+
+	queue->m_transferDone = true;
+	queue->Run();
+}
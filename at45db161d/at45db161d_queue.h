@@ -0,0 +1,211 @@
+/**
+ * @file at45db161d_queue.h
+ * @brief Prioritized, interrupt driven request queue for the AT45DB161D module
+ **/
+#ifndef _AT45DB161D_QUEUE_H_
+#define _AT45DB161D_QUEUE_H_
+
+#include <inttypes.h>
+
+#include "at45db161d.h"
+
+/**
+ * @defgroup AT45DB161D_queue AT45DB161D request queue
+ * @{
+ **/
+
+/**
+ * Kind of a queued request.
+ **/
+typedef enum dataflash_request_type
+{
+	DATAFLASH_REQUEST_READ,			/**< Read len bytes from page and offset, across pages **/
+	DATAFLASH_REQUEST_WRITE,		/**< Write len bytes at page and offset, within the page **/
+	DATAFLASH_REQUEST_ERASE_BLOCK,	/**< Erase the block holding page **/
+	DATAFLASH_REQUEST_ERASE_SECTOR	/**< Erase the sector holding page; sector 0 in its parts 0a and 0b **/
+} dataflash_request_type;
+
+/**
+ * Progress of a queued request.
+ **/
+typedef enum dataflash_request_status
+{
+	DATAFLASH_REQUEST_QUEUED,
+	DATAFLASH_REQUEST_RUNNING,
+	DATAFLASH_REQUEST_DONE,
+	DATAFLASH_REQUEST_FAILED		/**< Out of the main memory, or DMA error **/
+} dataflash_request_status;
+
+/**
+ * Handler called when a request is over.
+ **/
+typedef void (*dataflash_request_handler)(void *context);
+
+/**
+ * @brief Prioritized request queue
+ * Takes read, write and erase requests from the main loop and from
+ * interrupt handlers, and runs them in the background: data moves by
+ * DMA and the next request starts from the DMA interrupt. Requests
+ * run by priority, then in the order they came. A request does not
+ * pass an earlier one touching the same pages unless both are reads.
+ *
+ * While the chip programs or erases, a read of a single page held by
+ * the other SRAM buffer is served from it; any other request waits for
+ * the end of the operation. Pages written through the queue stay in a
+ * buffer, so reads of recent writes do not wait behind the next ones.
+ *
+ * A sector erase runs as the erase of each of its blocks, and reads of
+ * a higher priority outside of the sector start between two blocks. A
+ * read thus waits for one block erase at most (tBE, 30 ms typical, 75
+ * ms max), not for a whole sector erase (tSE, 1.6 s), unless it is held
+ * back by an earlier request on the same pages.
+ *
+ * The end of a program or erase is found by Service, to be called from
+ * the main loop or a timer interrupt; it reads the status register no
+ * sooner than the typical duration of the operation. So is the end of
+ * the page to buffer transfer that comes first in a write of part of a
+ * page not held by a buffer: the queue never waits on the chip, so
+ * interrupt handlers running it return at once.
+ *
+ * The queue owns the chip and its DMA interrupt handler: no other
+ * command may be sent to the device while requests are queued or
+ * running.
+ **/
+class DataFlashQueue
+{
+	public:
+		/**
+		 * @brief Request, owned by the caller until it is over
+		 **/
+		struct Request
+		{
+			dataflash_request_type type;
+			uint8_t priority;				/**< Higher runs first **/
+			uint16_t page;
+			uint16_t offset;
+			uint8_t *data;					/**< Destination of a read, source of a write **/
+			size_t len;
+			dataflash_request_handler handler;	/**< Called when over, or NULL **/
+			void *context;					/**< Passed to the handler **/
+			volatile dataflash_request_status status;
+
+			/* Used by the queue */
+			uint32_t sequence;
+			struct Request *next;
+		};
+
+		/**
+		 * Constructor. Takes over the DMA interrupt handler of the driver.
+		 * @param dataflash Device to drive
+		 **/
+		DataFlashQueue(AT45DB161D *dataflash);
+
+		/**
+		 * Queue a request, and start it if it can run now. May be called
+		 * from interrupt handlers, request handlers included. If the
+		 * device was powered down by PowerDownIfIdle, starting the request
+		 * waits t_RDPD (35 us) to resume it, in the caller's context.
+		 * @param request Request, valid until its status is
+		 *        DATAFLASH_REQUEST_DONE or DATAFLASH_REQUEST_FAILED
+		 **/
+		void Submit(struct DataFlashQueue::Request *request);
+
+		/**
+		 * Check for the end of the program, erase or transfer running and
+		 * start what can run next.
+		 **/
+		void Service();
+
+		/**
+		 * Whether no request is queued or running.
+		 **/
+		inline bool Idle()
+		{
+			return m_queue == NULL && m_transfer == NULL && m_program == NULL;
+		}
+
+	private:
+		/**
+		 * Run Step until nothing changes, unless another context is at it.
+		 **/
+		void Run();
+
+		/**
+		 * Finish the transfer or operation that ended and start the next
+		 * request that can run.
+		 * @return true if anything changed
+		 **/
+		bool Step();
+
+		/**
+		 * Queued request to start next, or NULL.
+		 **/
+		struct Request *Next();
+
+		/**
+		 * Start a request taken out of the queue.
+		 **/
+		void Start(struct Request *request);
+
+		/**
+		 * Start the DMA transfer of the data of a write into m_buffer.
+		 **/
+		bool StartWrite(struct Request *request);
+
+		/**
+		 * Start the erase of the next block of a sector request.
+		 **/
+		void EraseNextBlock(struct Request *request);
+
+		/**
+		 * Whether a request may run between two blocks of m_erase.
+		 **/
+		bool Passes(const struct Request *request);
+
+		/**
+		 * Whether an earlier queued request touches the same pages and
+		 * either one changes them.
+		 **/
+		bool Blocked(const struct Request *request);
+
+		/**
+		 * Buffer holding the page of a single page read, that the
+		 * operation running does not use.
+		 **/
+		bool BufferHit(const struct Request *request, dataflash_buffer *bufferNum);
+
+		/**
+		 * Pages a request touches.
+		 **/
+		void Range(const struct Request *request, uint16_t *first, uint16_t *count);
+
+		/**
+		 * Record the end of a request and call its handler.
+		 **/
+		void Complete(struct Request *request, dataflash_request_status status);
+
+		static void DMAHandler(void *context);
+
+	private:
+		AT45DB161D *m_dataflash;
+
+		struct Request *volatile m_queue;		/**< Waiting requests, by priority then sequence **/
+		struct Request *volatile m_transfer;	/**< Request whose DMA transfer runs **/
+		struct Request *m_program;				/**< Request whose program, erase or page load runs **/
+		volatile bool m_transferDone;			/**< The DMA transfer of m_transfer ended **/
+		bool m_loading;							/**< m_program loads the page of a partial write **/
+		struct Request *m_erase;				/**< Sector erase waiting between two blocks **/
+		uint16_t m_erasePage;					/**< First page of the next block of a sector erase **/
+		uint16_t m_eraseEnd;					/**< Page past the sector of a sector erase **/
+		dataflash_buffer m_buffer;				/**< Buffer of the write in m_transfer **/
+		uint32_t m_sequence;					/**< Sequence of the next request **/
+
+		volatile bool m_running;				/**< A context is in Run **/
+		volatile bool m_again;					/**< Something changed during Run **/
+};
+
+/**
+ * @}
+ **/
+
+#endif /* _AT45DB161D_QUEUE_H_ */
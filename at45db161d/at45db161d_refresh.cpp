@@ -0,0 +1,210 @@
+#include "at45db161d_refresh.h"
+
+/**
+ * Constructor. Takes over the program handler of the driver. The
+ * geometry of the part is only read later, when the chip is in use.
+ * @param dataflash Device to refresh
+ * @param workspace DATAFLASH_REFRESH_WORKSPACE_SIZE(sectors) words,
+ *        valid for the life of the scheduler
+ * @param sectors Number of sectors the workspace is sized for, at least
+ *        those of the part
+ **/
+DataFlashRefresh::DataFlashRefresh(AT45DB161D *dataflash, uint16_t *workspace, uint8_t sectors)
+{
+	m_dataflash = dataflash;
+	m_rewrites = 0;
+	m_count = workspace;
+	m_next = workspace + sectors;
+	m_sectors = sectors;
+
+	for(uint8_t i = 0; i < m_sectors; i++)
+	{
+		m_count[i] = 0;
+		m_next[i] = 0;
+	}
+
+	m_dataflash->AttachProgramHandler(DataFlashRefresh::ProgramHandler, this);
+}
+
+/**
+ * Rewrite the pages due, if the chip is idle. The sector furthest
+ * behind its schedule goes first.
+ * @param maxPages Largest number of pages rewritten. Above one, the
+ *        call waits for each rewrite to end before the next.
+ * @return Number of rewrites started
+ **/
+uint8_t DataFlashRefresh::Tick(uint8_t maxPages)
+{
+	dataflash_buffer bufferNum;
+	uint8_t started = 0;
+	uint8_t sectors;
+	uint16_t sectorPages;
+
+	if(m_dataflash->Poll())
+		return 0;
+
+	/* Keep the changes waiting in the buffers, and rather take a buffer
+	 * mirroring no page */
+	if(m_dataflash->IsBufferDirty(DATAFLASH_BUFFER2) ||
+	   (!m_dataflash->IsBufferDirty(DATAFLASH_BUFFER1) && m_dataflash->BufferPage(DATAFLASH_BUFFER1) == DATAFLASH_NO_PAGE))
+		bufferNum = DATAFLASH_BUFFER1;
+	else
+		bufferNum = DATAFLASH_BUFFER2;
+
+	if(m_dataflash->IsBufferDirty(bufferNum))
+		return 0;
+
+	sectors = Sectors();
+	sectorPages = m_dataflash->SectorPages();
+
+	while(started < maxPages)
+	{
+		uint8_t sector = 0;
+		uint16_t behind = 0;
+
+		for(uint8_t i = 0; i < sectors; i++)
+		{
+			uint16_t due = Due(i);
+
+			if(due > m_next[i] && due - m_next[i] > behind)
+			{
+				sector = i;
+				behind = due - m_next[i];
+			}
+		}
+
+		if(!behind)
+			break;
+
+		/* Waits for the previous rewrite, if any */
+		m_dataflash->StartAutoPageRewrite(sector * sectorPages + m_next[sector], bufferNum);
+		m_rewrites++;
+		started++;
+
+		if(++m_next[sector] == sectorPages)
+		{
+			/* Every page was rewritten, the next pass begins */
+			m_count[sector] = 0;
+			m_next[sector] = 0;
+		}
+	}
+
+	return started;
+}
+
+/**
+ * Number of pages due for a rewrite and not rewritten yet.
+ **/
+uint16_t DataFlashRefresh::Backlog()
+{
+	uint16_t backlog = 0;
+	uint8_t sectors = Sectors();
+
+	for(uint8_t i = 0; i < sectors; i++)
+	{
+		uint16_t due = Due(i);
+
+		if(due > m_next[i])
+			backlog += due - m_next[i];
+	}
+
+	return backlog;
+}
+
+/**
+ * Count an operation started by the driver. Block erases and the
+ * erase of sector 0a or 0b count once per page erased. Erasing a
+ * whole sector leaves nothing to refresh in it.
+ **/
+void DataFlashRefresh::Count(dataflash_op type, uint16_t address)
+{
+	/* The driver knows the geometry once it starts an operation */
+	uint16_t sectorPages = m_dataflash->SectorPages();
+
+	switch(type)
+	{
+		case DATAFLASH_OP_BUFFER_TO_PAGE:
+		case DATAFLASH_OP_PAGE_ERASE:
+		case DATAFLASH_OP_PAGE_WRITE_THROUGH_BUFFER:
+		case DATAFLASH_OP_AUTO_PAGE_REWRITE:
+			Add(address / sectorPages, 1);
+			break;
+
+		case DATAFLASH_OP_BLOCK_ERASE:
+			Add(((uint32_t)address * DATAFLASH_BLOCK_PAGES) / sectorPages, DATAFLASH_BLOCK_PAGES);
+			break;
+
+		case DATAFLASH_OP_SECTOR_ERASE:
+			if(address == 0)
+			{
+				Add(0, DATAFLASH_BLOCK_PAGES);
+			}
+			else if(address < sectorPages)
+			{
+				Add(0, sectorPages - DATAFLASH_BLOCK_PAGES);
+			}
+			else if(address / sectorPages < m_sectors)
+			{
+				m_count[address / sectorPages] = 0;
+				m_next[address / sectorPages] = 0;
+			}
+			break;
+
+		case DATAFLASH_OP_CHIP_ERASE:
+			for(uint8_t i = 0; i < m_sectors; i++)
+			{
+				m_count[i] = 0;
+				m_next[i] = 0;
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+/**
+ * Add operations to a sector.
+ **/
+void DataFlashRefresh::Add(uint8_t sector, uint16_t count)
+{
+	if(sector >= m_sectors)
+		return;
+
+	m_count[sector] = (m_count[sector] > 0xFFFF - count) ? 0xFFFF : m_count[sector] + count;
+}
+
+/**
+ * Pages of a sector that should have been rewritten by now, growing
+ * with the operations counted so that the pass ends after
+ * DATAFLASH_REFRESH_BUDGET of them.
+ **/
+uint16_t DataFlashRefresh::Due(uint8_t sector)
+{
+	uint16_t sectorPages = m_dataflash->SectorPages();
+	uint32_t due = ((uint32_t)m_count[sector] * sectorPages + DATAFLASH_REFRESH_BUDGET - 1) / DATAFLASH_REFRESH_BUDGET;
+
+	return (due > sectorPages) ? sectorPages : (uint16_t)due;
+}
+
+/**
+ * Number of sectors of the part, within those of the workspace. A
+ * workspace too small for the part leaves its last sectors alone.
+ **/
+uint8_t DataFlashRefresh::Sectors()
+{
+	uint16_t sectors = m_dataflash->PageCount() / m_dataflash->SectorPages();
+
+	if(sectors > m_sectors)
+	{
+		ASSERT(0);
+		return m_sectors;
+	}
+
+	return (uint8_t)sectors;
+}
+
+void DataFlashRefresh::ProgramHandler(void *context, dataflash_op type, uint16_t address)
+{
+	((DataFlashRefresh*)context)->Count(type, address);
+}
@@ -0,0 +1,133 @@
+/**
+ * @file at45db161d_refresh.h
+ * @brief Background page refresh for the AT45DB161D module
+ **/
+#ifndef _AT45DB161D_REFRESH_H_
+#define _AT45DB161D_REFRESH_H_
+
+#include <inttypes.h>
+
+#include "at45db161d.h"
+
+/**
+ * @defgroup AT45DB161D_refresh AT45DB161D page refresh
+ * @{
+ **/
+
+/**
+ * Cumulative page program and erase operations a sector may go through
+ * before each of its pages has to be rewritten.
+ **/
+#define DATAFLASH_REFRESH_LIMIT		10000
+/**
+ * Operations within which a refresh pass over a sector completes. A
+ * page is rewritten at most two passes apart, so this is kept under
+ * half the limit, with room for the rewrites being late. Sectors of
+ * DATAFLASH_SECTOR_PAGES are the largest of the parts.
+ **/
+#define DATAFLASH_REFRESH_BUDGET	(DATAFLASH_REFRESH_LIMIT / 2 - DATAFLASH_SECTOR_PAGES)
+
+/**
+ * Number of 16-bit words of the workspace given to the constructor:
+ * an operation count and a rewrite position per sector. The AT45DB161D
+ * has DATAFLASH_SECTOR_COUNT sectors, the AT45DB321D 64.
+ * @param sectors Number of sectors of the part
+ **/
+#define DATAFLASH_REFRESH_WORKSPACE_SIZE(sectors)	((sectors) * 2)
+
+/**
+ * @brief Incremental Auto Page Rewrite scheduler
+ * Counts the program and erase operations the driver starts in each
+ * sector. As soon as a sector is written to, a refresh pass over its
+ * pages begins, paced so that it ends after DATAFLASH_REFRESH_BUDGET
+ * operations. Tick rewrites the pages that are due, a few at a time,
+ * when the chip is idle, so the refresh never stops the application
+ * for long. Sectors never written to are left alone.
+ *
+ * The rewrites go through an SRAM buffer holding no changes waiting to
+ * be programmed; Tick skips its turn when both buffers hold some.
+ *
+ * @note Counts are kept in RAM and start from zero. An application
+ *       resetting often between heavy writes should persist them.
+ **/
+class DataFlashRefresh
+{
+	public:
+		/**
+		 * Constructor. Takes over the program handler of the driver.
+		 * @param dataflash Device to refresh
+		 * @param workspace DATAFLASH_REFRESH_WORKSPACE_SIZE(sectors) words,
+		 *        valid for the life of the scheduler
+		 * @param sectors Number of sectors the workspace is sized for, at
+		 *        least those of the part
+		 **/
+		DataFlashRefresh(AT45DB161D *dataflash, uint16_t *workspace, uint8_t sectors);
+
+		/**
+		 * Rewrite the pages due, if the chip is idle.
+		 * @param maxPages Largest number of pages rewritten. Above one, the
+		 *        call waits for each rewrite to end before the next.
+		 * @return Number of rewrites started
+		 **/
+		uint8_t Tick(uint8_t maxPages = 1);
+
+		/**
+		 * Number of pages due for a rewrite and not rewritten yet.
+		 **/
+		uint16_t Backlog();
+
+		/**
+		 * Operations counted in a sector since its refresh pass began.
+		 * @param sector Sector, less than the sectors of the workspace
+		 **/
+		inline uint16_t Operations(uint8_t sector)
+		{
+			return m_count[sector];
+		}
+
+		/**
+		 * Number of pages rewritten since construction.
+		 **/
+		inline uint32_t Rewrites()
+		{
+			return m_rewrites;
+		}
+
+	private:
+		/**
+		 * Count an operation started by the driver.
+		 **/
+		void Count(dataflash_op type, uint16_t address);
+
+		/**
+		 * Add operations to a sector.
+		 **/
+		void Add(uint8_t sector, uint16_t count);
+
+		/**
+		 * Pages of a sector that should have been rewritten by now.
+		 **/
+		uint16_t Due(uint8_t sector);
+
+		/**
+		 * Number of sectors of the part, within those of the workspace.
+		 **/
+		uint8_t Sectors();
+
+		static void ProgramHandler(void *context, dataflash_op type, uint16_t address);
+
+	private:
+		AT45DB161D *m_dataflash;
+
+		uint16_t *m_count;				/**< Operations since the pass began, per sector **/
+		uint16_t *m_next;				/**< Pages rewritten in the pass, per sector **/
+		uint8_t m_sectors;				/**< Sectors the workspace holds **/
+
+		uint32_t m_rewrites;
+};
+
+/**
+ * @}
+ **/
+
+#endif /* _AT45DB161D_REFRESH_H_ */
@@ -0,0 +1,257 @@
+#include "at45db161d_stream.h"
+
+#include <string.h>
+
+/**
+ * Constructor.
+ * @param dataflash Device to read
+ * @param ring RAM filled ahead of the reader, valid for the life of the stream
+ * @param size Size of the ring, an even number of bytes. Each DMA
+ *        transfer moves half of it.
+ **/
+DataFlashStream::DataFlashStream(AT45DB161D *dataflash, uint8_t *ring, size_t size)
+{
+	if(size < 2 || (size & 1))
+	{
+		ASSERT(0);
+		size &= ~(size_t)1;
+	}
+
+	m_dataflash = dataflash;
+	m_ring = ring;
+	m_size = size;
+	m_half = size / 2;
+
+	m_start = 0;
+	m_end = 0;
+	m_head = 0;
+	m_tail = 0;
+	m_pending = 0;
+	m_error = false;
+	m_open = false;
+}
+
+/**
+ * Start reading at a page and offset. Waits for the operation in
+ * progress, if any. The stream ends with the last byte of the main
+ * memory.
+ * @param page Page of the main memory where the read starts
+ * @param offset Starting byte within the page
+ * @return false if DMA is not available
+ **/
+bool DataFlashStream::Open(uint16_t page, uint16_t offset)
+{
+	if(m_open)
+		Close();
+
+	m_dataflash->WaitForOperation();
+	m_dataflash->AttachDMAInterrupt(DataFlashStream::DMAHandler, this);
+
+	m_end = (uint32_t)m_dataflash->PageCount() * m_dataflash->PageSize();
+	m_error = false;
+
+	return Start((uint32_t)page * m_dataflash->PageSize() + offset);
+}
+
+/**
+ * Stop reading and release the bus. Waits for the DMA transfer
+ * running, at most half of the ring.
+ **/
+void DataFlashStream::Close()
+{
+	if(!m_open)
+		return;
+
+	Stop();
+	m_dataflash->AttachDMAInterrupt(NULL, NULL);
+}
+
+/**
+ * Read the next bytes, waiting for the DMA if needed.
+ * @param dst Destination, at least len bytes
+ * @param len Number of bytes to read
+ * @return Number of bytes read, less than len at the end of the
+ *         memory or after a DMA error
+ **/
+size_t DataFlashStream::Read(uint8_t *dst, size_t len)
+{
+	size_t done = 0;
+
+	while(done < len && Wait())
+	{
+		size_t index = m_tail % m_size;
+		size_t count = m_head - m_tail;
+
+		/* Up to the end of the ring, the rest comes next round */
+		if(count > m_size - index)
+			count = m_size - index;
+		if(count > len - done)
+			count = len - done;
+
+		memcpy(dst + done, m_ring + index, count);
+		done += count;
+		Consume(count);
+	}
+
+	return done;
+}
+
+/**
+ * Next byte, left in the stream.
+ * @return The byte, or -1 at the end of the memory or after a DMA error
+ **/
+int16_t DataFlashStream::Peek()
+{
+	if(!Wait())
+		return -1;
+
+	return m_ring[m_tail % m_size];
+}
+
+/**
+ * Pass over the next bytes. A jump further than what the ring holds
+ * plus DATAFLASH_STREAM_SEEK_DISTANCE restarts the read at the target
+ * rather than reading what is skipped.
+ * @param len Number of bytes to skip
+ * @return Number of bytes skipped, less than len at the end of the
+ *         memory or after a DMA error
+ **/
+size_t DataFlashStream::Skip(size_t len)
+{
+	size_t done = 0;
+
+	if(m_open && len > m_end - Position())
+		len = m_end - Position();
+
+	if(m_open && !m_error && len > Available() + DATAFLASH_STREAM_SEEK_DISTANCE)
+	{
+		Stop();
+		Start(Position() + len);
+		return len;
+	}
+
+	while(done < len && Wait())
+	{
+		size_t count = m_head - m_tail;
+
+		if(count > len - done)
+			count = len - done;
+
+		done += count;
+		Consume(count);
+	}
+
+	return done;
+}
+
+/**
+ * Begin the read at a linear address, with the ring empty.
+ **/
+bool DataFlashStream::Start(uint32_t address)
+{
+	uint16_t page, offset;
+
+	m_start = address;
+	m_head = 0;
+	m_tail = 0;
+	m_pending = 0;
+
+	m_dataflash->LinearToPage(address, &page, &offset);
+	m_open = m_dataflash->BeginReadDMA(page, offset);
+
+	if(m_open)
+		Fill();
+
+	return m_open;
+}
+
+/**
+ * Let the transfer running end, without starting another, and end
+ * the read.
+ **/
+void DataFlashStream::Stop()
+{
+	m_open = false;
+
+	while(m_pending);
+
+	m_dataflash->EndReadDMA();
+}
+
+/**
+ * Start filling the next half of the ring, if the reader is done with
+ * it. Called with no transfer running, from the DMA interrupt or from
+ * the reader.
+ **/
+void DataFlashStream::Fill()
+{
+	uint32_t left = m_end - (m_start + m_head);
+	size_t len = (left < m_half) ? left : m_half;
+
+	if(!m_open || m_error || len == 0)
+		return;
+
+	/* The halves are filled in turn, so the next one is free once
+	 * there is room for a whole half */
+	if(m_head - m_tail + m_half > m_size)
+		return;
+
+	m_pending = len;
+
+	if(!m_dataflash->ContinueReadDMA(m_ring + (m_head % m_size), len))
+	{
+		m_error = true;
+		m_pending = 0;
+	}
+}
+
+/**
+ * End of a DMA transfer: hand the bytes to the reader and go on.
+ **/
+void DataFlashStream::Filled()
+{
+	if(m_dataflash->DMAStatus() == DATAFLASH_DMA_DONE)
+		m_head += m_pending;
+	else
+		m_error = true;
+
+	m_pending = 0;
+	Fill();
+}
+
+/**
+ * Drop bytes the reader is done with, restarting the DMA if it had
+ * paused for want of room.
+ **/
+void DataFlashStream::Consume(size_t len)
+{
+	m_tail += len;
+
+	/* When a transfer is running, the interrupt at its end sees the
+	 * new tail */
+	if(!m_pending)
+		Fill();
+}
+
+/**
+ * Wait until a byte is available.
+ * @return false at the end of the memory, after a DMA error or when
+ *         the stream is closed
+ **/
+bool DataFlashStream::Wait()
+{
+	while(m_head == m_tail)
+	{
+		/* The interrupt moves the head before clearing m_pending, so
+		 * the head is checked again once no transfer is seen */
+		if(!m_pending && m_head == m_tail)
+			return false;
+	}
+
+	return true;
+}
+
+void DataFlashStream::DMAHandler(void *context)
+{
+	((DataFlashStream*)context)->Filled();
+}
@@ -0,0 +1,167 @@
+/**
+ * @file at45db161d_stream.h
+ * @brief Sequential reader with DMA read-ahead for the AT45DB161D module
+ **/
+#ifndef _AT45DB161D_STREAM_H_
+#define _AT45DB161D_STREAM_H_
+
+#include <inttypes.h>
+
+#include "at45db161d.h"
+
+/**
+ * @defgroup AT45DB161D_stream AT45DB161D stream reader
+ * @{
+ **/
+
+/**
+ * Smallest jump forward for which Skip starts a new read at the
+ * target instead of clocking in the bytes in between, in addition to
+ * what the ring already holds. A new read costs 4 bytes and a CS
+ * toggle, but its DMA restarts from scratch.
+ **/
+#define DATAFLASH_STREAM_SEEK_DISTANCE	64
+
+/**
+ * @brief Sequential reader with DMA read-ahead
+ * Keeps a Continuous Array Read open and fills a ring of RAM ahead of
+ * the reader, half of the ring at a time, from the DMA interrupt.
+ * Read, Peek and Skip are served from the ring and only wait when the
+ * DMA has not caught up. When the reader falls behind, the DMA pauses
+ * with CS held low until half of the ring is free again, so no data
+ * is lost and the read never has to be restarted.
+ *
+ * The stream owns the bus while open: no other command may be sent to
+ * the device, and the DMA interrupt handler of the driver is taken
+ * over, until Close.
+ **/
+class DataFlashStream
+{
+	public:
+		/**
+		 * Constructor.
+		 * @param dataflash Device to read
+		 * @param ring RAM filled ahead of the reader, valid for the life of the stream
+		 * @param size Size of the ring, an even number of bytes. Each DMA
+		 *        transfer moves half of it.
+		 **/
+		DataFlashStream(AT45DB161D *dataflash, uint8_t *ring, size_t size);
+
+		/**
+		 * Start reading at a page and offset. The stream ends with the
+		 * last byte of the main memory.
+		 * @param page Page of the main memory where the read starts
+		 * @param offset Starting byte within the page
+		 * @return false if DMA is not available
+		 **/
+		bool Open(uint16_t page, uint16_t offset);
+
+		/**
+		 * Stop reading and release the bus. Waits for the DMA transfer
+		 * running, at most half of the ring.
+		 **/
+		void Close();
+
+		/**
+		 * Read the next bytes, waiting for the DMA if needed.
+		 * @param dst Destination, at least len bytes
+		 * @param len Number of bytes to read
+		 * @return Number of bytes read, less than len at the end of the
+		 *         memory or after a DMA error
+		 **/
+		size_t Read(uint8_t *dst, size_t len);
+
+		/**
+		 * Next byte, left in the stream.
+		 * @return The byte, or -1 at the end of the memory or after a DMA error
+		 **/
+		int16_t Peek();
+
+		/**
+		 * Pass over the next bytes. Long jumps restart the read at the
+		 * target rather than reading what is skipped.
+		 * @param len Number of bytes to skip
+		 * @return Number of bytes skipped, less than len at the end of the
+		 *         memory or after a DMA error
+		 **/
+		size_t Skip(size_t len);
+
+		/**
+		 * Number of bytes that can be read without waiting.
+		 **/
+		inline size_t Available()
+		{
+			return m_head - m_tail;
+		}
+
+		/**
+		 * Linear address of the next byte read.
+		 **/
+		inline uint32_t Position()
+		{
+			return m_start + m_tail;
+		}
+
+		/**
+		 * Whether a DMA transfer failed since Open.
+		 **/
+		inline bool Error()
+		{
+			return m_error;
+		}
+
+	private:
+		/**
+		 * Start filling the next half of the ring, if the reader is done with it.
+		 **/
+		void Fill();
+
+		/**
+		 * End of a DMA transfer.
+		 **/
+		void Filled();
+
+		/**
+		 * Drop bytes the reader is done with.
+		 **/
+		void Consume(size_t len);
+
+		/**
+		 * Wait until a byte is available.
+		 * @return false at the end of the memory or after a DMA error
+		 **/
+		bool Wait();
+
+		/**
+		 * Begin the read at a linear address, with the ring empty.
+		 **/
+		bool Start(uint32_t address);
+
+		/**
+		 * Let the transfer running end and end the read.
+		 **/
+		void Stop();
+
+		static void DMAHandler(void *context);
+
+	private:
+		AT45DB161D *m_dataflash;
+
+		uint8_t *m_ring;
+		size_t m_size;
+		size_t m_half;					/**< Bytes moved by one transfer **/
+
+		uint32_t m_start;				/**< Linear address of the first byte read **/
+		uint32_t m_end;					/**< Size of the main memory **/
+		volatile uint32_t m_head;		/**< Bytes received since Open **/
+		volatile uint32_t m_tail;		/**< Bytes consumed since Open **/
+		volatile size_t m_pending;		/**< Bytes of the transfer running, or 0 **/
+		volatile bool m_error;
+		volatile bool m_open;
+};
+
+/**
+ * @}
+ **/
+
+#endif /* _AT45DB161D_STREAM_H_ */
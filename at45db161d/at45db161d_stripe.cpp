@@ -0,0 +1,181 @@
+#include "at45db161d_stripe.h"
+
+/**
+ * Constructor. Releases the CS line of every chip, which begin() leaves
+ * asserted.
+ * @param chips Chips of the volume, valid for the life of the volume
+ * @param count Number of chips
+ **/
+DataFlashStripe::DataFlashStripe(AT45DB161D **chips, uint8_t count)
+{
+	if(count == 0)
+		ASSERT(0);
+
+	m_chips = chips;
+	m_count = count;
+	m_page = 0;
+	m_offset = 0;
+
+	for(uint8_t i = 0; i < m_count; i++)
+		m_chips[i]->Disable();
+}
+
+/**
+ * Size of a page, the same on every chip.
+ **/
+uint16_t DataFlashStripe::PageSize()
+{
+	uint16_t size = m_chips[0]->PageSize();
+
+	m_chips[0]->Disable();
+	return size;
+}
+
+/**
+ * Number of logical pages: the pages of the smallest chip, times the
+ * number of chips.
+ **/
+uint32_t DataFlashStripe::PageCount()
+{
+	uint16_t pages = 0xFFFF;
+
+	for(uint8_t i = 0; i < m_count; i++)
+	{
+		if(m_chips[i]->PageCount() < pages)
+			pages = m_chips[i]->PageCount();
+		m_chips[i]->Disable();
+	}
+
+	return (uint32_t)pages * m_count;
+}
+
+/**
+ * Start a sequential write of whole logical pages. Each chip gets a
+ * stream write of its own, from its first page in the span.
+ * @param page First logical page to write
+ * @param erase If set every page is erased before being programmed
+ * @note No other command may be issued to the chips until EndWrite.
+ **/
+void DataFlashStripe::BeginWrite(uint32_t page, uint8_t erase)
+{
+	for(uint8_t i = 0; i < m_count; i++)
+	{
+		uint32_t first = page + (i + m_count - page % m_count) % m_count;
+
+		m_chips[i]->BeginStreamWrite(first / m_count, erase);
+		m_chips[i]->Disable();
+	}
+
+	m_page = page;
+	m_offset = 0;
+}
+
+/**
+ * Append data to the write. Each page is programmed as soon as it is
+ * full, while the next one goes to the buffer of the next chip. A chip
+ * is only waited for when its turn comes back before the end of its
+ * previous program.
+ * @param src Source, at least len bytes
+ * @param len Number of bytes to write
+ **/
+void DataFlashStripe::Write(const uint8_t *src, size_t len)
+{
+	uint16_t pageSize = PageSize();
+
+	while(len)
+	{
+		AT45DB161D *chip = m_chips[m_page % m_count];
+		size_t count = pageSize - m_offset;
+
+		if(count > len)
+			count = len;
+
+		chip->StreamWrite(src, count);
+		chip->Disable();
+
+		m_offset += count;
+		src += count;
+		len -= count;
+
+		if(m_offset == pageSize)
+		{
+			m_page++;
+			m_offset = 0;
+		}
+	}
+}
+
+/**
+ * Program the last, partially filled page and wait for every chip to
+ * be ready. The rest of a partial page is filled with 0xFF.
+ * @return Number of the logical page following the last page written
+ **/
+uint32_t DataFlashStripe::EndWrite()
+{
+	for(uint8_t i = 0; i < m_count; i++)
+		m_chips[i]->EndStreamWrite();
+
+	if(m_offset)
+	{
+		m_page++;
+		m_offset = 0;
+	}
+
+	return m_page;
+}
+
+/**
+ * Read a span of logical pages, one Continuous Array Read per page.
+ * Waits for the operation running on each chip read, if any.
+ * @param page Logical page where the read starts
+ * @param offset Starting byte within the page
+ * @param dst Destination, at least len bytes
+ * @param len Number of bytes to read
+ **/
+void DataFlashStripe::Read(uint32_t page, uint16_t offset, uint8_t *dst, size_t len)
+{
+	uint16_t pageSize = PageSize();
+
+	while(len)
+	{
+		AT45DB161D *chip = m_chips[page % m_count];
+		size_t count = pageSize - offset;
+
+		if(count > len)
+			count = len;
+
+		chip->Read(page / m_count, offset, dst, count);
+
+		dst += count;
+		len -= count;
+		page++;
+		offset = 0;
+	}
+}
+
+/**
+ * Check every chip once for the end of its operation. A chip is only
+ * asked once the typical duration of its operation is over, see
+ * AT45DB161D::Poll.
+ * @return true while an operation runs on any chip
+ **/
+bool DataFlashStripe::Poll()
+{
+	bool busy = false;
+
+	for(uint8_t i = 0; i < m_count; i++)
+	{
+		if(m_chips[i]->Poll())
+			busy = true;
+	}
+
+	return busy;
+}
+
+/**
+ * Wait for the end of the operations running on the chips.
+ **/
+void DataFlashStripe::WaitForOperation()
+{
+	while(Poll());
+}
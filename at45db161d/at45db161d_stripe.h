@@ -0,0 +1,108 @@
+/**
+ * @file at45db161d_stripe.h
+ * @brief Volume striped across several AT45DB161D chips
+ **/
+#ifndef _AT45DB161D_STRIPE_H_
+#define _AT45DB161D_STRIPE_H_
+
+#include <inttypes.h>
+
+#include "at45db161d.h"
+
+/**
+ * @defgroup AT45DB161D_stripe AT45DB161D striped volume
+ * @{
+ **/
+
+/**
+ * @brief Volume striped across several chips
+ * Logical page n of the volume is page n / count of chip n % count,
+ * so consecutive pages go to the chips in turn. A sequential write
+ * loads the buffer of a chip while the others program, and each chip
+ * has a full turn to program its page before its next one, so the
+ * throughput grows with the number of chips until the SPI bus is busy
+ * all the time.
+ *
+ * The chips share the bus, one CS line each. CS of a chip is released
+ * after every command the volume sends it, as a chip left selected
+ * would take the traffic of the others: chips of the bus left out of
+ * the volume must be released as well. The chips must have the same
+ * page size.
+ **/
+class DataFlashStripe
+{
+	public:
+		/**
+		 * Constructor. Releases the CS line of every chip.
+		 * @param chips Chips of the volume, valid for the life of the volume
+		 * @param count Number of chips
+		 **/
+		DataFlashStripe(AT45DB161D **chips, uint8_t count);
+
+		/**
+		 * Size of a page, the same on every chip.
+		 **/
+		uint16_t PageSize();
+
+		/**
+		 * Number of logical pages: the pages of the smallest chip, times
+		 * the number of chips.
+		 **/
+		uint32_t PageCount();
+
+		/**
+		 * Start a sequential write of whole logical pages.
+		 * @param page First logical page to write
+		 * @param erase If set every page is erased before being programmed
+		 * @note No other command may be issued to the chips until EndWrite.
+		 **/
+		void BeginWrite(uint32_t page, uint8_t erase);
+
+		/**
+		 * Append data to the write. Each page is programmed as soon as
+		 * it is full, while the next one goes to the next chip.
+		 * @param src Source, at least len bytes
+		 * @param len Number of bytes to write
+		 **/
+		void Write(const uint8_t *src, size_t len);
+
+		/**
+		 * Program the last, partially filled page and wait for every
+		 * chip to be ready. The rest of a partial page is filled with 0xFF.
+		 * @return Number of the logical page following the last page written
+		 **/
+		uint32_t EndWrite();
+
+		/**
+		 * Read a span of logical pages.
+		 * @param page Logical page where the read starts
+		 * @param offset Starting byte within the page
+		 * @param dst Destination, at least len bytes
+		 * @param len Number of bytes to read
+		 **/
+		void Read(uint32_t page, uint16_t offset, uint8_t *dst, size_t len);
+
+		/**
+		 * Check every chip once for the end of its operation.
+		 * @return true while an operation runs on any chip
+		 **/
+		bool Poll();
+
+		/**
+		 * Wait for the end of the operations running on the chips.
+		 **/
+		void WaitForOperation();
+
+	private:
+		AT45DB161D **m_chips;
+		uint8_t m_count;
+
+		uint32_t m_page;				/**< Logical page being written **/
+		uint16_t m_offset;				/**< Bytes of it written so far **/
+};
+
+/**
+ * @}
+ **/
+
+#endif /* _AT45DB161D_STRIPE_H_ */
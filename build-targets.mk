@@ -1,6 +1,15 @@
 TARGET_MAIN = main-Benchmark
 
-OBJECTS = $(BUILD_PATH)/at45db161d/at45db161d.o
+OBJECTS = $(BUILD_PATH)/at45db161d/at45db161d.o \
+          $(BUILD_PATH)/at45db161d/at45db161d_cache.o \
+          $(BUILD_PATH)/at45db161d/at45db161d_log.o \
+          $(BUILD_PATH)/at45db161d/at45db161d_ftl.o \
+          $(BUILD_PATH)/at45db161d/at45db161d_refresh.o \
+          $(BUILD_PATH)/at45db161d/at45db161d_stream.o \
+          $(BUILD_PATH)/at45db161d/at45db161d_pool.o \
+          $(BUILD_PATH)/at45db161d/at45db161d_stripe.o \
+          $(BUILD_PATH)/at45db161d/at45db161d_bus.o \
+          $(BUILD_PATH)/at45db161d/at45db161d_queue.o
 
 BUILDDIRS += $(BUILD_PATH)/at45db161d
 			
@@ -12,6 +21,33 @@ $(BUILD_PATH)/$(TARGET_MAIN).o: $(TARGET_MAIN).cpp
 $(BUILD_PATH)/at45db161d/at45db161d.o: at45db161d/at45db161d.cpp
 	$(SILENT_CXX) $(CXX) $(CFLAGS) $(CXXFLAGS) $(LIBMAPLE_INCLUDES) $(WIRISH_INCLUDES) -I/ -o $@ -c $<
 
+$(BUILD_PATH)/at45db161d/at45db161d_cache.o: at45db161d/at45db161d_cache.cpp
+	$(SILENT_CXX) $(CXX) $(CFLAGS) $(CXXFLAGS) $(LIBMAPLE_INCLUDES) $(WIRISH_INCLUDES) -I/ -o $@ -c $<
+
+$(BUILD_PATH)/at45db161d/at45db161d_log.o: at45db161d/at45db161d_log.cpp
+	$(SILENT_CXX) $(CXX) $(CFLAGS) $(CXXFLAGS) $(LIBMAPLE_INCLUDES) $(WIRISH_INCLUDES) -I/ -o $@ -c $<
+
+$(BUILD_PATH)/at45db161d/at45db161d_ftl.o: at45db161d/at45db161d_ftl.cpp
+	$(SILENT_CXX) $(CXX) $(CFLAGS) $(CXXFLAGS) $(LIBMAPLE_INCLUDES) $(WIRISH_INCLUDES) -I/ -o $@ -c $<
+
+$(BUILD_PATH)/at45db161d/at45db161d_refresh.o: at45db161d/at45db161d_refresh.cpp
+	$(SILENT_CXX) $(CXX) $(CFLAGS) $(CXXFLAGS) $(LIBMAPLE_INCLUDES) $(WIRISH_INCLUDES) -I/ -o $@ -c $<
+
+$(BUILD_PATH)/at45db161d/at45db161d_stream.o: at45db161d/at45db161d_stream.cpp
+	$(SILENT_CXX) $(CXX) $(CFLAGS) $(CXXFLAGS) $(LIBMAPLE_INCLUDES) $(WIRISH_INCLUDES) -I/ -o $@ -c $<
+
+$(BUILD_PATH)/at45db161d/at45db161d_pool.o: at45db161d/at45db161d_pool.cpp
+	$(SILENT_CXX) $(CXX) $(CFLAGS) $(CXXFLAGS) $(LIBMAPLE_INCLUDES) $(WIRISH_INCLUDES) -I/ -o $@ -c $<
+
+$(BUILD_PATH)/at45db161d/at45db161d_stripe.o: at45db161d/at45db161d_stripe.cpp
+	$(SILENT_CXX) $(CXX) $(CFLAGS) $(CXXFLAGS) $(LIBMAPLE_INCLUDES) $(WIRISH_INCLUDES) -I/ -o $@ -c $<
+
+$(BUILD_PATH)/at45db161d/at45db161d_bus.o: at45db161d/at45db161d_bus.cpp
+	$(SILENT_CXX) $(CXX) $(CFLAGS) $(CXXFLAGS) $(LIBMAPLE_INCLUDES) $(WIRISH_INCLUDES) -I/ -o $@ -c $<
+
+$(BUILD_PATH)/at45db161d/at45db161d_queue.o: at45db161d/at45db161d_queue.cpp
+	$(SILENT_CXX) $(CXX) $(CFLAGS) $(CXXFLAGS) $(LIBMAPLE_INCLUDES) $(WIRISH_INCLUDES) -I/ -o $@ -c $<
+
 # Library			
 $(BUILD_PATH)/libmaple.a: $(BUILDDIRS) $(TGT_BIN)
 	- rm -f $@
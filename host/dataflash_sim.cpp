@@ -0,0 +1,445 @@
+/**
+ * @file dataflash_sim.cpp
+ * @brief Timing-accurate AT45DB161D model for the host simulation
+ **/
+#include <stdio.h>
+#include <string.h>
+
+#include "dataflash_sim.h"
+#include "at45db161d/at45db161d_commands.h"
+
+/** Manufacturer and device ID bytes **/
+static const uint8 dataflash_sim_id[] = { 0x1F, 0x26, 0x00, 0x00 };
+
+/** "Power of 2" page size configuration sequence **/
+static const uint8 dataflash_sim_binary_sequence[] = { 0x3D, 0x2A, 0x80, 0xA6 };
+
+/** Chip erase sequence **/
+static const uint8 dataflash_sim_chip_erase_sequence[] =
+{
+	AT45DB161D_CHIP_ERASE_0, AT45DB161D_CHIP_ERASE_1,
+	AT45DB161D_CHIP_ERASE_2, AT45DB161D_CHIP_ERASE_3
+};
+
+/** Warnings printed before the rest are suppressed **/
+#define DATAFLASH_SIM_MAX_WARNINGS 10
+
+DataFlashSim::DataFlashSim(spi_dev *spi, gpio_dev *cs_dev, uint8 cs_pin,
+                           gpio_dev *reset_dev, uint8 reset_pin, bool binaryPages)
+	: SimSpiDevice(spi, cs_dev, cs_pin)
+{
+	m_memory = new uint8[DATAFLASH_SIM_PAGES * DATAFLASH_SIM_PAGE_SIZE];
+	memset(m_memory, 0xFF, DATAFLASH_SIM_PAGES * DATAFLASH_SIM_PAGE_SIZE);
+	memset(m_buffers, 0xFF, sizeof(m_buffers));
+
+	m_count = 0;
+	m_ignored = false;
+	m_page = 0;
+	m_offset = 0;
+	m_busyUntil = 0;
+	m_busyBuffer = -1;
+	m_compareMismatch = false;
+	m_binaryPages = binaryPages;
+	m_binaryPending = binaryPages;
+	m_powerDown = false;
+	m_awakeAt = 0;
+	m_resetGPIO = reset_dev;
+	m_resetPin = reset_pin;
+	m_warnings = 0;
+}
+
+DataFlashSim::~DataFlashSim()
+{
+	delete[] m_memory;
+}
+
+bool DataFlashSim::ready() const
+{
+	return sim_now_ns() >= m_busyUntil;
+}
+
+uint8 DataFlashSim::status() const
+{
+	/* Density code 1011 = 16 Mbit */
+	uint8 status = 0x2C;
+
+	if(ready())
+		status |= 0x80;
+	if(m_compareMismatch)
+		status |= 0x40;
+	if(m_binaryPages)
+		status |= 0x01;
+
+	return status;
+}
+
+uint16 DataFlashSim::pageSize() const
+{
+	return m_binaryPages ? DATAFLASH_SIM_BINARY_PAGE_SIZE : DATAFLASH_SIM_PAGE_SIZE;
+}
+
+uint8 *DataFlashSim::page(uint16 n)
+{
+	return &m_memory[(uint32)n * DATAFLASH_SIM_PAGE_SIZE];
+}
+
+void DataFlashSim::warn(const char *message)
+{
+	if(m_warnings < DATAFLASH_SIM_MAX_WARNINGS)
+	{
+		fprintf(stderr, "[sim] DataFlash: %s (opcode 0x%02X, t=%llu us)\n",
+		        message, m_command[0], (unsigned long long)(sim_now_ns() / 1000));
+	}
+	else if(m_warnings == DATAFLASH_SIM_MAX_WARNINGS)
+	{
+		fprintf(stderr, "[sim] DataFlash: further warnings suppressed\n");
+	}
+
+	m_warnings++;
+}
+
+void DataFlashSim::select()
+{
+	m_count = 0;
+	m_ignored = false;
+}
+
+/**
+ * Decide whether the chip acts on a command, given its state.
+ **/
+bool DataFlashSim::accept(uint8 opcode)
+{
+	if(m_powerDown)
+	{
+		if(opcode == AT45DB161D_RESUME_FROM_DEEP_POWER_DOWN)
+			return true;
+
+		warn("command ignored in deep power-down");
+		return false;
+	}
+
+	if(sim_now_ns() < m_awakeAt)
+	{
+		warn("command ignored before tRDPD elapsed");
+		return false;
+	}
+
+	if(ready())
+		return true;
+
+	switch(opcode)
+	{
+		case AT45DB161D_STATUS_REGISTER_READ:
+		case AT45DB161D_STATUS_REGISTER_READ_LEGACY:
+			return true;
+
+		case AT45DB161D_BUFFER_1_READ_LOW_FREQ:
+		case AT45DB161D_BUFFER_1_READ:
+		case AT45DB161D_BUFFER_1_READ_LEGACY:
+		case AT45DB161D_BUFFER_1_WRITE:
+			if(m_busyBuffer != 0)
+				return true;
+			break;
+
+		case AT45DB161D_BUFFER_2_READ_LOW_FREQ:
+		case AT45DB161D_BUFFER_2_READ:
+		case AT45DB161D_BUFFER_2_READ_LEGACY:
+		case AT45DB161D_BUFFER_2_WRITE:
+			if(m_busyBuffer != 1)
+				return true;
+			break;
+	}
+
+	warn("command ignored while busy");
+	return false;
+}
+
+/**
+ * Latch page and byte address from command bytes 1-3.
+ **/
+void DataFlashSim::decodeAddress()
+{
+	uint32 address = ((uint32)m_command[1] << 16) | ((uint32)m_command[2] << 8) | m_command[3];
+
+	if(m_binaryPages)
+	{
+		m_page = (address >> 9) & (DATAFLASH_SIM_PAGES - 1);
+		m_offset = address & 0x1FF;
+	}
+	else
+	{
+		m_page = (address >> 10) & (DATAFLASH_SIM_PAGES - 1);
+		m_offset = address & 0x3FF;
+	}
+
+	if(m_offset >= pageSize())
+	{
+		warn("byte address beyond the page");
+		m_offset %= pageSize();
+	}
+}
+
+uint8 DataFlashSim::exchange(uint8 mosi)
+{
+	uint32 index = m_count++;
+
+	if(index < sizeof(m_command))
+		m_command[index] = mosi;
+
+	if(index == 0)
+		m_ignored = !accept(mosi);
+
+	if(m_ignored)
+		return 0xFF;
+
+	uint8 opcode = m_command[0];
+	uint32 dataStart;
+	int8 buffer = -1;
+	uint8 out;
+
+	switch(opcode)
+	{
+		case AT45DB161D_STATUS_REGISTER_READ:
+		case AT45DB161D_STATUS_REGISTER_READ_LEGACY:
+			return index ? status() : 0xFF;
+
+		case AT45DB161D_READ_MANUFACTURER_AND_DEVICE_ID:
+			if(index == 0)
+				return 0xFF;
+			return (index <= sizeof(dataflash_sim_id)) ? dataflash_sim_id[index - 1] : 0x00;
+
+		case AT45DB161D_PAGE_READ:
+		case AT45DB161D_PAGE_READ_LEGACY:
+			/* 3 address bytes, 4 don't care bytes; wraps within the page */
+			if(index == 3)
+				decodeAddress();
+			if(index < 8)
+				return 0xFF;
+
+			out = page(m_page)[m_offset];
+			m_offset = (m_offset + 1) % pageSize();
+			return out;
+
+		case AT45DB161D_CONTINUOUS_READ_LOW_FREQ:
+		case AT45DB161D_CONTINUOUS_READ_HIGH_FREQ:
+		case AT45DB161D_CONTINUOUS_READ_LEGACY:
+			/* Runs across pages and wraps at the end of the array */
+			dataStart = (opcode == AT45DB161D_CONTINUOUS_READ_LOW_FREQ) ? 4 :
+			            (opcode == AT45DB161D_CONTINUOUS_READ_HIGH_FREQ) ? 5 : 8;
+			if(index == 3)
+				decodeAddress();
+			if(index < dataStart)
+				return 0xFF;
+
+			out = page(m_page)[m_offset];
+			if(++m_offset == pageSize())
+			{
+				m_offset = 0;
+				m_page = (m_page + 1) % DATAFLASH_SIM_PAGES;
+			}
+			return out;
+
+		case AT45DB161D_BUFFER_1_READ_LOW_FREQ:
+		case AT45DB161D_BUFFER_2_READ_LOW_FREQ:
+		case AT45DB161D_BUFFER_1_READ:
+		case AT45DB161D_BUFFER_2_READ:
+		case AT45DB161D_BUFFER_1_READ_LEGACY:
+		case AT45DB161D_BUFFER_2_READ_LEGACY:
+			buffer = (opcode == AT45DB161D_BUFFER_1_READ_LOW_FREQ || opcode == AT45DB161D_BUFFER_1_READ ||
+			          opcode == AT45DB161D_BUFFER_1_READ_LEGACY) ? 0 : 1;
+			dataStart = (opcode == AT45DB161D_BUFFER_1_READ_LOW_FREQ || opcode == AT45DB161D_BUFFER_2_READ_LOW_FREQ) ? 4 : 5;
+			if(index == 3)
+				decodeAddress();
+			if(index < dataStart)
+				return 0xFF;
+
+			out = m_buffers[buffer][m_offset];
+			m_offset = (m_offset + 1) % pageSize();
+			return out;
+
+		case AT45DB161D_BUFFER_1_WRITE:
+		case AT45DB161D_BUFFER_2_WRITE:
+		case AT45DB161D_PAGE_THROUGH_BUFFER_1:
+		case AT45DB161D_PAGE_THROUGH_BUFFER_2:
+			buffer = (opcode == AT45DB161D_BUFFER_1_WRITE || opcode == AT45DB161D_PAGE_THROUGH_BUFFER_1) ? 0 : 1;
+			if(index == 3)
+				decodeAddress();
+			if(index >= 4)
+			{
+				m_buffers[buffer][m_offset] = mosi;
+				m_offset = (m_offset + 1) % pageSize();
+			}
+			return 0xFF;
+	}
+
+	return 0xFF;
+}
+
+void DataFlashSim::startBusy(uint32 us, int8 buffer)
+{
+	m_busyUntil = sim_now_ns() + (uint64)us * 1000ULL;
+	m_busyBuffer = buffer;
+}
+
+void DataFlashSim::erasePages(uint16 first, uint16 count)
+{
+	memset(page(first), 0xFF, (uint32)count * DATAFLASH_SIM_PAGE_SIZE);
+}
+
+/**
+ * Start the self-timed operation of the command just ended by CS
+ * going high.
+ **/
+void DataFlashSim::execute()
+{
+	if(m_ignored || m_count == 0)
+		return;
+
+	uint8 opcode = m_command[0];
+	int8 buffer;
+
+	switch(opcode)
+	{
+		case AT45DB161D_BUFFER_1_TO_PAGE_WITH_ERASE:
+		case AT45DB161D_BUFFER_2_TO_PAGE_WITH_ERASE:
+		case AT45DB161D_BUFFER_1_TO_PAGE_WITHOUT_ERASE:
+		case AT45DB161D_BUFFER_2_TO_PAGE_WITHOUT_ERASE:
+		case AT45DB161D_TRANSFER_PAGE_TO_BUFFER_1:
+		case AT45DB161D_TRANSFER_PAGE_TO_BUFFER_2:
+		case AT45DB161D_COMPARE_PAGE_TO_BUFFER_1:
+		case AT45DB161D_COMPARE_PAGE_TO_BUFFER_2:
+		case AT45DB161D_AUTO_PAGE_REWRITE_THROUGH_BUFFER_1:
+		case AT45DB161D_AUTO_PAGE_REWRITE_THROUGH_BUFFER_2:
+		case AT45DB161D_PAGE_ERASE:
+		case AT45DB161D_BLOCK_ERASE:
+		case AT45DB161D_SECTOR_ERASE:
+			if(m_count != 4)
+			{
+				warn("command aborted: CS raised before the end of the address");
+				return;
+			}
+			decodeAddress();
+			break;
+
+		case AT45DB161D_PAGE_THROUGH_BUFFER_1:
+		case AT45DB161D_PAGE_THROUGH_BUFFER_2:
+			if(m_count < 4)
+			{
+				warn("command aborted: CS raised before the end of the address");
+				return;
+			}
+			/* Page address was latched by exchange() */
+			break;
+	}
+
+	switch(opcode)
+	{
+		case AT45DB161D_BUFFER_1_TO_PAGE_WITH_ERASE:
+		case AT45DB161D_BUFFER_2_TO_PAGE_WITH_ERASE:
+			buffer = (opcode == AT45DB161D_BUFFER_1_TO_PAGE_WITH_ERASE) ? 0 : 1;
+			memcpy(page(m_page), m_buffers[buffer], pageSize());
+			startBusy(DATAFLASH_SIM_T_EP, buffer);
+			break;
+
+		case AT45DB161D_PAGE_THROUGH_BUFFER_1:
+		case AT45DB161D_PAGE_THROUGH_BUFFER_2:
+			buffer = (opcode == AT45DB161D_PAGE_THROUGH_BUFFER_1) ? 0 : 1;
+			memcpy(page(m_page), m_buffers[buffer], pageSize());
+			startBusy(DATAFLASH_SIM_T_EP, buffer);
+			break;
+
+		case AT45DB161D_BUFFER_1_TO_PAGE_WITHOUT_ERASE:
+		case AT45DB161D_BUFFER_2_TO_PAGE_WITHOUT_ERASE:
+			/* Programming can only clear bits */
+			buffer = (opcode == AT45DB161D_BUFFER_1_TO_PAGE_WITHOUT_ERASE) ? 0 : 1;
+			for(uint16 i = 0; i < pageSize(); i++)
+				page(m_page)[i] &= m_buffers[buffer][i];
+			startBusy(DATAFLASH_SIM_T_P, buffer);
+			break;
+
+		case AT45DB161D_TRANSFER_PAGE_TO_BUFFER_1:
+		case AT45DB161D_TRANSFER_PAGE_TO_BUFFER_2:
+			buffer = (opcode == AT45DB161D_TRANSFER_PAGE_TO_BUFFER_1) ? 0 : 1;
+			memcpy(m_buffers[buffer], page(m_page), pageSize());
+			startBusy(DATAFLASH_SIM_T_XFR, buffer);
+			break;
+
+		case AT45DB161D_COMPARE_PAGE_TO_BUFFER_1:
+		case AT45DB161D_COMPARE_PAGE_TO_BUFFER_2:
+			buffer = (opcode == AT45DB161D_COMPARE_PAGE_TO_BUFFER_1) ? 0 : 1;
+			m_compareMismatch = memcmp(m_buffers[buffer], page(m_page), pageSize()) != 0;
+			startBusy(DATAFLASH_SIM_T_XFR, buffer);
+			break;
+
+		case AT45DB161D_AUTO_PAGE_REWRITE_THROUGH_BUFFER_1:
+		case AT45DB161D_AUTO_PAGE_REWRITE_THROUGH_BUFFER_2:
+			buffer = (opcode == AT45DB161D_AUTO_PAGE_REWRITE_THROUGH_BUFFER_1) ? 0 : 1;
+			memcpy(m_buffers[buffer], page(m_page), pageSize());
+			startBusy(DATAFLASH_SIM_T_EP, buffer);
+			break;
+
+		case AT45DB161D_PAGE_ERASE:
+			erasePages(m_page, 1);
+			startBusy(DATAFLASH_SIM_T_PE, -1);
+			break;
+
+		case AT45DB161D_BLOCK_ERASE:
+			erasePages(m_page & ~(DATAFLASH_SIM_BLOCK_PAGES - 1), DATAFLASH_SIM_BLOCK_PAGES);
+			startBusy(DATAFLASH_SIM_T_BE, -1);
+			break;
+
+		case AT45DB161D_SECTOR_ERASE:
+			if(m_page >= DATAFLASH_SIM_SECTOR_PAGES)
+				erasePages(m_page & ~(DATAFLASH_SIM_SECTOR_PAGES - 1), DATAFLASH_SIM_SECTOR_PAGES);
+			else if(m_page < DATAFLASH_SIM_BLOCK_PAGES)
+				erasePages(0, DATAFLASH_SIM_BLOCK_PAGES);	/* Sector 0a */
+			else
+				erasePages(DATAFLASH_SIM_BLOCK_PAGES, DATAFLASH_SIM_SECTOR_PAGES - DATAFLASH_SIM_BLOCK_PAGES);	/* Sector 0b */
+			startBusy(DATAFLASH_SIM_T_SE, -1);
+			break;
+
+		case AT45DB161D_CHIP_ERASE_0:
+			if(m_count == 4 && !memcmp(m_command, dataflash_sim_chip_erase_sequence, 4))
+			{
+				erasePages(0, DATAFLASH_SIM_PAGES);
+				startBusy(DATAFLASH_SIM_T_CE, -1);
+			}
+			break;
+
+		case 0x3D:
+			if(m_count == 4 && !memcmp(m_command, dataflash_sim_binary_sequence, 4))
+			{
+				/* One-time configuration, effective after the next reset */
+				m_binaryPending = true;
+				startBusy(DATAFLASH_SIM_T_P, -1);
+			}
+			break;
+
+		case AT45DB161D_DEEP_POWER_DOWN:
+			m_powerDown = true;
+			break;
+
+		case AT45DB161D_RESUME_FROM_DEEP_POWER_DOWN:
+			m_powerDown = false;
+			m_awakeAt = sim_now_ns() + DATAFLASH_SIM_T_RDPD * 1000ULL;
+			break;
+	}
+}
+
+void DataFlashSim::deselect()
+{
+	execute();
+	m_count = 0;
+}
+
+void DataFlashSim::pinChanged(gpio_dev *dev, uint8 pin, uint8 val)
+{
+	if(dev != m_resetGPIO || pin != m_resetPin || val)
+		return;
+
+	/* RESET low aborts any operation in progress */
+	m_ignored = true;
+	m_busyUntil = 0;
+	m_busyBuffer = -1;
+	m_binaryPages = m_binaryPending;
+}
@@ -0,0 +1,125 @@
+/**
+ * @file dataflash_sim.h
+ * @brief Timing-accurate AT45DB161D model for the host simulation
+ **/
+#ifndef _DATAFLASH_SIM_H_
+#define _DATAFLASH_SIM_H_
+
+#include "sim.h"
+
+/**
+ * @defgroup DataFlashSim AT45DB161D model
+ * @{
+ **/
+
+/**
+ * @defgroup DATAFLASH_SIM_GEOMETRY Geometry
+ * @{
+ **/
+/** Number of main memory pages **/
+#define DATAFLASH_SIM_PAGES 4096
+/** Page and buffer size in standard DataFlash mode **/
+#define DATAFLASH_SIM_PAGE_SIZE 528
+/** Page and buffer size in "power of 2" binary mode **/
+#define DATAFLASH_SIM_BINARY_PAGE_SIZE 512
+/** Pages per block **/
+#define DATAFLASH_SIM_BLOCK_PAGES 8
+/** Pages per sector (sectors 0a and 0b together form sector 0) **/
+#define DATAFLASH_SIM_SECTOR_PAGES 256
+/**
+ * @}
+ **/
+
+/**
+ * @defgroup DATAFLASH_SIM_TIMING Timing
+ * Typical values from the AT45DB161D datasheet AC characteristics,
+ * in microseconds.
+ * @{
+ **/
+/** Page to buffer transfer/compare (tXFR) **/
+#define DATAFLASH_SIM_T_XFR 200
+/** Page erase and programming (tEP) **/
+#define DATAFLASH_SIM_T_EP 14000
+/** Page programming (tP) **/
+#define DATAFLASH_SIM_T_P 2000
+/** Page erase (tPE) **/
+#define DATAFLASH_SIM_T_PE 13000
+/** Block erase (tBE) **/
+#define DATAFLASH_SIM_T_BE 30000
+/** Sector erase (tSE) **/
+#define DATAFLASH_SIM_T_SE 1600000
+/** Chip erase (tCE) **/
+#define DATAFLASH_SIM_T_CE 12500000
+/** CS high to deep power-down (tEDPD) **/
+#define DATAFLASH_SIM_T_EDPD 1
+/** CS high to standby after resume (tRDPD) **/
+#define DATAFLASH_SIM_T_RDPD 35
+/**
+ * @}
+ **/
+
+/**
+ * @brief AT45DB161D on the simulated SPI bus
+ * Decodes the opcodes from at45db161d_commands.h, models both SRAM
+ * buffers, the status register and the self-timed program, erase and
+ * transfer operations. Commands that the chip would ignore (anything
+ * but status and the idle buffer while busy, anything but resume while
+ * powered down) are ignored and reported on stderr.
+ **/
+class DataFlashSim : public SimSpiDevice
+{
+	public:
+		DataFlashSim(spi_dev *spi, gpio_dev *cs_dev, uint8 cs_pin,
+		             gpio_dev *reset_dev, uint8 reset_pin, bool binaryPages);
+		virtual ~DataFlashSim();
+
+		virtual void select();
+		virtual void deselect();
+		virtual uint8 exchange(uint8 mosi);
+		virtual void pinChanged(gpio_dev *dev, uint8 pin, uint8 val);
+
+	private:
+		bool ready() const;
+		uint8 status() const;
+		uint16 pageSize() const;
+		uint8 *page(uint16 n);
+
+		bool accept(uint8 opcode);
+		void decodeAddress();
+		void execute();
+		void startBusy(uint32 us, int8 buffer);
+		void erasePages(uint16 first, uint16 count);
+		void warn(const char *message);
+
+	private:
+		uint8 *m_memory;					/**< Main memory, 528 bytes per page **/
+		uint8 m_buffers[2][DATAFLASH_SIM_PAGE_SIZE];
+
+		uint8 m_command[8];					/**< First bytes of the current command **/
+		uint32 m_count;						/**< Bytes clocked since CS went low **/
+		bool m_ignored;						/**< Current command is ignored **/
+
+		uint16 m_page;						/**< Page of the data phase **/
+		uint16 m_offset;					/**< Byte of the data phase **/
+
+		uint64 m_busyUntil;					/**< End of the self-timed operation, ns **/
+		int8 m_busyBuffer;					/**< Buffer in use by it, or -1 **/
+		bool m_compareMismatch;				/**< Status COMPARE bit **/
+
+		bool m_binaryPages;					/**< "Power of 2" page size active **/
+		bool m_binaryPending;				/**< ...after the next reset **/
+
+		bool m_powerDown;					/**< In deep power-down **/
+		uint64 m_awakeAt;					/**< End of tRDPD, ns **/
+
+		gpio_dev *m_resetGPIO;
+		uint8 m_resetPin;
+
+		uint32 m_warnings;
+};
+
+/**
+ * @}
+ **/
+
+#endif /* _DATAFLASH_SIM_H_ */
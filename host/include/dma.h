@@ -0,0 +1,109 @@
+/**
+ * @file dma.h
+ * @brief Host stand-in for libmaple's DMA interface
+ *
+ * Channels whose peripheral address is an SPI data register and which
+ * sit on that SPI's request lines (SPI1: DMA1 CH2/CH3, SPI2: DMA1
+ * CH4/CH5, SPI3: DMA2 CH1/CH2) are serviced by a background thread
+ * that clocks the bus on the simulated clock. Only 8-bit transfers are
+ * supported.
+ **/
+#ifndef _DMA_H_
+#define _DMA_H_
+
+#include "libmaple_types.h"
+
+typedef enum dma_channel
+{
+	DMA_CH1 = 1,
+	DMA_CH2 = 2,
+	DMA_CH3 = 3,
+	DMA_CH4 = 4,
+	DMA_CH5 = 5,
+	DMA_CH6 = 6,
+	DMA_CH7 = 7
+} dma_channel;
+
+typedef enum dma_xfer_size
+{
+	DMA_SIZE_8BITS  = 0,
+	DMA_SIZE_16BITS = 1,
+	DMA_SIZE_32BITS = 2
+} dma_xfer_size;
+
+typedef enum dma_mode_flags
+{
+	DMA_MEM_2_MEM  = 1 << 14,
+	DMA_MINC_MODE  = 1 << 7,
+	DMA_PINC_MODE  = 1 << 6,
+	DMA_CIRC_MODE  = 1 << 5,
+	DMA_FROM_MEM   = 1 << 4,
+	DMA_TRNS_ERR   = 1 << 3,
+	DMA_HALF_TRNS  = 1 << 2,
+	DMA_TRNS_CMPLT = 1 << 1
+} dma_mode_flags;
+
+typedef enum dma_priority
+{
+	DMA_PRIORITY_LOW,
+	DMA_PRIORITY_MEDIUM,
+	DMA_PRIORITY_HIGH,
+	DMA_PRIORITY_VERY_HIGH
+} dma_priority;
+
+typedef enum dma_irq_cause
+{
+	DMA_TRANSFER_COMPLETE,
+	DMA_TRANSFER_HALF_COMPLETE,
+	DMA_TRANSFER_ERROR
+} dma_irq_cause;
+
+/** Interrupt status bits **/
+#define DMA_ISR_GIF	(1U << 0)
+#define DMA_ISR_TCIF	(1U << 1)
+#define DMA_ISR_HTIF	(1U << 2)
+#define DMA_ISR_TEIF	(1U << 3)
+
+/**
+ * Simulated channel state.
+ **/
+typedef struct dma_channel_state
+{
+	__io void *par;		/**< Peripheral address **/
+	__io void *mar;		/**< Memory address **/
+	uint32 mode;		/**< dma_mode_flags **/
+	uint16 ndtr;		/**< Programmed number of transfers **/
+	uint16 cndtr;		/**< Remaining transfers **/
+	uint32 pos;			/**< Memory index of the next transfer **/
+	uint8 isr;			/**< DMA_ISR_* bits **/
+	bool enabled;
+	voidFuncPtr handler;
+} dma_channel_state;
+
+typedef struct dma_dev
+{
+	dma_channel_state channels[7];
+	const char *name;
+} dma_dev;
+
+extern dma_dev *DMA1;
+extern dma_dev *DMA2;
+
+void dma_init(dma_dev *dev);
+void dma_setup_transfer(dma_dev *dev, dma_channel channel,
+                        __io void *peripheral_address, dma_xfer_size peripheral_size,
+                        __io void *memory_address, dma_xfer_size memory_size,
+                        uint32 mode);
+void dma_set_num_transfers(dma_dev *dev, dma_channel channel, uint16 num_transfers);
+void dma_set_priority(dma_dev *dev, dma_channel channel, dma_priority priority);
+void dma_attach_interrupt(dma_dev *dev, dma_channel channel, void (*handler)(void));
+void dma_detach_interrupt(dma_dev *dev, dma_channel channel);
+dma_irq_cause dma_get_irq_cause(dma_dev *dev, dma_channel channel);
+void dma_enable(dma_dev *dev, dma_channel channel);
+void dma_disable(dma_dev *dev, dma_channel channel);
+void dma_set_mem_addr(dma_dev *dev, dma_channel channel, __io void *address);
+void dma_set_per_addr(dma_dev *dev, dma_channel channel, __io void *address);
+uint8 dma_get_isr_bits(dma_dev *dev, dma_channel channel);
+void dma_clear_isr_bits(dma_dev *dev, dma_channel channel);
+
+#endif /* _DMA_H_ */
@@ -0,0 +1,47 @@
+/**
+ * @file gpio.h
+ * @brief Host stand-in for libmaple's GPIO interface
+ *
+ * Pin writes are forwarded to the simulated SPI slaves so that chip
+ * select and reset edges reach the emulated devices.
+ **/
+#ifndef _GPIO_H_
+#define _GPIO_H_
+
+#include "libmaple_types.h"
+
+/**
+ * GPIO pin modes.
+ **/
+typedef enum gpio_pin_mode
+{
+	GPIO_OUTPUT_PP,
+	GPIO_OUTPUT_OD,
+	GPIO_AF_OUTPUT_PP,
+	GPIO_AF_OUTPUT_OD,
+	GPIO_INPUT_ANALOG,
+	GPIO_INPUT_FLOATING,
+	GPIO_INPUT_PD,
+	GPIO_INPUT_PU
+} gpio_pin_mode;
+
+/**
+ * GPIO port. Only the output data register is modelled.
+ **/
+typedef struct gpio_dev
+{
+	__io uint32 ODR;	/**< Output data register **/
+	const char *name;	/**< Port name, for diagnostics **/
+} gpio_dev;
+
+extern gpio_dev *GPIOA;
+extern gpio_dev *GPIOB;
+extern gpio_dev *GPIOC;
+extern gpio_dev *GPIOD;
+
+void gpio_set_mode(gpio_dev *dev, uint8 pin, gpio_pin_mode mode);
+void gpio_write_bit(gpio_dev *dev, uint8 pin, uint8 val);
+uint32 gpio_read_bit(gpio_dev *dev, uint8 pin);
+void gpio_toggle_bit(gpio_dev *dev, uint8 pin);
+
+#endif /* _GPIO_H_ */
@@ -0,0 +1,25 @@
+/**
+ * @file libmaple_types.h
+ * @brief Host stand-in for libmaple's fixed-width types
+ **/
+#ifndef _LIBMAPLE_TYPES_H_
+#define _LIBMAPLE_TYPES_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t  uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef uint64_t uint64;
+
+typedef int8_t  int8;
+typedef int16_t int16;
+typedef int32_t int32;
+typedef int64_t int64;
+
+typedef void (*voidFuncPtr)(void);
+
+#define __io volatile
+
+#endif /* _LIBMAPLE_TYPES_H_ */
@@ -0,0 +1,61 @@
+/**
+ * @file spi.h
+ * @brief Host stand-in for libmaple's SPI register interface
+ *
+ * Every byte written to the data register is clocked through the
+ * simulated slaves at once and costs one byte time on the simulated
+ * clock. The receive side mirrors the STM32: a byte received while
+ * RXNE is still set is lost and OVR is raised.
+ **/
+#ifndef _SPI_H_
+#define _SPI_H_
+
+#include "libmaple_types.h"
+
+/**
+ * SPI register map.
+ **/
+typedef struct spi_reg_map
+{
+	__io uint32 CR1;
+	__io uint32 CR2;
+	__io uint32 SR;
+	__io uint32 DR;
+} spi_reg_map;
+
+/** Status register bits **/
+#define SPI_SR_RXNE	(1U << 0)
+#define SPI_SR_TXE	(1U << 1)
+#define SPI_SR_OVR	(1U << 6)
+#define SPI_SR_BSY	(1U << 7)
+
+/** Control register 2 bits **/
+#define SPI_CR2_RXDMAEN	(1U << 0)
+#define SPI_CR2_TXDMAEN	(1U << 1)
+
+/**
+ * SPI device.
+ **/
+typedef struct spi_dev
+{
+	spi_reg_map *regs;	/**< Register map **/
+	uint32 clock_hz;	/**< Serial clock, set by HardwareSPI::begin() **/
+} spi_dev;
+
+extern spi_dev *SPI1;
+extern spi_dev *SPI2;
+extern spi_dev *SPI3;
+
+void spi_rx_dma_enable(spi_dev *dev);
+void spi_rx_dma_disable(spi_dev *dev);
+void spi_tx_dma_enable(spi_dev *dev);
+void spi_tx_dma_disable(spi_dev *dev);
+
+uint32 spi_tx(spi_dev *dev, const void *buf, uint32 len);
+void spi_tx_reg(spi_dev *dev, uint16 val);
+uint16 spi_rx_reg(spi_dev *dev);
+uint8 spi_is_rx_nonempty(spi_dev *dev);
+uint8 spi_is_tx_empty(spi_dev *dev);
+uint8 spi_is_busy(spi_dev *dev);
+
+#endif /* _SPI_H_ */
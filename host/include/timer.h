@@ -0,0 +1,21 @@
+/**
+ * @file timer.h
+ * @brief Host stand-in for libmaple's timer interface
+ **/
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include "libmaple_types.h"
+
+typedef struct timer_dev timer_dev;
+
+typedef enum timer_mode
+{
+	TIMER_DISABLED,
+	TIMER_PWM,
+	TIMER_OUTPUT_COMPARE
+} timer_mode;
+
+void timer_set_mode(timer_dev *dev, uint8 channel, timer_mode mode);
+
+#endif /* _TIMER_H_ */
@@ -0,0 +1,166 @@
+/**
+ * @file wirish.h
+ * @brief Host stand-in for the parts of wirish used by this library
+ *
+ * Time is simulated: micros() and millis() report the simulated clock,
+ * which only advances on SPI traffic, DMA transfers and delays.
+ **/
+#ifndef _WIRISH_H_
+#define _WIRISH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+#include "libmaple_types.h"
+#include "gpio.h"
+#include "timer.h"
+#include "spi.h"
+
+/**
+ * @defgroup Board Board definitions
+ * @{
+ **/
+#define BOARD_NR_GPIO_PINS 44
+
+typedef struct stm32_pin_info
+{
+	gpio_dev *gpio_device;		/**< GPIO port **/
+	timer_dev *timer_device;	/**< Timer, or NULL **/
+	uint8 gpio_bit;				/**< Bit within the port **/
+	uint8 timer_channel;		/**< Timer channel **/
+} stm32_pin_info;
+
+extern const stm32_pin_info PIN_MAP[BOARD_NR_GPIO_PINS];
+
+#define ASSERT(exp) assert(exp)
+/**
+ * @}
+ **/
+
+void init(void);
+
+uint32 millis(void);
+uint32 micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(uint32 us);
+
+/** Masking interrupts holds off the DMA thread, which runs the handlers **/
+void noInterrupts(void);
+void interrupts(void);
+
+/**
+ * @defgroup Print Print
+ * @{
+ **/
+#define BYTE 0
+#define BIN  2
+#define OCT  8
+#define DEC  10
+#define HEX  16
+
+class Print
+{
+	public:
+		virtual ~Print() {}
+		virtual void write(uint8 ch) = 0;
+		virtual void write(const char *str);
+		virtual void write(const void *buf, uint32 len);
+
+		void print(char c);
+		void print(const char str[]);
+		void print(uint8 b, int base = DEC);
+		void print(int n, int base = DEC);
+		void print(unsigned int n, int base = DEC);
+		void print(long n, int base = DEC);
+		void print(unsigned long n, int base = DEC);
+		void print(long long n, int base = DEC);
+		void print(unsigned long long n, int base = DEC);
+		void print(double n, int digits = 2);
+
+		void println(void);
+		void println(char c);
+		void println(const char str[]);
+		void println(uint8 b, int base = DEC);
+		void println(int n, int base = DEC);
+		void println(unsigned int n, int base = DEC);
+		void println(long n, int base = DEC);
+		void println(unsigned long n, int base = DEC);
+		void println(long long n, int base = DEC);
+		void println(unsigned long long n, int base = DEC);
+		void println(double n, int digits = 2);
+
+	private:
+		void printNumber(unsigned long long n, uint8 base);
+};
+
+/**
+ * Serial port. Output goes to stdout; the baud rate is not modelled.
+ **/
+class HardwareSerial : public Print
+{
+	public:
+		void begin(uint32 baud);
+		void end(void);
+		virtual void write(uint8 ch);
+		using Print::write;
+};
+
+extern HardwareSerial Serial1;
+extern HardwareSerial Serial2;
+extern HardwareSerial Serial3;
+extern HardwareSerial SerialUSB;
+/**
+ * @}
+ **/
+
+/**
+ * @defgroup HardwareSPI HardwareSPI
+ * @{
+ **/
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+typedef enum SPIFrequency
+{
+	SPI_18MHZ       = 0,
+	SPI_9MHZ        = 1,
+	SPI_4_5MHZ      = 2,
+	SPI_2_25MHZ     = 3,
+	SPI_1_125MHZ    = 4,
+	SPI_562_500KHZ  = 5,
+	SPI_281_250KHZ  = 6,
+	SPI_140_625KHZ  = 7
+} SPIFrequency;
+
+/**
+ * Master-mode SPI port. Each public call costs a fixed software
+ * overhead on the simulated clock on top of the wire time, so that the
+ * per-byte transfer() loops behave like they do on the Maple.
+ **/
+class HardwareSPI
+{
+	public:
+		HardwareSPI(uint32 spiPortNumber);
+
+		void begin(SPIFrequency frequency, uint32 bitOrder, uint32 mode);
+		void begin(void);
+		void end(void);
+
+		uint8 read(void);
+		void read(uint8 *buffer, uint32 length);
+		void write(uint8 data);
+		void write(const uint8 *buffer, uint32 length);
+		uint8 transfer(uint8 data);
+
+		spi_dev *c_dev(void) { return spi_d; }
+
+	private:
+		spi_dev *spi_d;
+};
+/**
+ * @}
+ **/
+
+#endif /* _WIRISH_H_ */
@@ -0,0 +1,480 @@
+/**
+ * @file libmaple.cpp
+ * @brief Host stand-in for libmaple's GPIO, board, timer, SPI and DMA layers
+ **/
+#include "wirish.h"
+#include "gpio.h"
+#include "timer.h"
+#include "spi.h"
+#include "dma.h"
+
+#include "sim.h"
+
+/*
+ * GPIO
+ */
+
+static gpio_dev gpioa = { 0xFFFF, "GPIOA" };
+static gpio_dev gpiob = { 0xFFFF, "GPIOB" };
+static gpio_dev gpioc = { 0xFFFF, "GPIOC" };
+static gpio_dev gpiod = { 0xFFFF, "GPIOD" };
+
+gpio_dev *GPIOA = &gpioa;
+gpio_dev *GPIOB = &gpiob;
+gpio_dev *GPIOC = &gpioc;
+gpio_dev *GPIOD = &gpiod;
+
+/*
+ * Board
+ */
+
+#define PINS16(port) \
+	{ port, NULL, 0, 0 },  { port, NULL, 1, 0 },  { port, NULL, 2, 0 },  { port, NULL, 3, 0 },  \
+	{ port, NULL, 4, 0 },  { port, NULL, 5, 0 },  { port, NULL, 6, 0 },  { port, NULL, 7, 0 },  \
+	{ port, NULL, 8, 0 },  { port, NULL, 9, 0 },  { port, NULL, 10, 0 }, { port, NULL, 11, 0 }, \
+	{ port, NULL, 12, 0 }, { port, NULL, 13, 0 }, { port, NULL, 14, 0 }, { port, NULL, 15, 0 }
+
+/**
+ * Pins run through ports A, B and C in bit order. Only the identity
+ * of each (port, bit) pair matters to the simulation.
+ **/
+const stm32_pin_info PIN_MAP[BOARD_NR_GPIO_PINS] =
+{
+	PINS16(&gpioa),
+	PINS16(&gpiob),
+	{ &gpioc, NULL, 0, 0 }, { &gpioc, NULL, 1, 0 }, { &gpioc, NULL, 2, 0 },  { &gpioc, NULL, 3, 0 },
+	{ &gpioc, NULL, 4, 0 }, { &gpioc, NULL, 5, 0 }, { &gpioc, NULL, 6, 0 },  { &gpioc, NULL, 7, 0 },
+	{ &gpioc, NULL, 8, 0 }, { &gpioc, NULL, 9, 0 }, { &gpioc, NULL, 10, 0 }, { &gpioc, NULL, 11, 0 }
+};
+
+void gpio_set_mode(gpio_dev *dev, uint8 pin, gpio_pin_mode mode)
+{
+	sim_touch();
+}
+
+void gpio_write_bit(gpio_dev *dev, uint8 pin, uint8 val)
+{
+	SimLock lock;
+	sim_touch();
+
+	uint32 mask = 1U << pin;
+	uint32 old = dev->ODR & mask;
+
+	if(val)
+		dev->ODR |= mask;
+	else
+		dev->ODR &= ~mask;
+
+	if(old != (dev->ODR & mask))
+		sim_gpio_changed(dev, pin, val ? 1 : 0);
+}
+
+uint32 gpio_read_bit(gpio_dev *dev, uint8 pin)
+{
+	sim_touch();
+	return dev->ODR & (1U << pin);
+}
+
+void gpio_toggle_bit(gpio_dev *dev, uint8 pin)
+{
+	gpio_write_bit(dev, pin, !gpio_read_bit(dev, pin));
+}
+
+/*
+ * Timers
+ */
+
+void timer_set_mode(timer_dev *dev, uint8 channel, timer_mode mode)
+{
+}
+
+/*
+ * SPI
+ */
+
+static spi_reg_map spi1_regs = { 0, 0, SPI_SR_TXE, 0 };
+static spi_reg_map spi2_regs = { 0, 0, SPI_SR_TXE, 0 };
+static spi_reg_map spi3_regs = { 0, 0, SPI_SR_TXE, 0 };
+
+static spi_dev spi1 = { &spi1_regs, 0 };
+static spi_dev spi2 = { &spi2_regs, 0 };
+static spi_dev spi3 = { &spi3_regs, 0 };
+
+spi_dev *SPI1 = &spi1;
+spi_dev *SPI2 = &spi2;
+spi_dev *SPI3 = &spi3;
+
+void spi_rx_dma_enable(spi_dev *dev)
+{
+	SimLock lock;
+	sim_touch();
+	dev->regs->CR2 |= SPI_CR2_RXDMAEN;
+}
+
+void spi_rx_dma_disable(spi_dev *dev)
+{
+	SimLock lock;
+	sim_touch();
+	dev->regs->CR2 &= ~SPI_CR2_RXDMAEN;
+}
+
+void spi_tx_dma_enable(spi_dev *dev)
+{
+	SimLock lock;
+	sim_touch();
+	dev->regs->CR2 |= SPI_CR2_TXDMAEN;
+}
+
+void spi_tx_dma_disable(spi_dev *dev)
+{
+	SimLock lock;
+	sim_touch();
+	dev->regs->CR2 &= ~SPI_CR2_TXDMAEN;
+}
+
+/**
+ * Latch a received byte the way the STM32 does: if the previous byte
+ * has not been read yet the new one is dropped and OVR is set.
+ **/
+static void spi_receive(spi_dev *dev, uint8 miso)
+{
+	if(dev->regs->SR & SPI_SR_RXNE)
+	{
+		dev->regs->SR |= SPI_SR_OVR;
+	}
+	else
+	{
+		dev->regs->DR = miso;
+		dev->regs->SR |= SPI_SR_RXNE;
+	}
+}
+
+void spi_tx_reg(spi_dev *dev, uint16 val)
+{
+	SimLock lock;
+	sim_touch();
+	sim_advance_ns(SIM_SPI_REGISTER_GAP_NS);
+	spi_receive(dev, sim_spi_exchange(dev, (uint8)val));
+}
+
+uint32 spi_tx(spi_dev *dev, const void *buf, uint32 len)
+{
+	SimLock lock;
+	sim_touch();
+
+	const uint8 *bytes = (const uint8*)buf;
+	for(uint32 i = 0; i < len; i++)
+		spi_receive(dev, sim_spi_exchange(dev, bytes[i]));
+
+	return len;
+}
+
+uint16 spi_rx_reg(spi_dev *dev)
+{
+	SimLock lock;
+	sim_touch();
+	dev->regs->SR &= ~(SPI_SR_RXNE | SPI_SR_OVR);
+	return (uint16)dev->regs->DR;
+}
+
+uint8 spi_is_rx_nonempty(spi_dev *dev)
+{
+	SimLock lock;
+	sim_touch();
+	return (dev->regs->SR & SPI_SR_RXNE) ? 1 : 0;
+}
+
+uint8 spi_is_tx_empty(spi_dev *dev)
+{
+	sim_touch();
+	return 1;
+}
+
+uint8 spi_is_busy(spi_dev *dev)
+{
+	sim_touch();
+	return 0;
+}
+
+/*
+ * DMA
+ */
+
+static dma_dev dma1 = { {}, "DMA1" };
+static dma_dev dma2 = { {}, "DMA2" };
+
+dma_dev *DMA1 = &dma1;
+dma_dev *DMA2 = &dma2;
+
+static dma_channel_state *dma_channel_get(dma_dev *dev, dma_channel channel)
+{
+	if(channel < DMA_CH1 || channel > DMA_CH7 || (dev == DMA2 && channel > DMA_CH5))
+		sim_fatal("bad DMA channel");
+
+	return &dev->channels[channel - 1];
+}
+
+void dma_init(dma_dev *dev)
+{
+	sim_touch();
+}
+
+void dma_setup_transfer(dma_dev *dev, dma_channel channel,
+                        __io void *peripheral_address, dma_xfer_size peripheral_size,
+                        __io void *memory_address, dma_xfer_size memory_size,
+                        uint32 mode)
+{
+	SimLock lock;
+	sim_touch();
+
+	if(peripheral_size != DMA_SIZE_8BITS || memory_size != DMA_SIZE_8BITS)
+		sim_fatal("only 8-bit DMA transfers are simulated");
+
+	dma_channel_state *ch = dma_channel_get(dev, channel);
+	ch->enabled = false;
+	ch->par = peripheral_address;
+	ch->mar = memory_address;
+	ch->mode = mode;
+	ch->pos = 0;
+	ch->isr = 0;
+}
+
+void dma_set_num_transfers(dma_dev *dev, dma_channel channel, uint16 num_transfers)
+{
+	SimLock lock;
+	sim_touch();
+
+	dma_channel_state *ch = dma_channel_get(dev, channel);
+	ch->ndtr = num_transfers;
+	ch->cndtr = num_transfers;
+	ch->pos = 0;
+}
+
+void dma_set_priority(dma_dev *dev, dma_channel channel, dma_priority priority)
+{
+	sim_touch();
+}
+
+void dma_attach_interrupt(dma_dev *dev, dma_channel channel, void (*handler)(void))
+{
+	SimLock lock;
+	sim_touch();
+	dma_channel_get(dev, channel)->handler = handler;
+}
+
+void dma_detach_interrupt(dma_dev *dev, dma_channel channel)
+{
+	SimLock lock;
+	sim_touch();
+	dma_channel_get(dev, channel)->handler = NULL;
+}
+
+dma_irq_cause dma_get_irq_cause(dma_dev *dev, dma_channel channel)
+{
+	SimLock lock;
+	dma_channel_state *ch = dma_channel_get(dev, channel);
+	uint8 isr = ch->isr;
+
+	ch->isr = 0;
+
+	if(isr & DMA_ISR_TEIF)
+		return DMA_TRANSFER_ERROR;
+	if(isr & DMA_ISR_HTIF)
+		return DMA_TRANSFER_HALF_COMPLETE;
+
+	return DMA_TRANSFER_COMPLETE;
+}
+
+void dma_enable(dma_dev *dev, dma_channel channel)
+{
+	SimLock lock;
+	sim_touch();
+
+	dma_channel_state *ch = dma_channel_get(dev, channel);
+	ch->enabled = true;
+	ch->pos = 0;
+}
+
+void dma_disable(dma_dev *dev, dma_channel channel)
+{
+	SimLock lock;
+	sim_touch();
+	dma_channel_get(dev, channel)->enabled = false;
+}
+
+void dma_set_mem_addr(dma_dev *dev, dma_channel channel, __io void *address)
+{
+	SimLock lock;
+	sim_touch();
+	dma_channel_get(dev, channel)->mar = address;
+}
+
+void dma_set_per_addr(dma_dev *dev, dma_channel channel, __io void *address)
+{
+	SimLock lock;
+	sim_touch();
+	dma_channel_get(dev, channel)->par = address;
+}
+
+uint8 dma_get_isr_bits(dma_dev *dev, dma_channel channel)
+{
+	SimLock lock;
+	sim_touch();
+	return dma_channel_get(dev, channel)->isr;
+}
+
+void dma_clear_isr_bits(dma_dev *dev, dma_channel channel)
+{
+	SimLock lock;
+	sim_touch();
+	dma_channel_get(dev, channel)->isr = 0;
+}
+
+/**
+ * SPI DMA request lines.
+ **/
+struct spi_dma_route
+{
+	spi_dev **spi;
+	dma_dev **dev;
+	dma_channel rx;
+	dma_channel tx;
+};
+
+static const spi_dma_route spi_dma_routes[] =
+{
+	{ &SPI1, &DMA1, DMA_CH2, DMA_CH3 },
+	{ &SPI2, &DMA1, DMA_CH4, DMA_CH5 },
+	{ &SPI3, &DMA2, DMA_CH1, DMA_CH2 },
+};
+
+/**
+ * Account for one transfer on a channel.
+ * @return true if the channel raised an interrupt
+ **/
+static bool dma_channel_step(dma_channel_state *ch)
+{
+	if(ch->mode & DMA_MINC_MODE)
+		ch->pos++;
+
+	ch->cndtr--;
+
+	if(ch->cndtr == ch->ndtr / 2)
+	{
+		ch->isr |= DMA_ISR_HTIF | DMA_ISR_GIF;
+		if(ch->mode & DMA_HALF_TRNS)
+			return true;
+	}
+
+	if(ch->cndtr == 0)
+	{
+		ch->isr |= DMA_ISR_TCIF | DMA_ISR_GIF;
+
+		if(ch->mode & DMA_CIRC_MODE)
+		{
+			ch->cndtr = ch->ndtr;
+			ch->pos = 0;
+		}
+
+		if(ch->mode & DMA_TRNS_CMPLT)
+			return true;
+	}
+
+	return false;
+}
+
+static bool dma_channel_fault(dma_channel_state *ch)
+{
+	if(ch->mar != NULL)
+		return false;
+
+	ch->isr |= DMA_ISR_TEIF | DMA_ISR_GIF;
+	ch->enabled = false;
+	return true;
+}
+
+static void dma_channel_irq(dma_channel_state *ch)
+{
+	if(ch->handler)
+		ch->handler();
+}
+
+/**
+ * Whether a TX channel is armed to clock an SPI bus.
+ **/
+bool sim_dma_active()
+{
+	for(uint8 r = 0; r < sizeof(spi_dma_routes) / sizeof(spi_dma_routes[0]); r++)
+	{
+		spi_dev *spi = *spi_dma_routes[r].spi;
+		dma_channel_state *tx = dma_channel_get(*spi_dma_routes[r].dev, spi_dma_routes[r].tx);
+
+		if(tx->enabled && tx->cndtr && (spi->regs->CR2 & SPI_CR2_TXDMAEN))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Run the SPI DMA channels until one of them raises an interrupt or
+ * runs dry. The TX channel paces the bus, as on the STM32: every
+ * byte it sends clocks a byte into the RX channel (or the data
+ * register, if RX DMA is off).
+ * @return true if any byte was transferred or interrupt raised
+ **/
+bool sim_dma_pump()
+{
+	bool serviced = false;
+
+	for(uint8 r = 0; r < sizeof(spi_dma_routes) / sizeof(spi_dma_routes[0]); r++)
+	{
+		spi_dev *spi = *spi_dma_routes[r].spi;
+		dma_channel_state *rx = dma_channel_get(*spi_dma_routes[r].dev, spi_dma_routes[r].rx);
+		dma_channel_state *tx = dma_channel_get(*spi_dma_routes[r].dev, spi_dma_routes[r].tx);
+
+		bool rxActive = rx->enabled && rx->cndtr && (spi->regs->CR2 & SPI_CR2_RXDMAEN) && rx->par == &spi->regs->DR;
+		bool txActive = tx->enabled && tx->cndtr && (spi->regs->CR2 & SPI_CR2_TXDMAEN) && tx->par == &spi->regs->DR
+		                && (tx->mode & DMA_FROM_MEM);
+
+		if(!txActive)
+			continue;
+
+		if(dma_channel_fault(tx) || (rxActive && dma_channel_fault(rx)))
+		{
+			serviced = true;
+			if(tx->mode & DMA_TRNS_ERR)
+				dma_channel_irq(tx);
+			if(rxActive && (rx->mode & DMA_TRNS_ERR))
+				dma_channel_irq(rx);
+			continue;
+		}
+
+		bool rxIrq = false, txIrq = false;
+		while(!rxIrq && !txIrq && tx->enabled && tx->cndtr)
+		{
+			uint8 mosi = ((__io uint8*)tx->mar)[tx->pos];
+			uint8 miso = sim_spi_exchange(spi, mosi);
+
+			if(rxActive && rx->enabled && rx->cndtr)
+			{
+				((__io uint8*)rx->mar)[rx->pos] = miso;
+				rxIrq = dma_channel_step(rx);
+			}
+			else
+			{
+				spi_receive(spi, miso);
+			}
+
+			txIrq = dma_channel_step(tx);
+			serviced = true;
+		}
+
+		if(txIrq)
+			dma_channel_irq(tx);
+		if(rxIrq)
+			dma_channel_irq(rx);
+	}
+
+	return serviced;
+}
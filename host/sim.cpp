@@ -0,0 +1,234 @@
+/**
+ * @file sim.cpp
+ * @brief Host simulation core
+ *
+ * Environment:
+ *   DATAFLASH_SIM_SECONDS   Simulated time budget (default 10)
+ *   DATAFLASH_SIM_CS        Comma separated CS pins of the DataFlash
+ *                           chips on SPI1 (default "5")
+ *   DATAFLASH_SIM_PAGE_SIZE 528 (default) or 512 for chips configured
+ *                           for "power of 2" pages
+ **/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "wirish.h"
+#include "sim.h"
+#include "dataflash_sim.h"
+
+/** Default RESET pin of the simulated chips **/
+#define SIM_DEFAULT_RESET_PIN 6
+
+/** Wall time the DMA thread gives the program to react to an interrupt **/
+#define SIM_IRQ_HANDOFF_US 2000
+/** Wall time without library calls after which the program is idle **/
+#define SIM_IDLE_TIMEOUT_MS 2000
+
+static std::recursive_mutex s_lock;
+static uint64 s_now_ns = 0;
+static uint64 s_budget_ns = 0;
+static SimSpiDevice *s_devices = NULL;
+static std::atomic<uint32> s_activity(0);
+static thread_local bool s_in_dma_thread = false;
+
+void sim_lock()
+{
+	s_lock.lock();
+}
+
+void sim_unlock()
+{
+	s_lock.unlock();
+}
+
+void sim_stop(const char *reason)
+{
+	fflush(stdout);
+	fprintf(stderr, "[sim] %s at t=%llu us\n", reason, (unsigned long long)(s_now_ns / 1000));
+	fflush(stderr);
+	_Exit(0);
+}
+
+void sim_fatal(const char *reason)
+{
+	fflush(stdout);
+	fprintf(stderr, "[sim] FATAL: %s at t=%llu us\n", reason, (unsigned long long)(s_now_ns / 1000));
+	fflush(stderr);
+	_Exit(2);
+}
+
+uint64 sim_now_ns()
+{
+	SimLock lock;
+	return s_now_ns;
+}
+
+void sim_advance_ns(uint64 ns)
+{
+	SimLock lock;
+
+	s_now_ns += ns;
+	if(s_budget_ns && s_now_ns >= s_budget_ns)
+		sim_stop("simulated time budget reached");
+}
+
+void sim_touch()
+{
+	if(!s_in_dma_thread)
+		s_activity++;
+}
+
+SimSpiDevice::SimSpiDevice(spi_dev *spi, gpio_dev *cs_dev, uint8 cs_pin)
+{
+	m_spi = spi;
+	m_chipSelectGPIO = cs_dev;
+	m_chipSelectPin = cs_pin;
+	m_selected = false;
+	m_next = NULL;
+}
+
+void sim_attach(SimSpiDevice *device)
+{
+	SimLock lock;
+
+	device->m_next = s_devices;
+	s_devices = device;
+}
+
+uint8 sim_spi_exchange(spi_dev *spi, uint8 mosi)
+{
+	SimLock lock;
+	uint8 miso = 0xFF;	/* Pulled up when nobody drives MISO */
+
+	for(SimSpiDevice *d = s_devices; d; d = d->m_next)
+	{
+		if(d->m_spi == spi && d->m_selected)
+			miso &= d->exchange(mosi);
+	}
+
+	sim_advance_ns(sim_spi_byte_ns(spi));
+	return miso;
+}
+
+uint32 sim_spi_byte_ns(spi_dev *spi)
+{
+	if(spi->clock_hz == 0)
+		sim_fatal("SPI used before HardwareSPI::begin()");
+
+	return (uint32)((8ULL * 1000000000ULL + spi->clock_hz - 1) / spi->clock_hz);
+}
+
+void sim_gpio_changed(gpio_dev *dev, uint8 pin, uint8 val)
+{
+	SimLock lock;
+
+	for(SimSpiDevice *d = s_devices; d; d = d->m_next)
+	{
+		if(d->m_chipSelectGPIO == dev && d->m_chipSelectPin == pin)
+		{
+			if(!val && !d->m_selected)
+			{
+				d->m_selected = true;
+				d->select();
+			}
+			else if(val && d->m_selected)
+			{
+				d->m_selected = false;
+				d->deselect();
+			}
+		}
+		else
+		{
+			d->pinChanged(dev, pin, val);
+		}
+	}
+}
+
+/**
+ * Background "DMA controller". Runs active channels up to their next
+ * interrupt. If they are still armed afterwards (circular mode), it
+ * waits for the program to react before going on, so that a busy-wait
+ * on a flag set by the handler sees it in time.
+ **/
+static void sim_dma_thread()
+{
+	using namespace std::chrono;
+
+	s_in_dma_thread = true;
+
+	uint32 last_activity = s_activity;
+	steady_clock::time_point last_change = steady_clock::now();
+
+	for(;;)
+	{
+		uint32 seen = s_activity;
+		bool serviced, active;
+
+		{
+			SimLock lock;
+			serviced = sim_dma_pump();
+			active = sim_dma_active();
+		}
+
+		if(serviced && active)
+		{
+			steady_clock::time_point start = steady_clock::now();
+			while(s_activity == seen && steady_clock::now() - start < microseconds(SIM_IRQ_HANDOFF_US))
+				std::this_thread::yield();
+
+			last_change = steady_clock::now();
+			continue;
+		}
+
+		std::this_thread::sleep_for(microseconds(50));
+
+		if(s_activity != last_activity)
+		{
+			last_activity = s_activity;
+			last_change = steady_clock::now();
+		}
+		else if(steady_clock::now() - last_change > milliseconds(SIM_IDLE_TIMEOUT_MS))
+		{
+			sim_stop("program idle");
+		}
+	}
+}
+
+void sim_init()
+{
+	static bool initialized = false;
+	if(initialized)
+		return;
+	initialized = true;
+
+	const char *env = getenv("DATAFLASH_SIM_SECONDS");
+	double seconds = env ? atof(env) : 10.0;
+	s_budget_ns = (uint64)(seconds * 1e9);
+
+	env = getenv("DATAFLASH_SIM_PAGE_SIZE");
+	bool binaryPages = env && atoi(env) == 512;
+
+	env = getenv("DATAFLASH_SIM_CS");
+	const char *pins = env ? env : "5";
+	while(*pins)
+	{
+		char *end;
+		long cs = strtol(pins, &end, 10);
+		if(end == pins || cs < 0 || cs >= BOARD_NR_GPIO_PINS)
+			sim_fatal("bad DATAFLASH_SIM_CS");
+
+		sim_attach(new DataFlashSim(SPI1, PIN_MAP[cs].gpio_device, PIN_MAP[cs].gpio_bit,
+		                            PIN_MAP[SIM_DEFAULT_RESET_PIN].gpio_device,
+		                            PIN_MAP[SIM_DEFAULT_RESET_PIN].gpio_bit,
+		                            binaryPages));
+
+		pins = (*end == ',') ? end + 1 : end;
+	}
+
+	std::thread(sim_dma_thread).detach();
+}
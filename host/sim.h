@@ -0,0 +1,121 @@
+/**
+ * @file sim.h
+ * @brief Host simulation core: simulated clock, bus lock and SPI slaves
+ **/
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include "libmaple_types.h"
+#include "gpio.h"
+#include "spi.h"
+
+/**
+ * @defgroup Sim Host simulation
+ * @{
+ **/
+
+/**
+ * Software cost of one HardwareSPI call on a 72 MHz Maple, on top of
+ * the wire time. Calibrated so that byte-by-byte transfer() loops at
+ * 18 MHz land near the ~280 KB/s measured on hardware (see README).
+ **/
+#define SIM_HARDWARESPI_CALL_NS 3100
+
+/**
+ * CPU time a polling loop spends between a byte completing and the
+ * next write to the data register, when driving the SPI registers
+ * directly. Back-to-back writes through spi_tx() have no such gap.
+ **/
+#define SIM_SPI_REGISTER_GAP_NS 140
+
+/**
+ * Read the configuration from the environment, attach the default
+ * DataFlash and start the DMA thread. Called by init().
+ **/
+void sim_init();
+
+/**
+ * Print a message and end the program successfully. Used when the
+ * simulated time budget runs out or the program goes idle.
+ **/
+void sim_stop(const char *reason);
+
+/**
+ * Print a message and abort. Used for bus usage that would hang or
+ * corrupt data on hardware.
+ **/
+void sim_fatal(const char *reason);
+
+/** Simulated time since start-up, in nanoseconds **/
+uint64 sim_now_ns();
+
+/** Advance the simulated clock **/
+void sim_advance_ns(uint64 ns);
+
+/**
+ * Record that the program made a library call. The DMA thread uses
+ * this to hand control back to the program after each interrupt.
+ **/
+void sim_touch();
+
+/**
+ * @brief Lock serializing the program and the DMA thread
+ * Recursive, so interrupt handlers may call back into the simulation.
+ **/
+void sim_lock();
+void sim_unlock();
+
+class SimLock
+{
+	public:
+		SimLock() { sim_lock(); }
+		~SimLock() { sim_unlock(); }
+};
+
+/**
+ * @brief SPI slave on the simulated bus, selected by a GPIO line
+ **/
+class SimSpiDevice
+{
+	public:
+		SimSpiDevice(spi_dev *spi, gpio_dev *cs_dev, uint8 cs_pin);
+		virtual ~SimSpiDevice() {}
+
+		/** CS went low **/
+		virtual void select() = 0;
+		/** CS went high **/
+		virtual void deselect() = 0;
+		/** Clock one byte; return the byte driven on MISO **/
+		virtual uint8 exchange(uint8 mosi) = 0;
+		/** Any other GPIO line changed (e.g. RESET) **/
+		virtual void pinChanged(gpio_dev *dev, uint8 pin, uint8 val) {}
+
+	public:
+		spi_dev *m_spi;
+		gpio_dev *m_chipSelectGPIO;
+		uint8 m_chipSelectPin;
+		bool m_selected;
+		SimSpiDevice *m_next;
+};
+
+/** Put a device on the bus. The device must outlive the program. **/
+void sim_attach(SimSpiDevice *device);
+
+/** Clock one byte on a bus, advancing the clock by one byte time **/
+uint8 sim_spi_exchange(spi_dev *spi, uint8 mosi);
+
+/** Wire time of one byte on a bus, in nanoseconds **/
+uint32 sim_spi_byte_ns(spi_dev *spi);
+
+/** Forward a GPIO edge to the devices on the bus **/
+void sim_gpio_changed(gpio_dev *dev, uint8 pin, uint8 val);
+
+/** Service DMA channels (implemented next to the DMA registers) **/
+bool sim_dma_pump();
+bool sim_dma_active();
+
+/**
+ * @}
+ **/
+
+#endif /* _SIM_H_ */
@@ -0,0 +1,268 @@
+/**
+ * @file trace-decode.cpp
+ * @brief Decoder for the command trace of the AT45DB161D module
+ *
+ * Reads the output of AT45DB161D::DumpTrace on stdin, from a serial
+ * capture or a host run, and prints the commands as a timeline, then
+ * the time spent per opcode and the gaps between commands, where the
+ * bus sat idle between two commands of the driver.
+ *
+ *   build/trace-decode < capture.txt
+ *
+ * Lines that are not part of the dump are ignored, so the whole output
+ * of the application can be fed in. Only the last dump is decoded.
+ **/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "at45db161d/at45db161d_commands.h"
+
+/** Number of largest gaps listed **/
+#define TRACE_LARGEST_GAPS 5
+
+struct trace_entry
+{
+	uint32_t start;
+	uint32_t end;
+	uint8_t opcode;
+	uint32_t address;
+	uint32_t length;
+};
+
+/** How the address of a command reads **/
+typedef enum trace_address
+{
+	TRACE_ADDRESS_NONE,
+	TRACE_ADDRESS_PAGE,		/* Page and offset */
+	TRACE_ADDRESS_BUFFER	/* Offset in a buffer */
+} trace_address;
+
+struct trace_opcode
+{
+	uint8_t opcode;
+	const char *name;
+	trace_address address;
+};
+
+static const struct trace_opcode opcodes[] =
+{
+	{ AT45DB161D_STATUS_REGISTER_READ, "status", TRACE_ADDRESS_NONE },
+	{ AT45DB161D_READ_MANUFACTURER_AND_DEVICE_ID, "id", TRACE_ADDRESS_NONE },
+	{ AT45DB161D_PAGE_READ, "page_read", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_CONTINUOUS_READ_LOW_FREQ, "array_read", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_CONTINUOUS_READ_HIGH_FREQ, "array_read_hf", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_BUFFER_1_READ_LOW_FREQ, "buf1_read", TRACE_ADDRESS_BUFFER },
+	{ AT45DB161D_BUFFER_2_READ_LOW_FREQ, "buf2_read", TRACE_ADDRESS_BUFFER },
+	{ AT45DB161D_BUFFER_1_READ, "buf1_read_hf", TRACE_ADDRESS_BUFFER },
+	{ AT45DB161D_BUFFER_2_READ, "buf2_read_hf", TRACE_ADDRESS_BUFFER },
+	{ AT45DB161D_BUFFER_1_WRITE, "buf1_write", TRACE_ADDRESS_BUFFER },
+	{ AT45DB161D_BUFFER_2_WRITE, "buf2_write", TRACE_ADDRESS_BUFFER },
+	{ AT45DB161D_BUFFER_1_TO_PAGE_WITH_ERASE, "buf1_to_page_erase", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_BUFFER_2_TO_PAGE_WITH_ERASE, "buf2_to_page_erase", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_BUFFER_1_TO_PAGE_WITHOUT_ERASE, "buf1_to_page", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_BUFFER_2_TO_PAGE_WITHOUT_ERASE, "buf2_to_page", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_TRANSFER_PAGE_TO_BUFFER_1, "page_to_buf1", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_TRANSFER_PAGE_TO_BUFFER_2, "page_to_buf2", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_COMPARE_PAGE_TO_BUFFER_1, "compare_buf1", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_COMPARE_PAGE_TO_BUFFER_2, "compare_buf2", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_AUTO_PAGE_REWRITE_THROUGH_BUFFER_1, "rewrite_buf1", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_AUTO_PAGE_REWRITE_THROUGH_BUFFER_2, "rewrite_buf2", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_PAGE_THROUGH_BUFFER_1, "program_buf1", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_PAGE_THROUGH_BUFFER_2, "program_buf2", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_PAGE_ERASE, "page_erase", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_BLOCK_ERASE, "block_erase", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_SECTOR_ERASE, "sector_erase", TRACE_ADDRESS_PAGE },
+	{ AT45DB161D_CHIP_ERASE_0, "chip_erase", TRACE_ADDRESS_NONE },
+	{ AT45DB161D_DEEP_POWER_DOWN, "deep_power_down", TRACE_ADDRESS_NONE },
+	{ AT45DB161D_RESUME_FROM_DEEP_POWER_DOWN, "resume", TRACE_ADDRESS_NONE }
+};
+
+#define OPCODE_COUNT (sizeof(opcodes) / sizeof(opcodes[0]))
+
+/** Time per opcode **/
+struct opcode_stats
+{
+	uint32_t count;
+	uint64_t total;
+	uint32_t max;
+};
+
+static const struct trace_opcode *find_opcode(uint8_t opcode)
+{
+	for(size_t i = 0; i < OPCODE_COUNT; i++)
+	{
+		if(opcodes[i].opcode == opcode)
+			return &opcodes[i];
+	}
+
+	return NULL;
+}
+
+/** Nearest rank percentile of sorted values **/
+static uint32_t percentile(const std::vector<uint32_t> &sorted, unsigned p)
+{
+	size_t rank = (sorted.size() * p + 99) / 100;
+
+	return sorted[rank ? rank - 1 : 0];
+}
+
+static void print_address(const struct trace_entry &entry, unsigned offsetBits)
+{
+	const struct trace_opcode *op = find_opcode(entry.opcode);
+	trace_address kind = op ? op->address : TRACE_ADDRESS_PAGE;
+	char text[32] = "";
+
+	switch(kind)
+	{
+		case TRACE_ADDRESS_PAGE:
+			snprintf(text, sizeof(text), "page %u offset %u", (unsigned)(entry.address >> offsetBits),
+			         (unsigned)(entry.address & ((1u << offsetBits) - 1)));
+			break;
+
+		case TRACE_ADDRESS_BUFFER:
+			snprintf(text, sizeof(text), "offset %u", (unsigned)entry.address);
+			break;
+
+		default:
+			break;
+	}
+
+	printf(" %-24s", text);
+}
+
+int main()
+{
+	std::vector<struct trace_entry> entries;
+	unsigned pageSize = 528, offsetBits = 10;
+	char line[256];
+
+	while(fgets(line, sizeof(line), stdin))
+	{
+		struct trace_entry entry;
+		unsigned opcode, count;
+		unsigned long start, end, address, length;
+
+		/* A new dump starts over */
+		if(sscanf(line, "# dataflash trace entries %u page_size %u offset_bits %u",
+		          &count, &pageSize, &offsetBits) == 3)
+		{
+			entries.clear();
+			continue;
+		}
+
+		if(sscanf(line, "T %lu %lu %x %lx %lu", &start, &end, &opcode, &address, &length) != 5)
+			continue;
+
+		entry.start = start;
+		entry.end = end;
+		entry.opcode = opcode;
+		entry.address = address;
+		entry.length = length;
+		entries.push_back(entry);
+	}
+
+	if(entries.empty())
+	{
+		fprintf(stderr, "trace-decode: no trace found on stdin\n");
+		return 1;
+	}
+
+	/*
+	 * Timeline. The gap runs from the release of CS by a command to the
+	 * opcode of the next one; times are relative to the first command.
+	 */
+
+	struct opcode_stats stats[OPCODE_COUNT + 1];
+	std::vector<uint32_t> gaps;
+	std::vector<std::pair<uint32_t, size_t> > largest;
+
+	memset(stats, 0, sizeof(stats));
+
+	printf("%10s %8s %8s  %-20s %-24s %6s\n", "time_us", "dur_us", "gap_us", "command", "address", "bytes");
+
+	for(size_t i = 0; i < entries.size(); i++)
+	{
+		const struct trace_entry &entry = entries[i];
+		const struct trace_opcode *op = find_opcode(entry.opcode);
+		struct opcode_stats &s = stats[op ? op - opcodes : OPCODE_COUNT];
+		uint32_t duration = entry.end ? entry.end - entry.start : 0;
+
+		printf("%10u ", (unsigned)(entry.start - entries[0].start));
+
+		if(entry.end)
+			printf("%8u ", (unsigned)duration);
+		else
+			printf("%8s ", "-");
+
+		if(i && entries[i - 1].end)
+		{
+			uint32_t gap = entry.start - entries[i - 1].end;
+
+			printf("%8u  ", (unsigned)gap);
+			gaps.push_back(gap);
+			largest.push_back(std::make_pair(gap, i));
+		}
+		else
+			printf("%8s  ", "-");
+
+		if(op)
+			printf("%-20s", op->name);
+		else
+			printf("0x%02X%-16s", entry.opcode, "");
+
+		print_address(entry, offsetBits);
+		printf(" %6u\n", (unsigned)entry.length);
+
+		s.count++;
+		s.total += duration;
+		if(duration > s.max)
+			s.max = duration;
+	}
+
+	/*
+	 * Summary
+	 */
+
+	printf("\n%-20s %8s %10s %8s %8s\n", "command", "count", "total_us", "avg_us", "max_us");
+
+	for(size_t i = 0; i <= OPCODE_COUNT; i++)
+	{
+		if(!stats[i].count)
+			continue;
+
+		printf("%-20s %8u %10llu %8llu %8u\n", (i < OPCODE_COUNT) ? opcodes[i].name : "other",
+		       (unsigned)stats[i].count, (unsigned long long)stats[i].total,
+		       (unsigned long long)(stats[i].total / stats[i].count), (unsigned)stats[i].max);
+	}
+
+	if(gaps.empty())
+		return 0;
+
+	std::sort(gaps.begin(), gaps.end());
+	std::sort(largest.begin(), largest.end());
+	std::reverse(largest.begin(), largest.end());
+
+	printf("\ngaps: %u, min %u us, p50 %u us, p99 %u us, max %u us\n", (unsigned)gaps.size(),
+	       (unsigned)gaps.front(), (unsigned)percentile(gaps, 50), (unsigned)percentile(gaps, 99),
+	       (unsigned)gaps.back());
+
+	printf("largest gaps:\n");
+	for(size_t i = 0; i < largest.size() && i < TRACE_LARGEST_GAPS; i++)
+	{
+		const struct trace_entry &before = entries[largest[i].second - 1];
+		const struct trace_entry &after = entries[largest[i].second];
+		const struct trace_opcode *opBefore = find_opcode(before.opcode);
+		const struct trace_opcode *opAfter = find_opcode(after.opcode);
+
+		printf("%10u us at %10u, after %s, before %s\n", (unsigned)largest[i].first,
+		       (unsigned)(after.start - entries[0].start),
+		       opBefore ? opBefore->name : "other", opAfter ? opAfter->name : "other");
+	}
+
+	return 0;
+}
@@ -0,0 +1,249 @@
+/**
+ * @file wirish.cpp
+ * @brief Host stand-in for wirish: time, serial and HardwareSPI
+ **/
+#include <stdio.h>
+
+#include "wirish.h"
+#include "sim.h"
+
+void init(void)
+{
+	sim_init();
+}
+
+/*
+ * Time
+ */
+
+uint32 millis(void)
+{
+	sim_touch();
+	return (uint32)(sim_now_ns() / 1000000ULL);
+}
+
+uint32 micros(void)
+{
+	sim_touch();
+	return (uint32)(sim_now_ns() / 1000ULL);
+}
+
+void delay(unsigned long ms)
+{
+	sim_touch();
+	sim_advance_ns((uint64)ms * 1000000ULL);
+}
+
+void delayMicroseconds(uint32 us)
+{
+	sim_touch();
+	sim_advance_ns((uint64)us * 1000ULL);
+}
+
+void noInterrupts(void)
+{
+	sim_lock();
+}
+
+void interrupts(void)
+{
+	sim_unlock();
+}
+
+/*
+ * Print
+ */
+
+void Print::write(const char *str)
+{
+	while(*str)
+		write((uint8)*str++);
+}
+
+void Print::write(const void *buf, uint32 len)
+{
+	const uint8 *bytes = (const uint8*)buf;
+
+	while(len--)
+		write(*bytes++);
+}
+
+void Print::print(char c)                             { write((uint8)c); }
+void Print::print(const char str[])                   { write(str); }
+void Print::print(uint8 b, int base)                  { if(base == BYTE) write(b); else printNumber(b, base); }
+void Print::print(int n, int base)                    { print((long long)n, base); }
+void Print::print(unsigned int n, int base)           { printNumber(n, base); }
+void Print::print(long n, int base)                   { print((long long)n, base); }
+void Print::print(unsigned long n, int base)          { printNumber(n, base); }
+void Print::print(unsigned long long n, int base)     { printNumber(n, base); }
+
+void Print::print(long long n, int base)
+{
+	if(base == BYTE)
+	{
+		write((uint8)n);
+	}
+	else if(n < 0 && base == DEC)
+	{
+		write((uint8)'-');
+		printNumber((unsigned long long)-n, base);
+	}
+	else
+	{
+		printNumber((unsigned long long)n, base);
+	}
+}
+
+void Print::print(double n, int digits)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%.*f", digits, n);
+	write(buf);
+}
+
+void Print::println(void)                               { write("\r\n"); }
+void Print::println(char c)                             { print(c); println(); }
+void Print::println(const char str[])                   { print(str); println(); }
+void Print::println(uint8 b, int base)                  { print(b, base); println(); }
+void Print::println(int n, int base)                    { print(n, base); println(); }
+void Print::println(unsigned int n, int base)           { print(n, base); println(); }
+void Print::println(long n, int base)                   { print(n, base); println(); }
+void Print::println(unsigned long n, int base)          { print(n, base); println(); }
+void Print::println(long long n, int base)              { print(n, base); println(); }
+void Print::println(unsigned long long n, int base)     { print(n, base); println(); }
+void Print::println(double n, int digits)               { print(n, digits); println(); }
+
+void Print::printNumber(unsigned long long n, uint8 base)
+{
+	char buf[8 * sizeof(n) + 1];
+	uint8 i = 0;
+
+	if(base < 2)
+		base = DEC;
+
+	do
+	{
+		uint8 digit = (uint8)(n % base);
+		buf[i++] = (char)(digit < 10 ? '0' + digit : 'A' + digit - 10);
+		n /= base;
+	} while(n);
+
+	while(i)
+		write((uint8)buf[--i]);
+}
+
+/*
+ * Serial
+ */
+
+void HardwareSerial::begin(uint32 baud)
+{
+}
+
+void HardwareSerial::end(void)
+{
+}
+
+void HardwareSerial::write(uint8 ch)
+{
+	if(ch != '\r')
+		putchar(ch);
+}
+
+HardwareSerial Serial1;
+HardwareSerial Serial2;
+HardwareSerial Serial3;
+HardwareSerial SerialUSB;
+
+/*
+ * HardwareSPI
+ */
+
+static const uint32 spi_frequencies[] =
+{
+	18000000, 9000000, 4500000, 2250000, 1125000, 562500, 281250, 140625
+};
+
+HardwareSPI::HardwareSPI(uint32 spiPortNumber)
+{
+	switch(spiPortNumber)
+	{
+		case 1: spi_d = SPI1; break;
+		case 2: spi_d = SPI2; break;
+		case 3: spi_d = SPI3; break;
+		default: sim_fatal("bad SPI port number"); break;
+	}
+}
+
+void HardwareSPI::begin(SPIFrequency frequency, uint32 bitOrder, uint32 mode)
+{
+	SimLock lock;
+	sim_touch();
+
+	if(frequency > SPI_140_625KHZ || bitOrder != MSBFIRST || mode != 0)
+		sim_fatal("DataFlash simulation needs MSB first, SPI mode 0");
+
+	spi_d->clock_hz = spi_frequencies[frequency];
+}
+
+void HardwareSPI::begin(void)
+{
+	begin(SPI_1_125MHZ, MSBFIRST, 0);
+}
+
+void HardwareSPI::end(void)
+{
+	sim_touch();
+}
+
+uint8 HardwareSPI::read(void)
+{
+	uint8 byte;
+	read(&byte, 1);
+	return byte;
+}
+
+/**
+ * As on libmaple, this only collects bytes that have already been
+ * clocked in; in master mode nothing clocks the bus while it waits.
+ **/
+void HardwareSPI::read(uint8 *buffer, uint32 length)
+{
+	SimLock lock;
+	sim_advance_ns(SIM_HARDWARESPI_CALL_NS);
+
+	for(uint32 i = 0; i < length; i++)
+	{
+		if(!spi_is_rx_nonempty(spi_d))
+			sim_fatal("HardwareSPI::read() waits forever: nothing clocks the bus in master mode");
+
+		buffer[i] = (uint8)spi_rx_reg(spi_d);
+	}
+}
+
+void HardwareSPI::write(uint8 data)
+{
+	write(&data, 1);
+}
+
+void HardwareSPI::write(const uint8 *buffer, uint32 length)
+{
+	SimLock lock;
+	sim_advance_ns(SIM_HARDWARESPI_CALL_NS);
+
+	uint32 txed = 0;
+	while(txed < length)
+		txed += spi_tx(spi_d, buffer + txed, length - txed);
+}
+
+uint8 HardwareSPI::transfer(uint8 data)
+{
+	SimLock lock;
+	sim_advance_ns(SIM_HARDWARESPI_CALL_NS);
+
+	spi_tx(spi_d, &data, 1);
+	while(!spi_is_rx_nonempty(spi_d))
+		;
+
+	return (uint8)spi_rx_reg(spi_d);
+}
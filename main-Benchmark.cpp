@@ -3,7 +3,6 @@
 #include <stdint.h>
 
 #include "wirish.h"
-#include "dma.h"
 
 #include "at45db161d/at45db161d.h"
 
@@ -14,27 +13,6 @@ __attribute__((constructor)) void premain()
 	init();
 }
 
-volatile bool spi_rx_dma_done;
-volatile uint16_t pages_to_write;
-
-void spi_rx_dma_irq(void)
-{
-	static uint8_t pages_done = 0;
-	pages_done++;
-	
-	/*
-	 * Realistically, DMA would not be set for continious reads
-	 * and we'd only read one page at a time then process those 528 bytes.
-	 * We'd then manually enable DMA for another 528 bytes and repeat.
-	 * Once we have enough bytes, we'd disable DMA and trigger our "flag."
-	 * But this is just a simple test to see maximum possible read speeds.
-	 *
-	 */
-	
-	if(pages_done == pages_to_write)
-		spi_rx_dma_done = true;	
-}
-
 int main()
 {
 	HardwareSPI SPI(1);
@@ -98,14 +76,17 @@ int main()
 	uint32_t read_buffer_time, read_buffer_start, read_buffer_end, read_buffer_errors;
 	uint32_t read_page_time, read_page_start, read_page_end, read_page_errors;
 	uint32_t read_array_time, read_array_start, read_array_end, read_array_errors;
-	uint32_t read_array_dma_time, read_array_dma_start, read_array_dma_end;
+	uint32_t read_array_dma_time, read_array_dma_start, read_array_dma_end, read_array_dma_errors;
 	uint32_t bytes_transfered;
 	uint8_t data, k;
+	uint8_t page_buffer[BYTES_PER_PAGE];
+	static uint8_t dma_buffer[PAGES_TO_TEST * BYTES_PER_PAGE];
 
 	bytes_transfered = 0;
 	read_buffer_errors = 0;
 	read_page_errors = 0;
 	read_array_errors = 0;
+	read_array_dma_errors = 0;
 
 	/*
 	 * Write via Buffer
@@ -114,17 +95,18 @@ int main()
 	Serial2.println("    Performing Write via Buffer Test.");
 	k = 0;
 	write_start = micros();
+	dataflash.BeginStreamWrite(START_PAGE, true);
 	for(uint16_t page = START_PAGE; page < (PAGES_TO_TEST + START_PAGE); page++)
 	{
-		dataflash.BufferWrite(BUFFER_TO_USE, 0);
 		for(uint16_t i = 0; i < BYTES_PER_PAGE; i++)
 		{
-			bytes_transfered++;
-			SPI.transfer(k);
+			page_buffer[i] = k;
 			k++;
 		}
-		dataflash.BufferToPage(BUFFER_TO_USE, page, true);
+		dataflash.StreamWrite(page_buffer, BYTES_PER_PAGE);
+		bytes_transfered += BYTES_PER_PAGE;
 	}
+	dataflash.EndStreamWrite();
 	write_end = micros();
 	dataflash.Disable();
 
@@ -138,11 +120,10 @@ int main()
 	for(uint16_t page = START_PAGE; page < (PAGES_TO_TEST + START_PAGE); page++)
 	{
 		dataflash.PageToBuffer(page, BUFFER_TO_USE);
-		dataflash.BufferRead(BUFFER_TO_USE, 0);
+		dataflash.ReadBuffer(BUFFER_TO_USE, 0, page_buffer, BYTES_PER_PAGE);
 		for(uint16_t i = 0; i < BYTES_PER_PAGE; i++)
 		{
-			data = SPI.transfer(0xFF);
-			if(data != k) read_buffer_errors++;
+			if(page_buffer[i] != k) read_buffer_errors++;
 			k++;
 		}
 	}
@@ -176,13 +157,12 @@ int main()
 	Serial2.println("    Performing Read via Continuous Array Test.");
 	k = 0;
 	read_array_start = micros();
-	dataflash.ContinuousArrayRead(START_PAGE, 0);
 	for(uint16_t page = START_PAGE; page < (PAGES_TO_TEST + START_PAGE); page++)
 	{
+		dataflash.Read(page, 0, page_buffer, BYTES_PER_PAGE);
 		for(uint16_t i = 0; i < BYTES_PER_PAGE; i++)
 		{
-			data = SPI.transfer(0xFF);
-			if(data != k) read_array_errors++;
+			if(page_buffer[i] != k) read_array_errors++;
 			k++;
 		}
 	}
@@ -195,55 +175,24 @@ int main()
 
 	Serial2.println("    Performing Read via Continuous Array with DMA Test.");
 
-	// Configuring DMA
-	
-	#define SPI_DMA_DEV DMA1
-	#define SPI_RX_DMA_CHANNEL DMA_CH2
-	#define SPI_TX_DMA_CHANNEL DMA_CH3
-	#define SPI_BUFF_SIZE BYTES_PER_PAGE
-	
-	uint8_t dma_rx_spi_buffer[SPI_BUFF_SIZE];
-	uint8_t dma_tx_spi_buffer[SPI_BUFF_SIZE];
-	
-	memset(dma_rx_spi_buffer, 0x00, SPI_BUFF_SIZE);
-	memset(dma_tx_spi_buffer, 0xFF, SPI_BUFF_SIZE);
-	
-	dma_init(SPI_DMA_DEV);
-	spi_rx_dma_enable(SPI1);
-	spi_tx_dma_enable(SPI1);
-	
-	dma_setup_transfer(SPI_DMA_DEV, SPI_RX_DMA_CHANNEL,
-						&SPI1->regs->DR, DMA_SIZE_8BITS,
-						dma_rx_spi_buffer,  DMA_SIZE_8BITS,
-						(DMA_MINC_MODE | DMA_CIRC_MODE | DMA_TRNS_CMPLT)
-						);
-	dma_attach_interrupt(SPI_DMA_DEV, SPI_RX_DMA_CHANNEL, spi_rx_dma_irq);
-	
-	dma_setup_transfer(SPI_DMA_DEV, SPI_TX_DMA_CHANNEL,
-						&SPI1->regs->DR, DMA_SIZE_8BITS,
-						dma_tx_spi_buffer,  DMA_SIZE_8BITS,
-						(DMA_MINC_MODE | DMA_CIRC_MODE| DMA_FROM_MEM)
-						);
-
 	read_array_dma_start = micros();
-
-	// Sending "I want to read" command manually
-	dataflash.ContinuousArrayRead(START_PAGE, 0);
-	
-	// Letting DMA rip!
-	dma_set_num_transfers(SPI_DMA_DEV, SPI_RX_DMA_CHANNEL, SPI_BUFF_SIZE);
-	dma_set_num_transfers(SPI_DMA_DEV, SPI_TX_DMA_CHANNEL, SPI_BUFF_SIZE);
-	pages_to_write = PAGES_TO_TEST;
-	
-	spi_rx_dma_done = false;
-	dma_enable(SPI_DMA_DEV, SPI_TX_DMA_CHANNEL);
-	dma_enable(SPI_DMA_DEV, SPI_RX_DMA_CHANNEL);
-	
-	while(spi_rx_dma_done == false);
-	dma_disable(SPI_DMA_DEV, SPI_TX_DMA_CHANNEL);
-	dma_disable(SPI_DMA_DEV, SPI_RX_DMA_CHANNEL);
-	
+	if(dataflash.ReadDMA(START_PAGE, 0, dma_buffer, PAGES_TO_TEST * BYTES_PER_PAGE))
+	{
+		if(!dataflash.WaitForDMA())
+			Serial2.println("    DMA transfer failed.");
+	}
+	else
+	{
+		Serial2.println("    DMA transfer could not be started.");
+	}
 	read_array_dma_end = micros();
+
+	k = 0;
+	for(uint32_t i = 0; i < PAGES_TO_TEST * BYTES_PER_PAGE; i++)
+	{
+		if(dma_buffer[i] != k) read_array_dma_errors++;
+		k++;
+	}
 	
 	Serial2.println("    Done.\n");
 	
@@ -285,7 +234,7 @@ int main()
 	Serial2.println("Benchmark 5 - Read via Continuous Array with DMA:");
 	Serial2.print("    Time: "); Serial2.print(read_array_dma_time); Serial2.println(" uS.");
 	Serial2.print("    Read: "); Serial2.print(bytes_transfered); Serial2.println(" bytes.");
-	//Serial2.print("    Errors: "); Serial2.print(read_array_errors); Serial2.println(" errors.");
+	Serial2.print("    Errors: "); Serial2.print(read_array_dma_errors); Serial2.println(" errors.");
 	Serial2.print("    Read Speed: "); Serial2.print(calculateDataRate(bytes_transfered, read_array_dma_time)); Serial2.println(" Bps.");
 	Serial2.println();
 
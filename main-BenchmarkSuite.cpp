@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "wirish.h"
+
+#include "at45db161d/at45db161d.h"
+
+/*
+ * Benchmark suite. Sweeps the operation, the transfer size, the number
+ * of pages, the SRAM buffer and the access pattern, and times every
+ * single operation. Each run reports min/p50/p99/max latency and the
+ * throughput, as CSV (default) or JSON when built with BENCH_JSON, so
+ * that runs can be diffed between library versions.
+ */
+
+#define START_PAGE 0
+#define MAX_PAGES 64
+#define MAX_PAGE_SIZE 528
+
+static const uint16_t transfer_sizes[] = { 16, 128, 528 };
+static const uint16_t page_counts[] = { 16, MAX_PAGES };
+
+typedef enum bench_op
+{
+	BENCH_RMW_WRITE,	/* Page to buffer, buffer write, buffer to page with erase */
+	BENCH_BUFFER_READ,	/* Page to buffer, buffer read */
+	BENCH_PAGE_READ,	/* Main memory page read, one SPI transfer per byte */
+	BENCH_ARRAY_READ,	/* Continuous array read */
+	BENCH_DMA_READ,		/* Continuous array read by DMA */
+	BENCH_OP_COUNT
+} bench_op;
+
+static const char *op_names[] = { "rmw_write", "buffer_read", "page_read", "array_read", "dma_read" };
+
+typedef enum bench_pattern
+{
+	BENCH_SEQUENTIAL,
+	BENCH_RANDOM,
+	BENCH_STRIDED,		/* Stride of a block plus one page, visits every page */
+	BENCH_PATTERN_COUNT
+} bench_pattern;
+
+static const char *pattern_names[] = { "sequential", "random", "strided" };
+
+/* Result of one run */
+typedef struct bench_result
+{
+	uint32_t ops;
+	uint32_t bytes;
+	uint32_t errors;
+	uint32_t total;
+	uint32_t min;
+	uint32_t p50;
+	uint32_t p99;
+	uint32_t max;
+} bench_result;
+
+static uint32_t latencies[MAX_PAGES];
+static uint8_t page_buffer[MAX_PAGE_SIZE];
+static uint32_t random_state;
+
+// Force init to be called *first*, i.e. before static object allocation.
+// Otherwise, statically allocated objects that need libmaple may fail.
+__attribute__((constructor)) void premain()
+{
+	init();
+}
+
+/* Content of a byte of the test pages, different on every page */
+static uint8_t pattern_byte(uint16_t page, uint16_t offset)
+{
+	return (uint8_t)(page * 31 + offset * 7 + (offset >> 8));
+}
+
+/* Page of the i-th operation of a run */
+static uint16_t pick_page(bench_pattern pattern, uint32_t i, uint16_t pages)
+{
+	switch(pattern)
+	{
+		case BENCH_RANDOM:
+			random_state = random_state * 1103515245 + 12345;
+			return START_PAGE + (random_state >> 16) % pages;
+
+		case BENCH_STRIDED:
+			return START_PAGE + (i * (DATAFLASH_BLOCK_PAGES + 1)) % pages;
+
+		default:
+			return START_PAGE + i;
+	}
+}
+
+static uint32_t check_bytes(uint16_t page, const uint8_t *data, uint16_t len)
+{
+	uint32_t errors = 0;
+
+	for(uint16_t i = 0; i < len; i++)
+	{
+		if(data[i] != pattern_byte(page, i))
+			errors++;
+	}
+
+	return errors;
+}
+
+static void print_hex8(uint8_t value)
+{
+	if(value < 0x10)
+		Serial2.print('0');
+	Serial2.print(value, HEX);
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile of the sorted latencies */
+static uint32_t percentile(uint32_t n, uint8_t p)
+{
+	uint32_t rank = (n * p + 99) / 100;
+
+	return latencies[rank ? rank - 1 : 0];
+}
+
+/* Time one operation and check what it read */
+static uint32_t run_op(AT45DB161D &dataflash, HardwareSPI &SPI, bench_op op, dataflash_buffer buffer,
+                       uint16_t page, uint16_t size, uint32_t *errors)
+{
+	uint32_t start, end;
+
+	switch(op)
+	{
+		case BENCH_RMW_WRITE:
+			for(uint16_t i = 0; i < size; i++)
+				page_buffer[i] = pattern_byte(page, i);
+
+			start = micros();
+			dataflash.PageToBuffer(page, buffer);
+			dataflash.WriteBuffer(buffer, 0, page_buffer, size);
+			dataflash.BufferToPage(buffer, page, 1);
+			end = micros();
+			return end - start;
+
+		case BENCH_BUFFER_READ:
+			start = micros();
+			dataflash.PageToBuffer(page, buffer);
+			dataflash.ReadBuffer(buffer, 0, page_buffer, size);
+			end = micros();
+			break;
+
+		case BENCH_PAGE_READ:
+			start = micros();
+			dataflash.ReadMainMemoryPage(page, 0);
+			for(uint16_t i = 0; i < size; i++)
+				page_buffer[i] = SPI.transfer(0xFF);
+			dataflash.Disable();
+			end = micros();
+			break;
+
+		case BENCH_ARRAY_READ:
+			start = micros();
+			dataflash.Read(page, 0, page_buffer, size);
+			end = micros();
+			break;
+
+		default:
+			start = micros();
+			if(!dataflash.ReadDMA(page, 0, page_buffer, size) || !dataflash.WaitForDMA())
+				*errors += size;
+			end = micros();
+			break;
+	}
+
+	*errors += check_bytes(page, page_buffer, size);
+	return end - start;
+}
+
+static void run(AT45DB161D &dataflash, HardwareSPI &SPI, bench_op op, dataflash_buffer buffer,
+                uint16_t size, uint16_t pages, bench_pattern pattern, bench_result *result)
+{
+	memset(result, 0, sizeof(*result));
+	random_state = 1;
+
+	for(uint32_t i = 0; i < pages; i++)
+	{
+		uint16_t page = pick_page(pattern, i, pages);
+
+		latencies[i] = run_op(dataflash, SPI, op, buffer, page, size, &result->errors);
+		result->total += latencies[i];
+		result->bytes += size;
+	}
+
+	/* Writes are checked once all done, reading whole pages back */
+	if(op == BENCH_RMW_WRITE)
+	{
+		for(uint16_t page = START_PAGE; page < START_PAGE + pages; page++)
+		{
+			dataflash.Read(page, 0, page_buffer, dataflash.PageSize());
+			result->errors += check_bytes(page, page_buffer, dataflash.PageSize());
+		}
+	}
+
+	qsort(latencies, pages, sizeof(latencies[0]), compare_latency);
+
+	result->ops = pages;
+	result->min = latencies[0];
+	result->p50 = percentile(pages, 50);
+	result->p99 = percentile(pages, 99);
+	result->max = latencies[pages - 1];
+}
+
+static void print_result(bench_op op, uint8_t buffer, uint16_t size, uint16_t pages,
+                         bench_pattern pattern, const bench_result *result, bool first)
+{
+	uint32_t throughput = result->total ? (uint32_t)((uint64_t)result->bytes * 1000000 / result->total) : 0;
+
+#ifdef BENCH_JSON
+	Serial2.print(first ? "  {" : ",\n  {");
+	Serial2.print("\"op\": \""); Serial2.print(op_names[op]);
+	Serial2.print("\", \"size\": "); Serial2.print(size);
+	Serial2.print(", \"pages\": "); Serial2.print(pages);
+	Serial2.print(", \"buffer\": "); Serial2.print(buffer);
+	Serial2.print(", \"pattern\": \""); Serial2.print(pattern_names[pattern]);
+	Serial2.print("\", \"ops\": "); Serial2.print(result->ops);
+	Serial2.print(", \"bytes\": "); Serial2.print(result->bytes);
+	Serial2.print(", \"errors\": "); Serial2.print(result->errors);
+	Serial2.print(", \"min_us\": "); Serial2.print(result->min);
+	Serial2.print(", \"p50_us\": "); Serial2.print(result->p50);
+	Serial2.print(", \"p99_us\": "); Serial2.print(result->p99);
+	Serial2.print(", \"max_us\": "); Serial2.print(result->max);
+	Serial2.print(", \"total_us\": "); Serial2.print(result->total);
+	Serial2.print(", \"throughput_Bps\": "); Serial2.print(throughput);
+	Serial2.print("}");
+#else
+	if(first)
+		Serial2.println("op,size,pages,buffer,pattern,ops,bytes,errors,min_us,p50_us,p99_us,max_us,total_us,throughput_Bps");
+
+	Serial2.print(op_names[op]); Serial2.print(',');
+	Serial2.print(size); Serial2.print(',');
+	Serial2.print(pages); Serial2.print(',');
+	Serial2.print(buffer); Serial2.print(',');
+	Serial2.print(pattern_names[pattern]); Serial2.print(',');
+	Serial2.print(result->ops); Serial2.print(',');
+	Serial2.print(result->bytes); Serial2.print(',');
+	Serial2.print(result->errors); Serial2.print(',');
+	Serial2.print(result->min); Serial2.print(',');
+	Serial2.print(result->p50); Serial2.print(',');
+	Serial2.print(result->p99); Serial2.print(',');
+	Serial2.print(result->max); Serial2.print(',');
+	Serial2.print(result->total); Serial2.print(',');
+	Serial2.println(throughput);
+#endif
+}
+
+int main()
+{
+	HardwareSPI SPI(1);
+	AT45DB161D dataflash(&SPI, 5, 6, 7); // SPI, CS, RST, WP
+
+	AT45DB161D::ID id;
+	bench_result result;
+	bool first = true;
+
+	/* Initialize SPI */
+	SPI.begin(SPI_18MHZ, MSBFIRST, 0);
+
+	/* Let's wait 1 second, allowing use to press the serial monitor button :p */
+	delay(1000);
+
+	dataflash.ReadManufacturerAndDeviceID(&id);
+
+	/*
+	 * Using Serial2 so we don't have to worry about delaying for SerialUSB to be connected to.
+	 */
+	Serial2.begin(115200);
+
+	/*
+	 * Fill the test pages with their pattern
+	 */
+
+	dataflash.BeginStreamWrite(START_PAGE, true);
+	for(uint16_t page = START_PAGE; page < START_PAGE + MAX_PAGES; page++)
+	{
+		for(uint16_t i = 0; i < dataflash.PageSize(); i++)
+			page_buffer[i] = pattern_byte(page, i);
+		dataflash.StreamWrite(page_buffer, dataflash.PageSize());
+	}
+	dataflash.EndStreamWrite();
+
+#ifdef BENCH_JSON
+	Serial2.print("{\"device\": \"0x");
+	print_hex8(id.manufacturer); print_hex8(id.device[0]); print_hex8(id.device[1]);
+	Serial2.print("\", \"page_size\": "); Serial2.print(dataflash.PageSize());
+	Serial2.println(", \"runs\": [");
+#else
+	Serial2.print("# device 0x");
+	print_hex8(id.manufacturer); print_hex8(id.device[0]); print_hex8(id.device[1]);
+	Serial2.print(", page size "); Serial2.println(dataflash.PageSize());
+#endif
+
+	for(uint8_t op = 0; op < BENCH_OP_COUNT; op++)
+	{
+		/* Only the operations going through a buffer depend on which one */
+		uint8_t buffers = (op == BENCH_RMW_WRITE || op == BENCH_BUFFER_READ) ? 2 : 1;
+
+		for(uint8_t b = 1; b <= buffers; b++)
+		for(uint8_t s = 0; s < sizeof(transfer_sizes) / sizeof(transfer_sizes[0]); s++)
+		for(uint8_t c = 0; c < sizeof(page_counts) / sizeof(page_counts[0]); c++)
+		for(uint8_t pattern = 0; pattern < BENCH_PATTERN_COUNT; pattern++)
+		{
+			uint16_t size = transfer_sizes[s];
+
+			if(size > dataflash.PageSize())
+				size = dataflash.PageSize();
+
+			run(dataflash, SPI, (bench_op)op, (dataflash_buffer)b, size, page_counts[c], (bench_pattern)pattern, &result);
+			print_result((bench_op)op, (buffers > 1) ? b : 0, size, page_counts[c], (bench_pattern)pattern, &result, first);
+			first = false;
+		}
+	}
+
+#ifdef BENCH_JSON
+	Serial2.println("\n]}");
+#else
+	Serial2.println("# done");
+#endif
+
+	// Just relax
+	while(1);
+
+	return 0;
+}
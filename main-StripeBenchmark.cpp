@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "wirish.h"
+
+#include "at45db161d/at45db161d_stripe.h"
+
+/*
+ * Striped volume benchmark. Writes the same span of logical pages, with
+ * built-in erase, on volumes of one, two and four chips, and reports
+ * the time taken. The span starts on a page that is not a multiple of
+ * the number of chips and ends within a page. It is then read back with
+ * DataFlashStripe::Read, in chunks crossing page boundaries, and each
+ * logical page is also read from the chip and page it maps to.
+ *
+ * Needs one simulated chip per CS line:
+ *     DATAFLASH_SIM_CS=5,8,9,10 ./main-StripeBenchmark
+ */
+
+#define MAX_CHIPS 4
+
+/* Logical pages of the span, the last one partly written */
+#define START_PAGE 3
+#define SPAN_PAGES 64
+#define SPAN_SHORT 100
+
+/* Bytes per Write and Read call */
+#define CHUNK_SIZE 1000
+
+static uint8_t chunk_buffer[CHUNK_SIZE];
+
+// Force init to be called *first*, i.e. before static object allocation.
+// Otherwise, statically allocated objects that need libmaple may fail.
+__attribute__((constructor)) void premain()
+{
+	init();
+}
+
+/* Content of a byte of the span, different for every volume */
+static uint8_t pattern_byte(uint32_t position, uint8_t chips)
+{
+	return (uint8_t)(position * 7 + (position >> 9) * 13 + chips * 31);
+}
+
+static void print_result(const char *name, uint32_t errors)
+{
+	Serial2.print(name);
+	Serial2.print(": ");
+	Serial2.print(errors);
+	Serial2.println(" errors.");
+}
+
+/* Bytes of the span that read back wrong through the volume */
+static uint32_t check_span(DataFlashStripe &stripe, uint32_t size, uint8_t chips)
+{
+	uint32_t errors = 0;
+	uint16_t pageSize = stripe.PageSize();
+
+	for(uint32_t position = 0; position < size; position += CHUNK_SIZE)
+	{
+		uint32_t len = (size - position < CHUNK_SIZE) ? size - position : CHUNK_SIZE;
+
+		stripe.Read(START_PAGE + position / pageSize, position % pageSize, chunk_buffer, len);
+
+		for(uint32_t i = 0; i < len; i++)
+		{
+			if(chunk_buffer[i] != pattern_byte(position + i, chips))
+				errors++;
+		}
+	}
+
+	return errors;
+}
+
+/*
+ * Logical pages of the span not found on chip n % chips, page n / chips.
+ * The rest of the last page must read as 0xFF.
+ */
+static uint32_t check_chips(AT45DB161D **chips, uint8_t count, uint16_t pageSize, uint32_t size)
+{
+	uint32_t errors = 0;
+
+	for(uint32_t page = START_PAGE; page < START_PAGE + SPAN_PAGES; page++)
+	{
+		AT45DB161D *chip = chips[page % count];
+		uint32_t position = (page - START_PAGE) * pageSize;
+
+		chip->Read(page / count, 0, chunk_buffer, pageSize);
+
+		for(uint16_t i = 0; i < pageSize; i++)
+		{
+			if(chunk_buffer[i] != ((position + i < size) ? pattern_byte(position + i, count) : 0xFF))
+			{
+				errors++;
+				break;
+			}
+		}
+	}
+
+	return errors;
+}
+
+int main()
+{
+	HardwareSPI SPI(1);
+	AT45DB161D chip0(&SPI, 5, 6, 7); // SPI, CS, RST, WP
+	AT45DB161D chip1(&SPI, 8, 6, 7);
+	AT45DB161D chip2(&SPI, 9, 6, 7);
+	AT45DB161D chip3(&SPI, 10, 6, 7);
+	AT45DB161D *chips[MAX_CHIPS] = { &chip0, &chip1, &chip2, &chip3 };
+
+	uint32_t start, elapsed, size, next;
+
+	/* Initialize SPI */
+	SPI.begin(SPI_18MHZ, MSBFIRST, 0);
+	Serial2.begin(115200);
+
+	/* The chips share the bus, none may stay selected */
+	for(uint8_t i = 0; i < MAX_CHIPS; i++)
+		chips[i]->Disable();
+
+	for(uint8_t count = 1; count <= MAX_CHIPS; count *= 2)
+	{
+		DataFlashStripe stripe(chips, count);
+		uint16_t pageSize = stripe.PageSize();
+
+		size = (uint32_t)SPAN_PAGES * pageSize - SPAN_SHORT;
+
+		Serial2.print("Chips: ");
+		Serial2.print(count);
+		Serial2.print(", ");
+		Serial2.print(stripe.PageCount());
+		Serial2.println(" pages.");
+
+		start = micros();
+		stripe.BeginWrite(START_PAGE, 1);
+		for(uint32_t position = 0; position < size; position += CHUNK_SIZE)
+		{
+			uint32_t len = (size - position < CHUNK_SIZE) ? size - position : CHUNK_SIZE;
+
+			for(uint32_t i = 0; i < len; i++)
+				chunk_buffer[i] = pattern_byte(position + i, count);
+
+			stripe.Write(chunk_buffer, len);
+		}
+		next = stripe.EndWrite();
+		elapsed = micros() - start;
+
+		Serial2.print("    Time: ");
+		Serial2.print(elapsed);
+		Serial2.print(" uS, ");
+		Serial2.print((uint32_t)((uint64_t)size * 1000000 / elapsed));
+		Serial2.println(" bytes/s.");
+
+		print_result("    Next page", next != START_PAGE + SPAN_PAGES);
+		print_result("    Read back", check_span(stripe, size, count));
+		print_result("    Chip pages", check_chips(chips, count, pageSize, size));
+	}
+
+	Serial2.println("# done");
+
+	// Just relax
+	while(1);
+
+	return 0;
+}
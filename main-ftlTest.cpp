@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "wirish.h"
+
+#include "at45db161d/at45db161d_ftl.h"
+
+/*
+ * Flash translation layer test. Writes logical pages at random, most of
+ * them to a few hot pages, long enough for blocks to be reclaimed and
+ * for static wear leveling to move the cold pages. Then mounts the
+ * range with a fresh instance and workspace and checks every logical
+ * page, the erase counts and the spread between them, and goes on
+ * writing through the mounted instance.
+ */
+
+/* Range of the translation layer */
+#define FTL_FIRST_PAGE 1000
+#define FTL_PAGES 160
+#define FTL_LOGICAL_PAGES 120
+#define FTL_BLOCKS (FTL_PAGES / DATAFLASH_BLOCK_PAGES)
+
+/* Pages most writes go to */
+#define HOT_PAGES 10
+#define RANDOM_WRITES 4000
+#define MOUNTED_WRITES 300
+
+static uint8_t workspace[DATAFLASH_FTL_WORKSPACE_SIZE(FTL_PAGES, FTL_LOGICAL_PAGES)];
+static uint8_t mount_workspace[DATAFLASH_FTL_WORKSPACE_SIZE(FTL_PAGES, FTL_LOGICAL_PAGES)];
+static uint8_t page_buffer[DATAFLASH_FTL_PAGE_SIZE];
+/* Times each logical page was written, which its content follows */
+static uint8_t versions[FTL_LOGICAL_PAGES];
+static uint32_t random_state;
+
+// Force init to be called *first*, i.e. before static object allocation.
+// Otherwise, statically allocated objects that need libmaple may fail.
+__attribute__((constructor)) void premain()
+{
+	init();
+}
+
+/* Content of a byte of a logical page, different on every write */
+static uint8_t pattern_byte(uint16_t page, uint8_t version, uint16_t offset)
+{
+	return (uint8_t)(page * 13 + offset * 7 + version * 101);
+}
+
+static uint32_t random_number(uint32_t range)
+{
+	random_state = random_state * 1103515245 + 12345;
+	return (random_state >> 16) % range;
+}
+
+/*
+ * Write the next version of a logical page: a whole page, or about one
+ * time in three two spans of it, the second write copying the first
+ * span from the page programmed by the first one.
+ */
+static void write_page(DataFlashFTL &ftl, uint16_t page)
+{
+	uint8_t version = ++versions[page];
+
+	for(uint16_t i = 0; i < DATAFLASH_FTL_PAGE_SIZE; i++)
+		page_buffer[i] = pattern_byte(page, version, i);
+
+	if(random_number(3))
+	{
+		ftl.Write(page, 0, page_buffer, DATAFLASH_FTL_PAGE_SIZE);
+	}
+	else
+	{
+		uint16_t split = 1 + random_number(DATAFLASH_FTL_PAGE_SIZE - 1);
+
+		ftl.Write(page, 0, page_buffer, split);
+		ftl.Write(page, split, page_buffer + split, DATAFLASH_FTL_PAGE_SIZE - split);
+	}
+}
+
+/* Logical pages that differ from the version last written */
+static uint32_t check_pages(DataFlashFTL &ftl)
+{
+	uint32_t errors = 0;
+
+	for(uint16_t page = 0; page < FTL_LOGICAL_PAGES; page++)
+	{
+		ftl.Read(page, 0, page_buffer, DATAFLASH_FTL_PAGE_SIZE);
+
+		for(uint16_t i = 0; i < DATAFLASH_FTL_PAGE_SIZE; i++)
+		{
+			if(page_buffer[i] != pattern_byte(page, versions[page], i))
+			{
+				errors++;
+				break;
+			}
+		}
+	}
+
+	return errors;
+}
+
+static void print_result(const char *name, uint32_t errors)
+{
+	Serial2.print(name);
+	Serial2.print(": ");
+	Serial2.print(errors);
+	Serial2.println(" errors.");
+}
+
+int main()
+{
+	HardwareSPI SPI(1);
+	AT45DB161D dataflash(&SPI, 5, 6, 7); // SPI, CS, RST, WP
+
+	uint32_t errors, start, lowest, highest;
+
+	/* Initialize SPI */
+	SPI.begin(SPI_18MHZ, MSBFIRST, 0);
+	Serial2.begin(115200);
+
+	DataFlashFTL ftl(&dataflash, FTL_FIRST_PAGE, FTL_PAGES, FTL_LOGICAL_PAGES, workspace);
+
+	/*
+	 * Random writes, past the point where blocks get reclaimed
+	 */
+
+	ftl.Format();
+	random_state = 1;
+
+	for(uint16_t page = 0; page < FTL_LOGICAL_PAGES; page++)
+		write_page(ftl, page);
+
+	start = micros();
+	for(uint16_t i = 0; i < RANDOM_WRITES; i++)
+	{
+		/* Four writes out of five go to the hot pages */
+		if(random_number(5))
+			write_page(ftl, random_number(HOT_PAGES));
+		else
+			write_page(ftl, random_number(FTL_LOGICAL_PAGES));
+	}
+	ftl.Sync();
+
+	Serial2.print("Random writes: ");
+	Serial2.print((micros() - start) / RANDOM_WRITES);
+	Serial2.print(" uS per write, ");
+	Serial2.print(ftl.Relocations());
+	Serial2.println(" pages relocated.");
+
+	errors = check_pages(ftl);
+	print_result("Pages before mount", errors);
+
+	/*
+	 * Mount on a fresh instance
+	 */
+
+	DataFlashFTL mounted(&dataflash, FTL_FIRST_PAGE, FTL_PAGES, FTL_LOGICAL_PAGES, mount_workspace);
+
+	start = micros();
+	mounted.Mount();
+	Serial2.print("Mount: ");
+	Serial2.print(micros() - start);
+	Serial2.println(" uS.");
+
+	errors = check_pages(mounted);
+	print_result("Pages after mount", errors);
+
+	/* The counts of the headers match the ones kept in RAM */
+	errors = 0;
+	lowest = 0xFFFFFFFF;
+	highest = 0;
+	for(uint16_t block = 0; block < FTL_BLOCKS; block++)
+	{
+		uint32_t count = mounted.EraseCount(block);
+
+		if(count != ftl.EraseCount(block))
+			errors++;
+		if(count < lowest)
+			lowest = count;
+		if(count > highest)
+			highest = count;
+	}
+	print_result("Erase counts after mount", errors);
+
+	Serial2.print("Erase counts: ");
+	Serial2.print(lowest);
+	Serial2.print(" to ");
+	Serial2.print(highest);
+	Serial2.println(".");
+
+	/* Static wear leveling keeps every block close to the least erased */
+	errors = 0;
+	for(uint16_t block = 0; block < FTL_BLOCKS; block++)
+	{
+		if(mounted.EraseCount(block) - lowest > DATAFLASH_FTL_WEAR_THRESHOLD)
+			errors++;
+	}
+	print_result("Erase count spread", errors);
+
+	/*
+	 * Writes through the mounted instance
+	 */
+
+	for(uint16_t i = 0; i < MOUNTED_WRITES; i++)
+		write_page(mounted, random_number(FTL_LOGICAL_PAGES));
+	mounted.Sync();
+
+	errors = check_pages(mounted);
+	print_result("Pages written after mount", errors);
+
+	Serial2.println("# done");
+
+	// Just relax
+	while(1);
+
+	return 0;
+}
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "wirish.h"
+
+#include "at45db161d/at45db161d_log.h"
+
+/*
+ * Record log test. Appends records across several blocks, then past the
+ * end of the range so that the log wraps around, and mounts the log
+ * with a fresh instance each time: the head must be found again and
+ * Rewind/ReadNext must return every record still held, in order. The
+ * last run stops just after the log has wrapped into its first block,
+ * once the block is erased but before its page is programmed, as a
+ * power loss would.
+ */
+
+/* Range of the log, eight blocks */
+#define LOG_FIRST_PAGE 64
+#define LOG_PAGES 64
+
+/* Records of the run within the range, and of the timed run */
+#define SHORT_RUN_RECORDS 300
+#define TIMED_RUN_RECORDS 2000
+
+static char record[64];
+static char expected[64];
+
+// Force init to be called *first*, i.e. before static object allocation.
+// Otherwise, statically allocated objects that need libmaple may fail.
+__attribute__((constructor)) void premain()
+{
+	init();
+}
+
+/* Text of a record, of one of two lengths */
+static uint16_t make_record(char *dst, uint32_t number)
+{
+	return snprintf(dst, sizeof(record), "record %lu %s", (unsigned long)number,
+	                (number % 3) ? "abc" : "longer payload .....");
+}
+
+static void print_result(const char *name, uint32_t errors)
+{
+	Serial2.print(name);
+	Serial2.print(": ");
+	Serial2.print(errors);
+	Serial2.println(" errors.");
+}
+
+/*
+ * Mount the log with a fresh instance and read it all back. The head
+ * and the next sequence number must be those of the log written, and
+ * the records a run of consecutive numbers ending at last.
+ * @param first Number of the first record expected, or -1 if unknown
+ */
+static uint32_t check_log(AT45DB161D &dataflash, DataFlashLog &written, int32_t first, uint32_t last)
+{
+	DataFlashLog log(&dataflash, LOG_FIRST_PAGE, LOG_PAGES);
+	DataFlashLog::Cursor cursor;
+	uint32_t errors = 0, records = 0, number = 0;
+	int16_t len;
+
+	if(!log.Mount() || !log.Rewind(&cursor))
+		return 1;
+
+	if(log.HeadPage() != written.HeadPage() || log.Sequence() != written.Sequence())
+		errors++;
+
+	while((len = log.ReadNext(&cursor, record, sizeof(record) - 1)) >= 0)
+	{
+		record[len] = 0;
+
+		if(records == 0)
+			number = (first < 0) ? strtoul(record + 7, NULL, 10) : first;
+
+		if(len != make_record(expected, number) || strcmp(record, expected))
+			errors++;
+
+		number++;
+		records++;
+	}
+
+	if(records == 0 || number != last + 1)
+		errors++;
+
+	Serial2.print("Records read back: ");
+	Serial2.print(records);
+	Serial2.print(", up to ");
+	Serial2.print(number - 1);
+	Serial2.print(", head page ");
+	Serial2.print(log.HeadPage());
+	Serial2.println(".");
+
+	return errors;
+}
+
+int main()
+{
+	HardwareSPI SPI(1);
+	AT45DB161D dataflash(&SPI, 5, 6, 7); // SPI, CS, RST, WP
+
+	DataFlashLog log(&dataflash, LOG_FIRST_PAGE, LOG_PAGES);
+	uint32_t number, bytes, start, elapsed;
+	uint16_t len;
+
+	/* Initialize SPI */
+	SPI.begin(SPI_18MHZ, MSBFIRST, 0);
+	Serial2.begin(115200);
+
+	log.Format();
+	print_result("Mount of the empty log", log.Mount());
+
+	/*
+	 * Several blocks, not wrapped around yet
+	 */
+
+	for(number = 0; number < SHORT_RUN_RECORDS; number++)
+	{
+		len = make_record(record, number);
+		log.Append(record, len);
+	}
+	log.Sync();
+
+	print_result("Mount within the range", check_log(dataflash, log, 0, number - 1));
+
+	/*
+	 * Past the end of the range, timed
+	 */
+
+	log.Format();
+	log.Mount();
+
+	bytes = 0;
+	start = micros();
+	for(number = 0; number < TIMED_RUN_RECORDS; number++)
+	{
+		len = make_record(record, number);
+		log.Append(record, len);
+		bytes += DATAFLASH_LOG_LENGTH_SIZE + len;
+	}
+	log.Sync();
+	elapsed = micros() - start;
+
+	Serial2.print("Append: ");
+	Serial2.print(TIMED_RUN_RECORDS);
+	Serial2.print(" records, ");
+	Serial2.print(bytes);
+	Serial2.print(" bytes in ");
+	Serial2.print(elapsed);
+	Serial2.print(" uS, ");
+	Serial2.print((uint32_t)((uint64_t)bytes * 1000000 / elapsed));
+	Serial2.println(" bytes/s.");
+
+	print_result("Mount after a wrap", check_log(dataflash, log, -1, number - 1));
+
+	/*
+	 * Wrapped into the first block, erased but not programmed yet
+	 */
+
+	while(log.HeadPage() != LOG_FIRST_PAGE + LOG_PAGES - 1)
+	{
+		len = make_record(record, number++);
+		log.Append(record, len);
+	}
+
+	/* The record that moved the head sits in a buffer and is lost */
+	dataflash.WaitForOperation();
+
+	print_result("Mount with the first block erased", check_log(dataflash, log, -1, number - 2));
+
+	Serial2.println("# done");
+
+	// Just relax
+	while(1);
+
+	return 0;
+}
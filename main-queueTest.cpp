@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "wirish.h"
+
+#include "at45db161d/at45db161d_queue.h"
+
+/*
+ * Request queue test. Erases a sector through the queue and checks that
+ * the neighbouring sectors, block 0 included, are left alone, and that
+ * a read queued behind the erase sees the erased page.
+ *
+ * Then measures the latency of high priority reads while full page
+ * writes, partial page writes and sector erases keep the queue busy at
+ * low priority. Reads of a page written a moment ago are served from an
+ * SRAM buffer; other reads wait for the operation running, which for a
+ * sector erase is the erase of one of its blocks.
+ */
+
+/* Page of sector 10, whose number is also the one of sector 0a */
+#define ERASE_PAGE 2600
+/* Page of sector 11, likewise for sector 0b */
+#define KEEP_PAGE 2900
+
+/* Pages read as old ones, also rewritten in part */
+#define OLD_PAGES 64
+/* Pages rewritten in full, in turn */
+#define WRITE_FIRST 100
+#define WRITE_LAST 160
+/* Page of the sector erased now and then */
+#define BUSY_ERASE_PAGE 1300
+/* Writes kept queued */
+#define WRITE_SLOTS 4
+/* Bytes rewritten by a partial write */
+#define PARTIAL_OFFSET 100
+#define PARTIAL_LEN 64
+
+#define LATENCY_RUN_US 3000000
+#define READ_INTERVAL_US 1000
+#define ERASE_INTERVAL_US 700000
+#define MAX_READS 2000
+
+typedef enum read_kind
+{
+	READ_OLD = 0,
+	READ_RECENT,
+	READ_KINDS
+} read_kind;
+
+static const char *read_kind_names[] = { "Old page reads", "Recent page reads" };
+
+static uint8_t page_buffer[528];
+static uint8_t write_buffers[WRITE_SLOTS][528];
+static uint32_t latencies[READ_KINDS][MAX_READS];
+static uint32_t latency_count[READ_KINDS];
+static uint32_t random_state;
+
+// Force init to be called *first*, i.e. before static object allocation.
+// Otherwise, statically allocated objects that need libmaple may fail.
+__attribute__((constructor)) void premain()
+{
+	init();
+}
+
+/* Content of a byte of the test pages, different on every page */
+static uint8_t pattern_byte(uint16_t page, uint16_t offset)
+{
+	return (uint8_t)(page * 13 + offset * 7);
+}
+
+static void write_page(AT45DB161D &dataflash, uint16_t page)
+{
+	for(uint16_t i = 0; i < dataflash.PageSize(); i++)
+		page_buffer[i] = pattern_byte(page, i);
+
+	dataflash.WriteBuffer(DATAFLASH_BUFFER1, 0, page_buffer, dataflash.PageSize());
+	dataflash.BufferToPage(DATAFLASH_BUFFER1, page, 1);
+}
+
+/* Bytes of a page that differ from its pattern, or from 0xFF if erased */
+static uint32_t check_page(AT45DB161D &dataflash, uint16_t page, bool erased)
+{
+	uint32_t errors = 0;
+
+	dataflash.Read(page, 0, page_buffer, dataflash.PageSize());
+
+	for(uint16_t i = 0; i < dataflash.PageSize(); i++)
+	{
+		if(page_buffer[i] != (erased ? 0xFF : pattern_byte(page, i)))
+			errors++;
+	}
+
+	return errors;
+}
+
+static void print_result(const char *name, uint32_t errors)
+{
+	Serial2.print(name);
+	Serial2.print(": ");
+	Serial2.print(errors);
+	Serial2.println(" errors.");
+}
+
+static void wait_idle(DataFlashQueue &queue)
+{
+	while(!queue.Idle())
+	{
+		queue.Service();
+		delayMicroseconds(100);
+	}
+}
+
+static uint16_t random_page(uint16_t pages)
+{
+	random_state = random_state * 1103515245 + 12345;
+	return (random_state >> 16) % pages;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile of sorted latencies */
+static uint32_t percentile(const uint32_t *sorted, uint32_t n, uint8_t p)
+{
+	uint32_t rank = (n * p + 99) / 100;
+
+	return sorted[rank ? rank - 1 : 0];
+}
+
+static void print_latency(read_kind kind)
+{
+	uint32_t n = latency_count[kind];
+
+	qsort(latencies[kind], n, sizeof(latencies[kind][0]), compare_latency);
+
+	Serial2.print(read_kind_names[kind]);
+	Serial2.print(": ");
+	Serial2.print(n);
+	if(n)
+	{
+		Serial2.print(", p50 ");
+		Serial2.print(percentile(latencies[kind], n, 50));
+		Serial2.print(" us, p99 ");
+		Serial2.print(percentile(latencies[kind], n, 99));
+		Serial2.print(" us, max ");
+		Serial2.print(latencies[kind][n - 1]);
+		Serial2.print(" us");
+	}
+	Serial2.println(".");
+}
+
+/* Queue the next write of a slot, every fourth one a partial page write */
+static void submit_write(DataFlashQueue &queue, DataFlashQueue::Request *request, uint8_t *data,
+                         uint16_t page, bool partial, uint16_t pageSize)
+{
+	request->type = DATAFLASH_REQUEST_WRITE;
+	request->priority = 0;
+	request->page = page;
+	request->offset = partial ? PARTIAL_OFFSET : 0;
+	request->len = partial ? PARTIAL_LEN : pageSize;
+	request->data = data;
+	request->handler = NULL;
+
+	for(uint16_t i = 0; i < request->len; i++)
+		data[i] = pattern_byte(page, request->offset + i);
+
+	queue.Submit(request);
+}
+
+int main()
+{
+	HardwareSPI SPI(1);
+	AT45DB161D dataflash(&SPI, 5, 6, 7); // SPI, CS, RST, WP
+
+	DataFlashQueue::Request erase, read;
+	DataFlashQueue::Request writes[WRITE_SLOTS];
+	uint32_t errors, failures, writeCount, partialCount;
+	uint32_t end, nextRead, nextErase, readStart;
+	uint16_t nextWrite, readPage;
+	int32_t lastWritten;
+	read_kind kind;
+	bool reading;
+
+	/* Initialize SPI */
+	SPI.begin(SPI_18MHZ, MSBFIRST, 0);
+	Serial2.begin(115200);
+
+	/*
+	 * Sector erase: block 0 and sector 11 keep their data
+	 */
+
+	for(uint16_t page = 0; page < DATAFLASH_BLOCK_PAGES; page++)
+		write_page(dataflash, page);
+	write_page(dataflash, ERASE_PAGE);
+	write_page(dataflash, KEEP_PAGE);
+
+	DataFlashQueue queue(&dataflash);
+
+	erase.type = DATAFLASH_REQUEST_ERASE_SECTOR;
+	erase.priority = 0;
+	erase.page = ERASE_PAGE;
+	erase.handler = NULL;
+
+	/* Queued behind the erase of the same pages, so it must wait for it */
+	read.type = DATAFLASH_REQUEST_READ;
+	read.priority = 0;
+	read.page = ERASE_PAGE;
+	read.offset = 0;
+	read.data = page_buffer;
+	read.len = dataflash.PageSize();
+	read.handler = NULL;
+
+	queue.Submit(&erase);
+	queue.Submit(&read);
+	wait_idle(queue);
+
+	errors = (erase.status != DATAFLASH_REQUEST_DONE) + (read.status != DATAFLASH_REQUEST_DONE);
+	for(uint16_t i = 0; i < dataflash.PageSize(); i++)
+	{
+		if(page_buffer[i] != 0xFF)
+			errors++;
+	}
+	print_result("Queued read of the erased sector", errors);
+
+	errors = check_page(dataflash, ERASE_PAGE, true);
+	print_result("Sector 10 erased", errors);
+
+	errors = 0;
+	for(uint16_t page = 0; page < DATAFLASH_BLOCK_PAGES; page++)
+		errors += check_page(dataflash, page, false);
+	print_result("Block 0 kept", errors);
+
+	errors = check_page(dataflash, KEEP_PAGE, false);
+	print_result("Sector 11 kept", errors);
+
+	/*
+	 * Read latency with writes and erases queued
+	 */
+
+	for(uint16_t page = 0; page < OLD_PAGES; page++)
+		write_page(dataflash, page);
+
+	random_state = 1;
+	errors = 0;
+	failures = 0;
+	writeCount = 0;
+	partialCount = 0;
+	nextWrite = WRITE_FIRST;
+	lastWritten = -1;
+	reading = false;
+	kind = READ_OLD;
+	readPage = 0;
+	readStart = 0;
+
+	erase.status = DATAFLASH_REQUEST_DONE;
+	for(uint8_t slot = 0; slot < WRITE_SLOTS; slot++)
+	{
+		writes[slot].status = DATAFLASH_REQUEST_DONE;
+		writes[slot].len = 0;
+	}
+
+	end = micros() + LATENCY_RUN_US;
+	nextRead = micros();
+	nextErase = micros() + ERASE_INTERVAL_US / 2;
+
+	while((int32_t)(micros() - end) < 0)
+	{
+		for(uint8_t slot = 0; slot < WRITE_SLOTS; slot++)
+		{
+			DataFlashQueue::Request *request = &writes[slot];
+
+			if(request->status < DATAFLASH_REQUEST_DONE)
+				continue;
+
+			if(request->status == DATAFLASH_REQUEST_FAILED)
+				failures++;
+			else if(request->len == dataflash.PageSize())
+				lastWritten = request->page;
+
+			/* Partial writes go to old pages, whose other bytes must stay */
+			if(writeCount % 4 == 3)
+			{
+				submit_write(queue, request, write_buffers[slot], random_page(OLD_PAGES), true, dataflash.PageSize());
+				partialCount++;
+			}
+			else
+			{
+				submit_write(queue, request, write_buffers[slot], nextWrite, false, dataflash.PageSize());
+				if(++nextWrite > WRITE_LAST)
+					nextWrite = WRITE_FIRST;
+			}
+			writeCount++;
+		}
+
+		if(erase.status >= DATAFLASH_REQUEST_DONE && (int32_t)(micros() - nextErase) >= 0)
+		{
+			if(erase.status == DATAFLASH_REQUEST_FAILED)
+				failures++;
+
+			erase.type = DATAFLASH_REQUEST_ERASE_SECTOR;
+			erase.priority = 0;
+			erase.page = BUSY_ERASE_PAGE;
+			erase.handler = NULL;
+			queue.Submit(&erase);
+			nextErase = micros() + ERASE_INTERVAL_US;
+		}
+
+		if(!reading && (int32_t)(micros() - nextRead) >= 0)
+		{
+			/* Half of the reads are of the page written last */
+			kind = (random_page(2) && lastWritten >= 0) ? READ_RECENT : READ_OLD;
+			readPage = (kind == READ_RECENT) ? lastWritten : random_page(OLD_PAGES);
+
+			read.type = DATAFLASH_REQUEST_READ;
+			read.priority = 10;
+			read.page = readPage;
+			read.offset = 0;
+			read.data = page_buffer;
+			read.len = dataflash.PageSize();
+			read.handler = NULL;
+
+			readStart = micros();
+			reading = true;
+			queue.Submit(&read);
+		}
+
+		if(reading && read.status >= DATAFLASH_REQUEST_DONE)
+		{
+			uint32_t latency = micros() - readStart;
+
+			reading = false;
+			nextRead = micros() + READ_INTERVAL_US;
+
+			if(read.status == DATAFLASH_REQUEST_FAILED)
+				failures++;
+
+			for(uint16_t i = 0; i < dataflash.PageSize(); i++)
+			{
+				if(page_buffer[i] != pattern_byte(readPage, i))
+				{
+					errors++;
+					break;
+				}
+			}
+
+			if(latency_count[kind] < MAX_READS)
+				latencies[kind][latency_count[kind]++] = latency;
+		}
+
+		queue.Service();
+
+		/* Simulated time only moves on when the bus is left alone */
+		if(dataflash.DMAStatus() != DATAFLASH_DMA_BUSY)
+			delayMicroseconds(20);
+	}
+
+	wait_idle(queue);
+
+	print_latency(READ_OLD);
+	print_latency(READ_RECENT);
+
+	Serial2.print("Writes: ");
+	Serial2.print(writeCount);
+	Serial2.print(", ");
+	Serial2.print(partialCount);
+	Serial2.println(" of part of a page.");
+
+	print_result("Reads under load", errors);
+	print_result("Failed requests", failures);
+
+	errors = 0;
+	for(uint16_t page = 0; page < OLD_PAGES; page++)
+		errors += check_page(dataflash, page, false);
+	print_result("Old pages kept by partial writes", errors);
+
+	Serial2.println("# done");
+
+	// Just relax
+	while(1);
+
+	return 0;
+}